@@ -120,6 +120,9 @@
 /* Define to 1 if you have the <mntent.h> header file. */
 #define HAVE_MNTENT_H 1
 
+/* Define to 1 if you have the `pwritev' function. */
+#define HAVE_PWRITEV 1
+
 /* Define to 1 if you have the <scsi/sg.h> header file. */
 #define HAVE_SCSI_SG_H 1
 
@@ -159,6 +162,9 @@
 /* Define to 1 if you have the <sys/types.h> header file. */
 #define HAVE_SYS_TYPES_H 1
 
+/* Define to 1 if you have the <sys/uio.h> header file. */
+#define HAVE_SYS_UIO_H 1
+
 /* Define to 1 if you have the <sys/utsname.h> header file. */
 #define HAVE_SYS_UTSNAME_H 1
 
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * access_profile.c
+ *
+ * Access-profile driven placement of sload. The profile is a boot trace
+ * listing one path per line, optionally followed by the offset read, in
+ * the order the files were accessed.
+ *
+ * Regular files of the profile get their directory entries as usual, but
+ * their inodes are kept in memory instead of being written. Once the rest
+ * of the tree is built, the inodes are written in the order of first
+ * access from a free node section, then the files are built in the same
+ * order from a free data section, so reading them at boot takes a few
+ * sequential runs of blocks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "access_profile.h"
+
+struct profile_path {
+	char *path;
+	u32 rank;		/* line of the first access */
+};
+
+static struct profile_path *paths;
+static u32 nr_paths;
+
+static struct profile_file *files;
+static u32 nr_files, max_files;
+
+static int cmp_path(const void *a, const void *b)
+{
+	const struct profile_path *pa = a, *pb = b;
+	int ret = strcmp(pa->path, pb->path);
+
+	if (ret)
+		return ret;
+	return pa->rank < pb->rank ? -1 : pa->rank > pb->rank;
+}
+
+static int cmp_rank(const void *a, const void *b)
+{
+	const struct profile_file *fa = a, *fb = b;
+
+	return fa->de.profile < fb->de.profile ? -1 :
+				fa->de.profile > fb->de.profile;
+}
+
+int profile_load(const char *path)
+{
+	size_t len = 0, mlen = 0;
+	u32 max_paths = 0, rank = 0, i, j;
+	char *line = NULL, *p;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	/* a trace of the running system has the mount point in its paths */
+	if (strcmp(c.mount_point, "/"))
+		mlen = strlen(c.mount_point);
+	if (mlen && c.mount_point[mlen - 1] == '/')
+		mlen--;
+
+	while (getline(&line, &len, fp) != -1) {
+		rank++;
+		p = line + strspn(line, " \t");
+		p[strcspn(p, " \t\r\n")] = '\0';
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		if (mlen && !strncmp(p, c.mount_point, mlen) && p[mlen] == '/')
+			p += mlen;
+		if (*p != '/') {
+			MSG(1, "Skip profile line %u: %s\n", rank, p);
+			continue;
+		}
+
+		if (nr_paths == max_paths) {
+			max_paths = max_paths ? max_paths * 2 : 256;
+			paths = realloc(paths, max_paths * sizeof(*paths));
+			ASSERT(paths);
+		}
+		paths[nr_paths].path = strdup(p);
+		ASSERT(paths[nr_paths].path);
+		paths[nr_paths++].rank = rank;
+	}
+	free(line);
+	fclose(fp);
+
+	/* keep the first access of each path */
+	qsort(paths, nr_paths, sizeof(*paths), cmp_path);
+	for (i = 0, j = 0; i < nr_paths; i++) {
+		if (j && !strcmp(paths[j - 1].path, paths[i].path)) {
+			free(paths[i].path);
+			continue;
+		}
+		paths[j++] = paths[i];
+	}
+	nr_paths = j;
+
+	MSG(0, "Info: %u files in the access profile\n", nr_paths);
+	return 0;
+}
+
+/* return the rank of @path in the profile, 0 if it is not there */
+u32 profile_rank(const char *path)
+{
+	u32 lo = 0, hi = nr_paths;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		int ret = strcmp(paths[mid].path, path);
+
+		if (!ret)
+			return paths[mid].rank;
+		if (ret < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+void profile_defer(struct dentry *de, struct f2fs_node *inode, u32 version)
+{
+	struct profile_file *pf;
+
+	if (nr_files == max_files) {
+		max_files = max_files ? max_files * 2 : 64;
+		files = realloc(files, max_files * sizeof(*files));
+		ASSERT(files);
+	}
+
+	pf = files + nr_files++;
+	pf->de = *de;
+	pf->de.path = strdup(de->path);
+	pf->de.full_path = strdup(de->full_path);
+	pf->de.name = (u8 *)strdup((const char *)de->name);
+	ASSERT(pf->de.path && pf->de.full_path && pf->de.name);
+	pf->de.data = NULL;
+	pf->inode = inode;
+	pf->version = version;
+}
+
+/*
+ * Write the inodes of the deferred files in profile order and return the
+ * files, which are then to be built in the same order.
+ */
+int profile_place(struct f2fs_sb_info *sbi, struct profile_file **out)
+{
+	struct f2fs_summary sum;
+	block_t blkaddr;
+	u32 i;
+	int ret;
+
+	*out = files;
+	if (!nr_files)
+		return 0;
+
+	qsort(files, nr_files, sizeof(*files), cmp_rank);
+
+	if (start_fresh_section(sbi, CURSEG_HOT_NODE))
+		MSG(1, "No free section for the profiled inodes\n");
+
+	for (i = 0; i < nr_files; i++) {
+		struct profile_file *pf = files + i;
+
+		blkaddr = NULL_ADDR;
+		set_summary(&sum, pf->de.ino, 0, pf->version);
+		ret = reserve_new_block(sbi, &blkaddr, &sum, CURSEG_HOT_NODE, 1);
+		ASSERT(!ret);
+
+		update_nat_blkaddr(sbi, pf->de.ino, pf->de.ino, blkaddr);
+
+		ret = dev_write_block(pf->inode, blkaddr);
+		ASSERT(ret >= 0);
+
+		free(pf->inode);
+		pf->inode = NULL;
+		MSG(1, "Info: Place %s ino=%x rank=%u at %x\n",
+				pf->de.path, pf->de.ino, pf->de.profile,
+				blkaddr);
+	}
+	update_free_segments(sbi);
+
+	if (start_fresh_section(sbi, CURSEG_WARM_DATA))
+		MSG(1, "No free section for the profiled data\n");
+
+	MSG(0, "Info: Place %u profiled files\n", nr_files);
+	return nr_files;
+}
+
+void profile_exit(void)
+{
+	u32 i;
+
+	for (i = 0; i < nr_paths; i++)
+		free(paths[i].path);
+	free(paths);
+	paths = NULL;
+	nr_paths = 0;
+
+	for (i = 0; i < nr_files; i++) {
+		free(files[i].de.path);
+		free(files[i].de.full_path);
+		free((void *)files[i].de.name);
+		free(files[i].inode);
+	}
+	free(files);
+	files = NULL;
+	nr_files = max_files = 0;
+}
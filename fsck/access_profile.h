@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * access_profile.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _ACCESS_PROFILE_H_
+#define _ACCESS_PROFILE_H_
+
+#include "fsck.h"
+
+/* a regular file of the profile, built after the rest of the tree */
+struct profile_file {
+	struct dentry de;		/* path, full_path and name are owned */
+	struct f2fs_node *inode;	/* not written until placed */
+	u32 version;			/* for the summary of the inode */
+};
+
+int profile_load(const char *path);
+u32 profile_rank(const char *path);
+void profile_defer(struct dentry *de, struct f2fs_node *inode, u32 version);
+int profile_place(struct f2fs_sb_info *sbi, struct profile_file **files);
+void profile_exit(void);
+#endif /* _ACCESS_PROFILE_H_ */
@@ -14,11 +14,16 @@
 #include "f2fs.h"
 
 #include "compress.h"
+#include <pthread.h>
 #ifdef HAVE_LIBLZO2
 #include <lzo/lzo1x.h>	/* for lzo1x_1_15_compress() */
 #endif
 #ifdef HAVE_LIBLZ4
 #include <lz4.h>	/* for LZ4_compress_fast_extState() */
+#include <lz4hc.h>	/* for LZ4_compress_HC_extStateHC() */
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>	/* for ZSTD_compressCCtx() */
 #endif
 
 /*
@@ -35,9 +40,13 @@
 #define LZ4_MEM_COMPRESS		sizeof(LZ4_stream_t)
 #define LZ4_ACCELERATION_DEFAULT	1
 #define LZ4_WORK_SIZE			ALIGN_UP(LZ4_MEM_COMPRESS, 8)
+#define LZ4HC_WORK_SIZE			ALIGN_UP(LZ4_sizeofStateHC(), 8)
+#endif
+#ifdef HAVE_LIBZSTD
+#define ZSTD_WORK_SIZE			ALIGN_UP(sizeof(ZSTD_CCtx *), 8)
 #endif
 
-#if defined(HAVE_LIBLZO2) || defined(HAVE_LIBLZ4)
+#if defined(HAVE_LIBLZO2) || defined(HAVE_LIBLZ4) || defined(HAVE_LIBZSTD)
 static void reset_cc(struct compress_ctx *cc)
 {
 	memset(cc->rbuf, 0, cc->cluster_size * F2FS_BLKSIZE);
@@ -71,21 +80,29 @@ static int lzo_compress(struct compress_ctx *cc)
 static void lz4_compress_init(struct compress_ctx *cc)
 {
 	size_t size = cc->cluster_size * F2FS_BLKSIZE;
+	size_t work = c.compress.level ? LZ4HC_WORK_SIZE : LZ4_WORK_SIZE;
 	size_t alloc = size + LZ4_COMPRESSBOUND(size)
-			+ COMPRESS_HEADER_SIZE + LZ4_WORK_SIZE;
+			+ COMPRESS_HEADER_SIZE + work;
 	cc->private = malloc(alloc);
 	ASSERT(cc->private);
-	cc->rbuf = (char *) cc->private + LZ4_WORK_SIZE;
+	cc->rbuf = (char *) cc->private + work;
 	cc->cbuf = (struct compress_data *)((char *) cc->rbuf + size);
 }
 
 static int lz4_compress(struct compress_ctx *cc)
 {
-	cc->clen = LZ4_compress_fast_extState(cc->private, cc->rbuf,
-			(char *)cc->cbuf->cdata, cc->rlen,
-			cc->rlen - F2FS_BLKSIZE * c.compress.min_blocks -
-			COMPRESS_HEADER_SIZE,
-			LZ4_ACCELERATION_DEFAULT);
+	int dst_size = cc->rlen - F2FS_BLKSIZE * c.compress.min_blocks -
+			COMPRESS_HEADER_SIZE;
+
+	/* a level given to lz4 means lz4hc, as in the kernel */
+	if (c.compress.level)
+		cc->clen = LZ4_compress_HC_extStateHC(cc->private, cc->rbuf,
+				(char *)cc->cbuf->cdata, cc->rlen, dst_size,
+				c.compress.level);
+	else
+		cc->clen = LZ4_compress_fast_extState(cc->private, cc->rbuf,
+				(char *)cc->cbuf->cdata, cc->rlen, dst_size,
+				LZ4_ACCELERATION_DEFAULT);
 
 	if (!cc->clen)
 		return 1;
@@ -95,25 +112,334 @@ static int lz4_compress(struct compress_ctx *cc)
 }
 #endif
 
+#ifdef HAVE_LIBZSTD
+static void zstd_compress_init(struct compress_ctx *cc)
+{
+	size_t size = cc->cluster_size * F2FS_BLKSIZE;
+	size_t alloc = size + ZSTD_compressBound(size)
+			+ COMPRESS_HEADER_SIZE + ZSTD_WORK_SIZE;
+	cc->private = malloc(alloc);
+	ASSERT(cc->private);
+	*(ZSTD_CCtx **)cc->private = ZSTD_createCCtx();
+	ASSERT(*(ZSTD_CCtx **)cc->private);
+	cc->rbuf = (char *) cc->private + ZSTD_WORK_SIZE;
+	cc->cbuf = (struct compress_data *)((char *) cc->rbuf + size);
+}
+
+/*
+ * The size of a cluster is given, so the window never exceeds it, which is
+ * what the kernel allows for decompression.
+ */
+static int zstd_compress(struct compress_ctx *cc)
+{
+	size_t ret = ZSTD_compressCCtx(*(ZSTD_CCtx **)cc->private,
+			cc->cbuf->cdata, cc->rlen -
+			F2FS_BLKSIZE * c.compress.min_blocks -
+			COMPRESS_HEADER_SIZE, cc->rbuf, cc->rlen,
+			c.compress.level ? c.compress.level :
+			F2FS_ZSTD_DEFAULT_CLEVEL);
+
+	if (ZSTD_isError(ret))
+		return 1;
+
+	cc->clen = ret;
+	cc->cbuf->clen = cpu_to_le32(cc->clen);
+	return 0;
+}
+
+static void zstd_compress_exit(struct compress_ctx *cc)
+{
+	ZSTD_freeCCtx(*(ZSTD_CCtx **)cc->private);
+	*(ZSTD_CCtx **)cc->private = NULL;
+}
+#endif
+
 const char *supported_comp_names[] = {
 	"lzo",
 	"lz4",
+	"zstd",
 	"",
 };
 
 compress_ops supported_comp_ops[] = {
 #ifdef HAVE_LIBLZO2
-	{lzo_compress_init, lzo_compress, reset_cc},
+	{lzo_compress_init, lzo_compress, reset_cc, NULL},
 #else
-	{NULL, NULL, NULL},
+	{NULL, NULL, NULL, NULL},
 #endif
 #ifdef HAVE_LIBLZ4
-	{lz4_compress_init, lz4_compress, reset_cc},
+	{lz4_compress_init, lz4_compress, reset_cc, NULL},
 #else
-	{NULL, NULL, NULL},
+	{NULL, NULL, NULL, NULL},
+#endif
+#ifdef HAVE_LIBZSTD
+	{zstd_compress_init, zstd_compress, reset_cc, zstd_compress_exit},
+#else
+	{NULL, NULL, NULL, NULL},
 #endif
 };
 
+/*
+ * Parse "<algorithm>[:<level>]", where lz4hc stands for lz4 with a level,
+ * as the compress_algorithm mount option of the kernel does.
+ */
+int parse_compress_alg(const char *arg, enum compress_algorithms *alg,
+						unsigned int *level)
+{
+	const char *sep = strchr(arg, ':');
+	size_t len = sep ? (size_t)(sep - arg) : strlen(arg);
+	bool hc = false;
+	unsigned int i;
+	char *end;
+	long val = 0;
+
+	if (len == strlen("lz4hc") && !strncmp(arg, "lz4hc", len)) {
+		hc = true;
+		len = strlen("lz4");
+	}
+	for (i = 0; i < MAX_COMPRESS_ALGS; i++)
+		if (strlen(supported_comp_names[i]) == len &&
+				!strncmp(supported_comp_names[i], arg, len))
+			break;
+	if (i == MAX_COMPRESS_ALGS)
+		return -EINVAL;
+
+	if (sep) {
+		val = strtol(sep + 1, &end, 10);
+		if (!sep[1] || *end || val <= 0)
+			return -EINVAL;
+	} else if (hc) {
+		val = F2FS_LZ4HC_DEFAULT_CLEVEL;
+	}
+
+	switch (i) {
+	case COMPR_LZO:
+		if (val)
+			return -EINVAL;
+		break;
+	case COMPR_LZ4:
+		if (val && (val < F2FS_LZ4HC_MIN_CLEVEL ||
+					val > F2FS_LZ4HC_MAX_CLEVEL))
+			return -EINVAL;
+		break;
+	case COMPR_ZSTD:
+		if (val > F2FS_ZSTD_MAX_CLEVEL)
+			return -EINVAL;
+		break;
+	}
+	*alg = i;
+	*level = val;
+	return 0;
+}
+
+/*
+ * Compression window of sload. The writer reads clusters of a file into
+ * free slots and submits them in file order; worker threads compress them
+ * meanwhile, and the writer takes the results back in the same order. With
+ * no worker, clusters are compressed on submit. At most nr_slots clusters
+ * are read ahead, which bounds the memory used.
+ */
+enum {
+	SLOT_FREE,
+	SLOT_QUEUED,
+	SLOT_RUNNING,
+	SLOT_DONE,
+};
+
+static struct {
+	struct compress_slot *slots;
+	unsigned int nr_slots;
+	unsigned int head;		/* oldest slot submitted */
+	unsigned int tail;		/* next slot to submit */
+	pthread_t threads[COMPRESS_MAX_THREADS];
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	bool quit;
+} cpool;
+
+static void compress_slot(struct compress_slot *slot, bool skip)
+{
+	struct compress_ctx *cc = &slot->cc;
+	size_t csize;
+
+	/* a short cluster is always written as is */
+	if (skip || slot->len < cc->rlen) {
+		slot->ret = 1;
+		return;
+	}
+
+	slot->ret = c.compress.ops->compress(cc);
+	if (slot->ret)
+		return;
+
+	/* leave no stale bytes of an earlier try in the last block */
+	csize = ALIGN_UP(cc->clen + COMPRESS_HEADER_SIZE, F2FS_BLKSIZE);
+	if (csize < cc->rlen)
+		memset(cc->cbuf->cdata + cc->clen, 0,
+				csize - COMPRESS_HEADER_SIZE - cc->clen);
+}
+
+static void *compress_worker(void *UNUSED(arg))
+{
+	struct compress_slot *slot;
+	unsigned int i;
+
+	pthread_mutex_lock(&cpool.lock);
+	while (!cpool.quit) {
+		slot = NULL;
+		for (i = cpool.head; i != cpool.tail; i++) {
+			if (cpool.slots[i % cpool.nr_slots].state ==
+							SLOT_QUEUED) {
+				slot = cpool.slots + i % cpool.nr_slots;
+				break;
+			}
+		}
+		if (!slot) {
+			pthread_cond_wait(&cpool.work, &cpool.lock);
+			continue;
+		}
+		slot->state = SLOT_RUNNING;
+		pthread_mutex_unlock(&cpool.lock);
+
+		compress_slot(slot, false);
+
+		pthread_mutex_lock(&cpool.lock);
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&cpool.done);
+	}
+	pthread_mutex_unlock(&cpool.lock);
+	return NULL;
+}
+
+int compress_pool_init(int nr_threads)
+{
+	struct compress_slot *slot;
+	unsigned int i;
+
+	if (nr_threads > COMPRESS_MAX_THREADS)
+		nr_threads = COMPRESS_MAX_THREADS;
+	if (nr_threads < 0)
+		nr_threads = 0;
+
+	memset(&cpool, 0, sizeof(cpool));
+	cpool.nr_slots = nr_threads ?
+			nr_threads * COMPRESS_SLOTS_PER_THREAD : 1;
+	cpool.slots = calloc(cpool.nr_slots, sizeof(struct compress_slot));
+	if (!cpool.slots)
+		return -ENOMEM;
+
+	for (i = 0; i < cpool.nr_slots; i++) {
+		slot = cpool.slots + i;
+		slot->cc.cluster_size = c.compress.cc.cluster_size;
+		slot->cc.log_cluster_size = c.compress.cc.log_cluster_size;
+		slot->cc.rlen = c.compress.cc.rlen;
+		c.compress.ops->init(&slot->cc);
+		c.compress.ops->reset(&slot->cc);
+		memset(slot->cc.cbuf, 0, COMPRESS_HEADER_SIZE);
+	}
+
+	pthread_mutex_init(&cpool.lock, NULL);
+	pthread_cond_init(&cpool.work, NULL);
+	pthread_cond_init(&cpool.done, NULL);
+	for (i = 0; i < (unsigned int)nr_threads; i++) {
+		if (pthread_create(&cpool.threads[i], NULL,
+					compress_worker, NULL)) {
+			MSG(0, "\tWarning: %u of %d compression threads "
+					"started\n", i, nr_threads);
+			break;
+		}
+	}
+	cpool.nr_threads = i;
+	return 0;
+}
+
+void compress_pool_exit(void)
+{
+	unsigned int i;
+
+	if (!cpool.slots)
+		return;
+
+	pthread_mutex_lock(&cpool.lock);
+	cpool.quit = true;
+	pthread_cond_broadcast(&cpool.work);
+	pthread_mutex_unlock(&cpool.lock);
+	for (i = 0; i < (unsigned int)cpool.nr_threads; i++)
+		pthread_join(cpool.threads[i], NULL);
+
+	pthread_cond_destroy(&cpool.done);
+	pthread_cond_destroy(&cpool.work);
+	pthread_mutex_destroy(&cpool.lock);
+
+	for (i = 0; i < cpool.nr_slots; i++) {
+		if (c.compress.ops->exit)
+			c.compress.ops->exit(&cpool.slots[i].cc);
+		free(cpool.slots[i].cc.private);
+	}
+	free(cpool.slots);
+	cpool.slots = NULL;
+}
+
+/* a free slot to read the next cluster into, NULL if the window is full */
+struct compress_slot *compress_slot_get(void)
+{
+	if (cpool.tail - cpool.head == cpool.nr_slots)
+		return NULL;
+	return cpool.slots + cpool.tail % cpool.nr_slots;
+}
+
+void compress_slot_submit(struct compress_slot *slot, bool skip)
+{
+	ASSERT(slot == cpool.slots + cpool.tail % cpool.nr_slots);
+
+	if (!cpool.nr_threads) {
+		compress_slot(slot, skip);
+		slot->state = SLOT_DONE;
+		cpool.tail++;
+		return;
+	}
+
+	if (skip)
+		compress_slot(slot, true);
+	pthread_mutex_lock(&cpool.lock);
+	slot->state = skip ? SLOT_DONE : SLOT_QUEUED;
+	cpool.tail++;
+	pthread_cond_signal(&cpool.work);
+	pthread_mutex_unlock(&cpool.lock);
+}
+
+/* the oldest cluster submitted, compressed or not; NULL if none is left */
+struct compress_slot *compress_slot_wait(void)
+{
+	struct compress_slot *slot;
+
+	if (cpool.head == cpool.tail)
+		return NULL;
+
+	slot = cpool.slots + cpool.head % cpool.nr_slots;
+	if (cpool.nr_threads) {
+		pthread_mutex_lock(&cpool.lock);
+		while (slot->state != SLOT_DONE)
+			pthread_cond_wait(&cpool.done, &cpool.lock);
+		pthread_mutex_unlock(&cpool.lock);
+	}
+	return slot;
+}
+
+void compress_slot_put(struct compress_slot *slot)
+{
+	ASSERT(slot == cpool.slots + cpool.head % cpool.nr_slots);
+
+	if (cpool.nr_threads)
+		pthread_mutex_lock(&cpool.lock);
+	slot->state = SLOT_FREE;
+	cpool.head++;
+	if (cpool.nr_threads)
+		pthread_mutex_unlock(&cpool.lock);
+}
+
 /* linked list */
 typedef struct _ext_t {
 	const char *ext;
@@ -19,4 +19,32 @@ extern const char *supported_comp_names[];
 extern compress_ops supported_comp_ops[];
 extern filter_ops ext_filter;
 
+/* compression levels, as checked by the kernel */
+#define F2FS_LZ4HC_MIN_CLEVEL		3
+#define F2FS_LZ4HC_DEFAULT_CLEVEL	9
+#define F2FS_LZ4HC_MAX_CLEVEL		12
+#define F2FS_ZSTD_DEFAULT_CLEVEL	1
+#define F2FS_ZSTD_MAX_CLEVEL		22
+
+int parse_compress_alg(const char *arg, enum compress_algorithms *alg,
+						unsigned int *level);
+
+#define COMPRESS_MAX_THREADS	64
+#define COMPRESS_SLOTS_PER_THREAD	4	/* clusters compressed ahead */
+
+/* a cluster on its way from the source file to the writer */
+struct compress_slot {
+	struct compress_ctx cc;		/* owns rbuf and cbuf */
+	size_t len;			/* bytes read into cc.rbuf */
+	int ret;			/* 0 if cc.cbuf holds the result */
+	int state;
+};
+
+int compress_pool_init(int nr_threads);
+void compress_pool_exit(void);
+struct compress_slot *compress_slot_get(void);
+void compress_slot_submit(struct compress_slot *slot, bool skip);
+struct compress_slot *compress_slot_wait(void);
+void compress_slot_put(struct compress_slot *slot);
+
 #endif /* COMPRESS_H */
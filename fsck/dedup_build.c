@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * dedup_build.c
+ *
+ * Build-time deduplication of sload. Before the tree is built, regular
+ * files of the source are grouped by contents: by size first, then by a
+ * fingerprint of their first and last blocks, then by a crc of the whole
+ * file, and at last by comparing the bytes, so a hash collision never
+ * shares data between different files.
+ *
+ * The first copy of a group that is built writes its data to an inner
+ * inode, which no directory links to. Every copy, the first one included,
+ * becomes an out inode pointing to it through i_inner_ino, with all its
+ * addresses set to DEDUP_ADDR, as fsck/dedup.c expects.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "dedup.h"
+#include "dedup_build.h"
+#include "pipeline.h"
+
+#define DEDUP_READ_SZ		(256 * BLOCK_SZ)
+
+struct dedup_file {
+	u64 dev;		/* st_dev and st_ino of the source */
+	u64 ino;
+	u64 size;
+	u32 fp;			/* crc of the first and last blocks */
+	u32 crc;		/* crc of the whole file */
+	int stage;		/* 0: size, 1: fp, 2: crc known, -1: unreadable */
+	char *path;
+	struct dedup_group *group;
+};
+
+static struct {
+	struct dedup_file *files;	/* sorted by dev, ino once grouped */
+	u32 nr, cap;
+	struct dedup_group **groups;
+	u32 nr_groups;
+} dd;
+
+static void add_file(const char *path, struct stat *st)
+{
+	struct dedup_file *f;
+
+	if (dd.nr == dd.cap) {
+		dd.cap = dd.cap ? dd.cap * 2 : 1024;
+		dd.files = realloc(dd.files, dd.cap * sizeof(*dd.files));
+		ASSERT(dd.files);
+	}
+	f = dd.files + dd.nr++;
+	memset(f, 0, sizeof(*f));
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	f->size = st->st_size;
+	f->path = strdup(path);
+	ASSERT(f->path);
+}
+
+static int collect_dir(const char *path)
+{
+	struct scan_dir dir;
+	char *full_path;
+	int i, ret;
+
+	if (scan_directory(path, &dir) < 0) {
+		ERR_MSG("No entries in %s\n", path);
+		return -ENOENT;
+	}
+
+	for (i = 0, ret = 0; i < dir.nr && !ret; i++) {
+		struct scan_ent *ent = dir.ents + i;
+
+		if (ent->err < 0)
+			continue;
+		if (!S_ISDIR(ent->st.st_mode) &&
+				(!S_ISREG(ent->st.st_mode) ||
+				ent->st.st_size <= DEF_MAX_INLINE_DATA))
+			continue;
+
+		ret = asprintf(&full_path, "%s/%s", path, ent->name);
+		ASSERT(ret > 0);
+		ret = 0;
+		if (S_ISDIR(ent->st.st_mode))
+			ret = collect_dir(full_path);
+		else
+			add_file(full_path, &ent->st);
+		free(full_path);
+	}
+	free_scan_dir(&dir);
+	return ret;
+}
+
+static int read_at(int fd, u8 *buf, size_t len, u64 pos)
+{
+	if (lseek(fd, pos, SEEK_SET) < 0)
+		return -errno;
+	return bulkread(fd, buf, len, NULL);
+}
+
+static void fingerprint(struct dedup_file *f, u8 *buf)
+{
+	u64 last = (f->size - 1) & ~((u64)BLOCK_SZ - 1);
+	int fd, n;
+
+	fd = open(f->path, O_RDONLY);
+	if (fd < 0)
+		goto fail;
+	n = read_at(fd, buf, BLOCK_SZ, 0);
+	if (n <= 0)
+		goto fail_close;
+	f->fp = f2fs_cal_crc32(F2FS_SUPER_MAGIC, buf, n);
+	if (last) {
+		n = read_at(fd, buf, BLOCK_SZ, last);
+		if (n <= 0)
+			goto fail_close;
+		f->fp = f2fs_cal_crc32(f->fp, buf, n);
+	}
+	close(fd);
+	f->stage = 1;
+	return;
+fail_close:
+	close(fd);
+fail:
+	f->stage = -1;
+}
+
+static void whole_crc(struct dedup_file *f, u8 *buf)
+{
+	u64 total = 0;
+	int fd, n;
+
+	fd = open(f->path, O_RDONLY);
+	if (fd < 0) {
+		f->stage = -1;
+		return;
+	}
+	f->crc = F2FS_SUPER_MAGIC;
+	while ((n = bulkread(fd, buf, DEDUP_READ_SZ, NULL)) > 0) {
+		f->crc = f2fs_cal_crc32(f->crc, buf, n);
+		total += n;
+	}
+	close(fd);
+	f->stage = (n < 0 || total != f->size) ? -1 : 2;
+}
+
+static bool same_contents(struct dedup_file *a, struct dedup_file *b,
+						u8 *abuf, u8 *bbuf)
+{
+	int afd, bfd, an, bn;
+	bool same = false;
+
+	afd = open(a->path, O_RDONLY);
+	if (afd < 0)
+		return false;
+	bfd = open(b->path, O_RDONLY);
+	if (bfd < 0) {
+		close(afd);
+		return false;
+	}
+	for (;;) {
+		an = bulkread(afd, abuf, DEDUP_READ_SZ, NULL);
+		bn = bulkread(bfd, bbuf, DEDUP_READ_SZ, NULL);
+		if (an < 0 || an != bn || memcmp(abuf, bbuf, an))
+			break;
+		if (!an) {
+			same = true;
+			break;
+		}
+	}
+	close(bfd);
+	close(afd);
+	return same;
+}
+
+/* compare the whole (st_dev, st_ino) pair, either may exceed 32 bits */
+static int cmp_devino(const void *a, const void *b)
+{
+	const struct dedup_file *fa = a, *fb = b;
+
+	if (fa->dev != fb->dev)
+		return fa->dev < fb->dev ? -1 : 1;
+	return (fa->ino > fb->ino) - (fa->ino < fb->ino);
+}
+
+static int cmp_contents(const void *a, const void *b)
+{
+	const struct dedup_file *fa = a, *fb = b;
+
+	if (fa->size != fb->size)
+		return fa->size < fb->size ? -1 : 1;
+	if (fa->fp != fb->fp)
+		return fa->fp < fb->fp ? -1 : 1;
+	if (fa->crc != fb->crc)
+		return fa->crc < fb->crc ? -1 : 1;
+	return cmp_devino(fa, fb);
+}
+
+static bool same_key(struct dedup_file *a, struct dedup_file *b, int stage)
+{
+	if (a->size != b->size)
+		return false;
+	if (stage >= 1 && a->fp != b->fp)
+		return false;
+	if (stage >= 2 && a->crc != b->crc)
+		return false;
+	return true;
+}
+
+/* hash files of @stage sharing their key with a neighbour, then resort */
+static void refine(int stage, u8 *buf)
+{
+	u32 i;
+
+	for (i = 0; i < dd.nr; i++) {
+		struct dedup_file *f = dd.files + i;
+
+		if (f->stage != stage - 1)
+			continue;
+		if (!(i && same_key(f - 1, f, stage - 1) &&
+					f[-1].stage >= stage - 1) &&
+				!(i + 1 < dd.nr && same_key(f, f + 1, stage - 1) &&
+					f[1].stage >= stage - 1))
+			continue;
+		if (stage == 1)
+			fingerprint(f, buf);
+		else
+			whole_crc(f, buf);
+	}
+	qsort(dd.files, dd.nr, sizeof(*dd.files), cmp_contents);
+}
+
+static struct dedup_group *new_group(u64 size)
+{
+	struct dedup_group *g;
+
+	if (!(dd.nr_groups & (dd.nr_groups + 1))) {
+		dd.groups = realloc(dd.groups, (dd.nr_groups * 2 + 1) *
+						sizeof(*dd.groups));
+		ASSERT(dd.groups);
+	}
+	g = calloc(1, sizeof(*g));
+	ASSERT(g);
+	g->size = size;
+	dd.groups[dd.nr_groups++] = g;
+	return g;
+}
+
+static void make_groups(u8 *abuf, u8 *bbuf)
+{
+	u32 start, end, i, j;
+
+	for (start = 0; start < dd.nr; start = end) {
+		for (end = start + 1; end < dd.nr &&
+				same_key(dd.files + start, dd.files + end, 2);
+				end++)
+			;
+		for (i = start; i < end; i++) {
+			struct dedup_file *a = dd.files + i;
+
+			if (a->stage != 2 || a->group)
+				continue;
+			for (j = i + 1; j < end; j++) {
+				struct dedup_file *b = dd.files + j;
+
+				if (b->stage != 2 || b->group ||
+					!same_contents(a, b, abuf, bbuf))
+					continue;
+				if (!a->group) {
+					a->group = new_group(a->size);
+					a->group->nr_files = 1;
+				}
+				b->group = a->group;
+				a->group->nr_files++;
+			}
+		}
+	}
+}
+
+int dedup_scan(const char *from_dir)
+{
+	u8 *abuf, *bbuf;
+	u32 i, n, nr_files = 0;
+	u64 saved = 0;
+	int ret;
+
+	ret = collect_dir(from_dir);
+	if (ret)
+		return ret;
+
+	/* hard links of one source inode are built once anyway */
+	qsort(dd.files, dd.nr, sizeof(*dd.files), cmp_devino);
+	for (i = 0, n = 0; i < dd.nr; i++) {
+		if (n && !cmp_devino(&dd.files[n - 1], &dd.files[i])) {
+			free(dd.files[i].path);
+			continue;
+		}
+		dd.files[n++] = dd.files[i];
+	}
+	dd.nr = n;
+	qsort(dd.files, dd.nr, sizeof(*dd.files), cmp_contents);
+
+	abuf = malloc(DEDUP_READ_SZ);
+	bbuf = malloc(DEDUP_READ_SZ);
+	ASSERT(abuf && bbuf);
+	refine(1, abuf);
+	refine(2, abuf);
+	make_groups(abuf, bbuf);
+	free(bbuf);
+	free(abuf);
+
+	/* only grouped files are looked up later */
+	for (i = 0, n = 0; i < dd.nr; i++) {
+		free(dd.files[i].path);
+		dd.files[i].path = NULL;
+		if (dd.files[i].group)
+			dd.files[n++] = dd.files[i];
+	}
+	dd.nr = n;
+	qsort(dd.files, dd.nr, sizeof(*dd.files), cmp_devino);
+
+	for (i = 0; i < dd.nr_groups; i++) {
+		nr_files += dd.groups[i]->nr_files;
+		saved += (dd.groups[i]->nr_files - 1) *
+				(dd.groups[i]->size + BLOCK_SZ - 1) / BLOCK_SZ;
+	}
+	MSG(0, "Info: dedup %u files into %u inner inodes, "
+		"about %"PRIu64" blocks saved\n",
+		nr_files, dd.nr_groups, saved);
+	return 0;
+}
+
+struct dedup_group *dedup_lookup(u64 dev, u64 ino)
+{
+	struct dedup_file key = { .dev = dev, .ino = ino }, *f;
+
+	if (!dd.nr)
+		return NULL;
+	f = bsearch(&key, dd.files, dd.nr, sizeof(*dd.files), cmp_devino);
+	return f ? f->group : NULL;
+}
+
+static int build_inner(struct f2fs_sb_info *sbi, struct dentry *de,
+						struct dedup_group *g)
+{
+	struct dentry inner = *de;
+	struct f2fs_node *node_blk;
+	struct f2fs_summary sum;
+	struct node_info ni;
+	block_t blkaddr = NULL_ADDR;
+	int ret;
+
+	inner.from_devino = 0;
+	inner.dedup = NULL;
+	f2fs_alloc_nid(sbi, &inner.ino);
+
+	node_blk = calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk);
+	init_inode_block(sbi, node_blk, &inner);
+	node_blk->i.i_links = 0;
+	node_blk->i.i_dedup_flags = cpu_to_le32(F2FS_DEDUPED_FL |
+							F2FS_INNER_FL);
+
+	get_node_info(sbi, inner.ino, &ni);
+	set_summary(&sum, inner.ino, 0, ni.version);
+	ret = reserve_new_block(sbi, &blkaddr, &sum, CURSEG_HOT_NODE, 1);
+	ASSERT(!ret);
+	update_nat_blkaddr(sbi, inner.ino, inner.ino, blkaddr);
+	ASSERT(write_inode(node_blk, blkaddr) >= 0);
+	free(node_blk);
+
+	ret = f2fs_build_file(sbi, &inner);
+	if (ret)
+		return ret;
+	g->inner_ino = inner.ino;
+	return 0;
+}
+
+/* turn the inode of @de into an out inode of its group */
+int dedup_build_file(struct f2fs_sb_info *sbi, struct dentry *de)
+{
+	struct dedup_group *g = de->dedup;
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	int i, ofs, ret;
+
+	if (!g->inner_ino) {
+		ret = build_inner(sbi, de, g);
+		if (ret)
+			return ret;
+	}
+
+	node_blk = calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk);
+
+	get_node_info(sbi, de->ino, &ni);
+	ASSERT(dev_read_block(node_blk, ni.blk_addr) >= 0);
+	node_blk->i.i_size = cpu_to_le64(de->size);
+	node_blk->i.i_inner_ino = cpu_to_le32(g->inner_ino);
+	node_blk->i.i_dedup_flags = cpu_to_le32(F2FS_DEDUPED_FL);
+	ofs = get_extra_isize(node_blk);
+	for (i = 0; i < ADDRS_PER_INODE(&node_blk->i); i++)
+		node_blk->i.i_addr[ofs + i] = cpu_to_le32(DEDUP_ADDR);
+	ASSERT(write_inode(node_blk, ni.blk_addr) >= 0);
+	free(node_blk);
+
+	g->nr_links++;
+	MSG(1, "Info: Dedup %s -> inner ino=%x\n", de->path, g->inner_ino);
+	return 0;
+}
+
+/* set i_links of inner inodes to the out inodes really built */
+void dedup_finish(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	u32 i;
+
+	node_blk = calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk);
+	for (i = 0; i < dd.nr_groups; i++) {
+		struct dedup_group *g = dd.groups[i];
+
+		if (g->inner_ino) {
+			get_node_info(sbi, g->inner_ino, &ni);
+			ASSERT(dev_read_block(node_blk, ni.blk_addr) >= 0);
+			node_blk->i.i_links = cpu_to_le32(g->nr_links);
+			ASSERT(write_inode(node_blk, ni.blk_addr) >= 0);
+		}
+		free(g);
+	}
+	free(node_blk);
+	for (i = 0; i < dd.nr; i++)
+		free(dd.files[i].path);
+	free(dd.groups);
+	free(dd.files);
+	memset(&dd, 0, sizeof(dd));
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * dedup_build.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _DEDUP_BUILD_H_
+#define _DEDUP_BUILD_H_
+
+#include "fsck.h"
+
+/* source files with the same contents, shared by one inner inode */
+struct dedup_group {
+	nid_t inner_ino;	/* 0 until the first copy is built */
+	u32 nr_files;		/* distinct source inodes */
+	u32 nr_links;		/* out inodes built, i_links of inner */
+	u64 size;
+};
+
+int dedup_scan(const char *from_dir);
+struct dedup_group *dedup_lookup(u64 dev, u64 ino);
+int dedup_build_file(struct f2fs_sb_info *sbi, struct dentry *de);
+void dedup_finish(struct f2fs_sb_info *sbi);
+#endif /* _DEDUP_BUILD_H_ */
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * defer.c
+ *
+ * Deferred data block verification. In DEFER_CHK_BOOT mode, fsck checks
+ * node and dentry blocks as usual but leaves the SSA ownership check of
+ * regular data blocks to a work list saved in a file. A later, low-priority
+ * run in DEFER_CHK_RESUME mode verifies the list and can be interrupted at
+ * any time; it restarts from the last saved cursor.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "defer.h"
+#include "extra_fsck.h"
+
+#define DEFER_INIT_ENTRIES	1024
+
+void defer_add_data_blk(struct f2fs_sb_info *sbi, u32 blk_addr,
+			u32 parent_nid, u16 idx_in_node)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct defer_entry *e;
+
+	if (fsck->nr_defer_entries == fsck->defer_entries_cap) {
+		u32 cap = fsck->defer_entries_cap ?
+			fsck->defer_entries_cap * 2 : DEFER_INIT_ENTRIES;
+
+		e = realloc(fsck->defer_entries, cap * sizeof(*e));
+		ASSERT(e);
+		fsck->defer_entries = e;
+		fsck->defer_entries_cap = cap;
+	}
+
+	e = &fsck->defer_entries[fsck->nr_defer_entries++];
+	e->blk_addr = cpu_to_le32(blk_addr);
+	e->nid = cpu_to_le32(parent_nid);
+	e->ofs_in_node = cpu_to_le16(idx_in_node);
+	e->reserved = 0;
+}
+
+void defer_free_list(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+
+	free(fsck->defer_entries);
+	fsck->defer_entries = NULL;
+	fsck->nr_defer_entries = 0;
+	fsck->defer_entries_cap = 0;
+}
+
+static int cmp_defer_entry(const void *a, const void *b)
+{
+	u32 l = le32_to_cpu(((const struct defer_entry *)a)->blk_addr);
+	u32 r = le32_to_cpu(((const struct defer_entry *)b)->blk_addr);
+
+	return l < r ? -1 : (l > r);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t ret = read(fd, p, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void remove_defer_list(void)
+{
+	if (unlink(c.defer_list) && errno != ENOENT)
+		MSG(0, "\tError: failed to remove %s: %s\n",
+					c.defer_list, strerror(errno));
+}
+
+/*
+ * Save the entries collected by the boot pass. The list is sorted by block
+ * address so that the resume pass reads SSA blocks in order and hits the
+ * summary cache, and it is written to a temporary file first so that a
+ * power cut never leaves a truncated list behind.
+ */
+int defer_save_list(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
+	struct defer_list_head head;
+	size_t len = (size_t)fsck->nr_defer_entries * sizeof(struct defer_entry);
+	char tmp[PATH_MAX];
+	int fd;
+
+	if (c.dry_run)
+		return 0;
+
+	if (!fsck->nr_defer_entries) {
+		remove_defer_list();
+		return 0;
+	}
+
+	qsort(fsck->defer_entries, fsck->nr_defer_entries,
+				sizeof(struct defer_entry), cmp_defer_entry);
+
+	memset(&head, 0, sizeof(head));
+	head.magic = cpu_to_le32(DEFER_LIST_MAGIC);
+	head.nr_entries = cpu_to_le32(fsck->nr_defer_entries);
+	head.next = 0;
+	head.crc = cpu_to_le32(f2fs_cal_crc32(F2FS_SUPER_MAGIC,
+					fsck->defer_entries, len));
+	head.cp_ver = cp->checkpoint_ver;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", c.defer_list) >=
+							(int)sizeof(tmp)) {
+		MSG(0, "\tError: deferred list path is too long\n");
+		return -1;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		MSG(0, "\tError: failed to create %s: %s\n",
+						tmp, strerror(errno));
+		return -1;
+	}
+	if (write_all(fd, &head, sizeof(head)) ||
+			write_all(fd, fsck->defer_entries, len) ||
+			fsync(fd)) {
+		MSG(0, "\tError: failed to write %s: %s\n",
+						tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp, c.defer_list)) {
+		MSG(0, "\tError: failed to rename %s: %s\n",
+						tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	MSG(0, "Info: %u data blocks deferred to %s\n",
+				fsck->nr_defer_entries, c.defer_list);
+	return 0;
+}
+
+static void update_defer_cursor(int fd, u32 next)
+{
+	__le32 val = cpu_to_le32(next);
+
+	if (c.dry_run)
+		return;
+
+	if (pwrite(fd, &val, sizeof(val),
+			offsetof(struct defer_list_head, next)) != sizeof(val) ||
+			fsync(fd))
+		MSG(0, "\tError: failed to update cursor of %s\n",
+							c.defer_list);
+}
+
+static void set_low_priority(void)
+{
+	if (setpriority(PRIO_PROCESS, 0, 19))
+		DBG(1, "failed to lower cpu priority\n");
+#ifdef SYS_ioprio_set
+	/* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE */
+	if (syscall(SYS_ioprio_set, 1, 0, 3 << 13))
+		DBG(1, "failed to lower io priority\n");
+#endif
+}
+
+/*
+ * Verify the saved list from its cursor. Returns 0 when all entries have
+ * been verified, -EINVAL when an inconsistency is found, and -1 if the list
+ * can not be used at all.
+ */
+int defer_resume_list(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
+	struct defer_list_head head;
+	struct defer_entry *entries;
+	u32 nr, i, stale = 0;
+	int fix_on = c.fix_on;
+	int fd, ret = 0;
+	size_t len;
+
+	fd = open(c.defer_list, c.dry_run ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			MSG(0, "Info: No deferred data check is pending\n");
+			return 0;
+		}
+		MSG(0, "\tError: failed to open %s: %s\n",
+					c.defer_list, strerror(errno));
+		return -1;
+	}
+
+	if (read_all(fd, &head, sizeof(head)) ||
+			le32_to_cpu(head.magic) != DEFER_LIST_MAGIC) {
+		MSG(0, "\tError: %s is not a deferred list\n", c.defer_list);
+		close(fd);
+		return -1;
+	}
+
+	nr = le32_to_cpu(head.nr_entries);
+	len = (size_t)nr * sizeof(struct defer_entry);
+	entries = malloc(len ? len : 1);
+	ASSERT(entries);
+
+	if (read_all(fd, entries, len) || le32_to_cpu(head.crc) !=
+			f2fs_cal_crc32(F2FS_SUPER_MAGIC, entries, len)) {
+		MSG(0, "\tError: deferred list %s is corrupted\n",
+							c.defer_list);
+		ret = -1;
+		goto out;
+	}
+
+	i = le32_to_cpu(head.next);
+	if (i > nr)
+		i = nr;
+
+	MSG(0, "Info: Resume deferred data check from %u/%u\n", i, nr);
+	if (head.cp_ver != cp->checkpoint_ver)
+		MSG(0, "Info: Checkpoint changed since the list was saved, "
+				"entries moved by the kernel are skipped\n");
+
+	set_low_priority();
+	build_sum_cache_list(sbi);
+
+	/* this pass only reports, repair is left to a full fsck */
+	c.fix_on = 0;
+	TIME_TAG_POINT_START(TIME_PHASE_CHK_DEFERRED);
+	for (; i < nr; i++) {
+		ret = fsck_chk_deferred_data_blk(sbi,
+				le32_to_cpu(entries[i].blk_addr),
+				le32_to_cpu(entries[i].nid),
+				le16_to_cpu(entries[i].ofs_in_node));
+		if (ret < 0)
+			break;
+		stale += ret;
+		ret = 0;
+		if ((i + 1) % DEFER_LIST_SYNC_CNT == 0)
+			update_defer_cursor(fd, i + 1);
+	}
+	TIME_TAG_POINT_END(TIME_PHASE_CHK_DEFERRED);
+	c.fix_on = fix_on;
+	destroy_sum_cache_list(sbi);
+
+	if (ret) {
+		/* leave the cursor at the bad entry for the next run */
+		update_defer_cursor(fd, i);
+		if (!c.fix_on && !c.dry_run && f2fs_dev_is_writable())
+			SetExtraFlag(sbi->raw_super, EXTRA_NEED_FSCK_FLAG);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	MSG(0, "Info: Deferred data check done, %u verified, %u stale\n",
+						nr - stale, stale);
+	if (!c.dry_run)
+		remove_defer_list();
+out:
+	free(entries);
+	close(fd);
+	return ret;
+}
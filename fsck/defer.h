@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * defer.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _DEFER_H_
+#define _DEFER_H_
+
+#include "fsck.h"
+
+enum {
+	DEFER_CHK_NONE,
+	DEFER_CHK_BOOT,		/* skip data SSA checks, save them to a list */
+	DEFER_CHK_RESUME,	/* verify the saved list in background */
+};
+
+#define DEFER_LIST_MAGIC	0xF2F5DEF0
+#define DEFER_LIST_SYNC_CNT	4096	/* entries between cursor updates */
+
+/* on-disk layout of the deferred list file, little endian */
+struct defer_list_head {
+	__le32 magic;
+	__le32 nr_entries;
+	__le32 next;		/* first entry not verified yet */
+	__le32 crc;		/* crc of the entry array */
+	__le64 cp_ver;		/* checkpoint version when saved */
+} __attribute__((packed));
+
+struct defer_entry {
+	__le32 blk_addr;
+	__le32 nid;		/* parent node */
+	__le16 ofs_in_node;
+	__le16 reserved;
+} __attribute__((packed));
+
+static inline bool is_defer_data_chk(enum FILE_TYPE ftype)
+{
+	/* dentry blocks are directory metadata, never defer them */
+	return c.defer_data_chk == DEFER_CHK_BOOT && ftype != F2FS_FT_DIR;
+}
+
+void defer_add_data_blk(struct f2fs_sb_info *sbi, u32 blk_addr,
+			u32 parent_nid, u16 idx_in_node);
+int defer_save_list(struct f2fs_sb_info *sbi);
+int defer_resume_list(struct f2fs_sb_info *sbi);
+void defer_free_list(struct f2fs_sb_info *sbi);
+#endif /* _DEFER_H_ */
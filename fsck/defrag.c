@@ -9,84 +9,360 @@
  */
 #include "fsck.h"
 
-static int migrate_block(struct f2fs_sb_info *sbi, u64 from, u64 to)
+/* blocks gathered, placed and moved together */
+#define DEFRAG_WINDOW_BLKS	(1 << 20)
+/* blocks copied with one buffer */
+#define DEFRAG_CHUNK_BLKS	2048
+
+struct defrag_blk {
+	block_t from;
+	block_t to;
+	nid_t ino;			/* owner inode */
+	struct f2fs_summary sum;	/* node, or dnode and offset of data */
+	unsigned char type;		/* segment type */
+};
+
+static int defrag_nid_cmp(const void *a, const void *b)
+{
+	const struct defrag_blk *x = a, *y = b;
+	nid_t nx = le32_to_cpu(x->sum.nid), ny = le32_to_cpu(y->sum.nid);
+
+	if (nx != ny)
+		return nx < ny ? -1 : 1;
+	return x->from < y->from ? -1 : x->from > y->from;
+}
+
+/* by type, then in file order: owner inode, dnode, offset in the dnode */
+static int defrag_owner_cmp(const void *a, const void *b)
 {
-	void *raw = calloc(BLOCK_SZ, 1);
+	const struct defrag_blk *x = a, *y = b;
+	u16 ox = le16_to_cpu(x->sum.ofs_in_node);
+	u16 oy = le16_to_cpu(y->sum.ofs_in_node);
+
+	if (x->type != y->type)
+		return x->type < y->type ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	if (x->sum.nid != y->sum.nid)
+		return defrag_nid_cmp(a, b);
+	if (IS_DATASEG(x->type) && ox != oy)
+		return ox < oy ? -1 : 1;
+	return x->from < y->from ? -1 : x->from > y->from;
+}
+
+static int defrag_from_cmp(const void *a, const void *b)
+{
+	const struct defrag_blk *x = *(struct defrag_blk * const *)a;
+	const struct defrag_blk *y = *(struct defrag_blk * const *)b;
+
+	return x->from < y->from ? -1 : x->from > y->from;
+}
+
+/* valid blocks in [@from, @from + @len), one SSA read per segment */
+static unsigned int defrag_gather(struct f2fs_sb_info *sbi, u64 from, u64 len,
+						struct defrag_blk *blks)
+{
+	struct f2fs_summary_block *sum_blk;
 	struct seg_entry *se;
-	struct f2fs_summary sum;
-	u64 offset;
-	int ret, type;
+	unsigned int nr = 0;
+	u64 idx, seg_end;
+	u32 segno, offset;
+	int type;
 
-	ASSERT(raw != NULL);
+	for (idx = from; idx < from + len; idx = seg_end) {
+		segno = GET_SEGNO(sbi, idx);
+		seg_end = START_BLOCK(sbi, segno + 1);
+		if (seg_end > from + len)
+			seg_end = from + len;
 
-	/* read from */
-	ret = dev_read_block(raw, from);
-	ASSERT(ret >= 0);
+		se = get_seg_entry(sbi, segno);
+		if (!se->valid_blocks)
+			continue;
 
-	/* write to */
-	ret = dev_write_block(raw, to);
-	ASSERT(ret >= 0);
+		sum_blk = get_sum_block(sbi, segno, &type);
+		for (; idx < seg_end; idx++) {
+			offset = OFFSET_IN_SEG(sbi, idx);
+			if (!f2fs_test_bit(offset,
+					(const char *)se->cur_valid_map))
+				continue;
 
-	/* update sit bitmap & valid_blocks && se->type */
-	se = get_seg_entry(sbi, GET_SEGNO(sbi, from));
-	offset = OFFSET_IN_SEG(sbi, from);
-	type = se->type;
-	se->valid_blocks--;
-	f2fs_clear_bit(offset, (char *)se->cur_valid_map);
-	se->dirty = 1;
+			blks[nr].from = idx;
+			blks[nr].sum = sum_blk->entries[offset];
+			blks[nr].type = se->type;
+			nr++;
+		}
+		if (type == SEG_TYPE_NODE || type == SEG_TYPE_DATA ||
+				type == SEG_TYPE_MAX)
+			free(sum_blk);
+	}
+	return nr;
+}
+
+/* owner inodes from NAT, one read per NAT block */
+static void defrag_find_owners(struct f2fs_sb_info *sbi,
+			struct defrag_blk *blks, unsigned int nr)
+{
+	struct f2fs_nat_block *nat_block;
+	pgoff_t block_addr = 0, addr;
+	unsigned int i;
+	nid_t nid;
+	int ret;
+
+	nat_block = calloc(BLOCK_SZ, 1);
+	ASSERT(nat_block);
+
+	qsort(blks, nr, sizeof(*blks), defrag_nid_cmp);
+	for (i = 0; i < nr; i++) {
+		nid = le32_to_cpu(blks[i].sum.nid);
+		addr = current_nat_addr(sbi, nid, NULL);
+		if (addr != block_addr) {
+			ret = dev_read_block(nat_block, addr);
+			ASSERT(ret >= 0);
+			block_addr = addr;
+		}
+		blks[i].ino = le32_to_cpu(
+			nat_block->entries[nid % NAT_ENTRY_PER_BLOCK].ino);
+	}
+	free(nat_block);
+}
+
+/*
+ * As reserve_new_block() does, a target is also taken in the checkpoint
+ * bitmap while fsync'd data waits for recovery: find_next_free_block()
+ * looks there, and must not hand out the same block twice.
+ */
+static void defrag_take_block(struct f2fs_sb_info *sbi, block_t blkaddr,
+							unsigned char type)
+{
+	struct seg_entry *se = get_seg_entry(sbi, GET_SEGNO(sbi, blkaddr));
+	unsigned int offset = OFFSET_IN_SEG(sbi, blkaddr);
 
-	se = get_seg_entry(sbi, GET_SEGNO(sbi, to));
-	offset = OFFSET_IN_SEG(sbi, to);
 	se->type = type;
 	se->valid_blocks++;
 	f2fs_set_bit(offset, (char *)se->cur_valid_map);
+	if (need_fsync_data_record(sbi)) {
+		se->ckpt_type = type;
+		se->ckpt_valid_blocks++;
+		f2fs_set_bit(offset, (char *)se->ckpt_valid_map);
+	}
 	se->dirty = 1;
+	update_free_seg_index(sbi, GET_SEGNO(sbi, blkaddr), false);
+}
+
+/*
+ * Release a moved source, or with @untake a target taken by
+ * defrag_take_block() when placement fails.  A source keeps its
+ * checkpoint bit, as before: the last checkpoint still points there.
+ */
+static void defrag_put_block(struct f2fs_sb_info *sbi, block_t blkaddr,
+							bool untake)
+{
+	struct seg_entry *se = get_seg_entry(sbi, GET_SEGNO(sbi, blkaddr));
+	unsigned int offset = OFFSET_IN_SEG(sbi, blkaddr);
 
-	/* read/write SSA */
-	get_sum_entry(sbi, from, &sum);
-	update_sum_entry(sbi, to, &sum);
-
-	/* if data block, read node and update node block */
-	if (IS_DATASEG(type))
-		update_data_blkaddr(sbi, le32_to_cpu(sum.nid),
-				le16_to_cpu(sum.ofs_in_node), to);
-	else
-		update_nat_blkaddr(sbi, 0, le32_to_cpu(sum.nid), to);
-
-	DBG(1, "Migrate %s block %"PRIx64" -> %"PRIx64"\n",
-					IS_DATASEG(type) ? "data" : "node",
-					from, to);
-	free(raw);
+	se->valid_blocks--;
+	f2fs_clear_bit(offset, (char *)se->cur_valid_map);
+	if (untake && need_fsync_data_record(sbi)) {
+		se->ckpt_valid_blocks--;
+		f2fs_clear_bit(offset, (char *)se->ckpt_valid_map);
+	}
+	se->dirty = 1;
+	update_free_seg_index(sbi, GET_SEGNO(sbi, blkaddr), true);
+}
+
+/*
+ * Give every block a target, taking the free blocks found from @to in
+ * runs: the block found by find_next_free_block() and the free blocks
+ * next to it in its segment go to consecutive blocks of one type.  The
+ * sources stay valid meanwhile, so no target overlaps a block still to
+ * be copied.
+ */
+static int defrag_place(struct f2fs_sb_info *sbi, struct defrag_blk *blks,
+				unsigned int nr, u64 to, int left)
+{
+	struct seg_entry *se;
+	unsigned char *bitmap;
+	unsigned int i, j, n;
+	int lo, hi;
+	u64 target;
+
+	for (i = 0; i < nr; i += n) {
+		target = to;
+		if (find_next_free_block(sbi, &target, left, blks[i].type,
+								false)) {
+			MSG(0, "Not enough space to migrate blocks\n");
+			for (j = 0; j < i; j++)
+				defrag_put_block(sbi, blks[j].to, true);
+			return -1;
+		}
+
+		/*
+		 * the run of free blocks on the search side of @target, by
+		 * the bitmap find_next_free_block() checks
+		 */
+		se = get_seg_entry(sbi, GET_SEGNO(sbi, target));
+		bitmap = get_seg_bitmap(sbi, se);
+		lo = hi = OFFSET_IN_SEG(sbi, target);
+		if (left) {
+			while (lo > 0 && !f2fs_test_bit(lo - 1,
+							(const char *)bitmap))
+				lo--;
+		} else {
+			while (hi + 1 < (int)sbi->blocks_per_seg &&
+					!f2fs_test_bit(hi + 1,
+							(const char *)bitmap))
+				hi++;
+		}
+		target = START_BLOCK(sbi, GET_SEGNO(sbi, target)) + lo;
+
+		for (n = 0; n < (unsigned int)(hi - lo + 1) && i + n < nr &&
+				blks[i + n].type == blks[i].type; n++) {
+			blks[i + n].to = target + n;
+			defrag_take_block(sbi, target + n, blks[i].type);
+		}
+	}
 	return 0;
 }
 
-int f2fs_defragment(struct f2fs_sb_info *sbi, u64 from, u64 len, u64 to, int left)
+/*
+ * Copy the blocks DEFRAG_CHUNK_BLKS at a time: each run of adjacent
+ * sources is read with one I/O and each run of adjacent targets is
+ * written with one I/O.
+ */
+static void defrag_copy(struct defrag_blk *blks, unsigned int nr)
+{
+	struct defrag_blk **order;
+	char *buf, *scratch;
+	unsigned int i, j, k, n;
+	int ret;
+
+	buf = malloc(BLOCK_SZ * DEFRAG_CHUNK_BLKS);
+	scratch = malloc(BLOCK_SZ * DEFRAG_CHUNK_BLKS);
+	order = malloc(sizeof(*order) * DEFRAG_CHUNK_BLKS);
+	ASSERT(buf && scratch && order);
+
+	for (i = 0; i < nr; i += n) {
+		n = min(nr - i, (unsigned int)DEFRAG_CHUNK_BLKS);
+
+		for (j = 0; j < n; j++)
+			order[j] = &blks[i + j];
+		qsort(order, n, sizeof(*order), defrag_from_cmp);
+
+		for (j = 0; j < n; j = k) {
+			for (k = j + 1; k < n &&
+				order[k]->from == order[k - 1]->from + 1; k++)
+				;
+			ret = dev_read(scratch + j * BLOCK_SZ,
+				(u64)order[j]->from << F2FS_BLKSIZE_BITS,
+				(k - j) << F2FS_BLKSIZE_BITS);
+			ASSERT(ret >= 0);
+		}
+		for (j = 0; j < n; j++)
+			memcpy(buf + (order[j] - &blks[i]) * BLOCK_SZ,
+					scratch + j * BLOCK_SZ, BLOCK_SZ);
+
+		for (j = 0; j < n; j = k) {
+			for (k = j + 1; k < n &&
+				blks[i + k].to == blks[i + k - 1].to + 1; k++)
+				;
+			ret = dev_write(buf + j * BLOCK_SZ,
+				(u64)blks[i + j].to << F2FS_BLKSIZE_BITS,
+				(k - j) << F2FS_BLKSIZE_BITS);
+			ASSERT(ret >= 0);
+		}
+	}
+	free(order);
+	free(scratch);
+	free(buf);
+}
+
+/*
+ * Targets are taken before any summary is written, so the SSA write-back
+ * cache would see each target segment full and write it per block; write
+ * each run of targets in one segment with one SSA update instead.
+ */
+static void defrag_write_sums(struct f2fs_sb_info *sbi,
+			struct defrag_blk *blks, unsigned int nr)
 {
+	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
+	struct f2fs_summary_block *sum_blk;
 	struct seg_entry *se;
-	u64 idx, offset;
+	unsigned int i, j;
+	u32 segno;
+	int type, ret;
+
+	if (get_sb(feature) & cpu_to_le32(F2FS_FEATURE_RO))
+		return;
+
+	for (i = 0; i < nr; i = j) {
+		segno = GET_SEGNO(sbi, blks[i].to);
+		se = get_seg_entry(sbi, segno);
+
+		sum_blk = get_sum_block(sbi, segno, &type);
+		for (j = i; j < nr && GET_SEGNO(sbi, blks[j].to) == segno; j++)
+			sum_blk->entries[OFFSET_IN_SEG(sbi, blks[j].to)] =
+								blks[j].sum;
+		sum_blk->footer.entry_type = IS_NODESEG(se->type) ?
+						SUM_TYPE_NODE : SUM_TYPE_DATA;
+
+		ret = dev_write_block(sum_blk, GET_SUM_BLKADDR(sbi, segno));
+		ASSERT(ret >= 0);
 
-	/* flush NAT/SIT journal entries */
+		if (type == SEG_TYPE_NODE || type == SEG_TYPE_DATA ||
+				type == SEG_TYPE_MAX)
+			free(sum_blk);
+	}
+}
+
+int f2fs_defragment(struct f2fs_sb_info *sbi, u64 from, u64 len, u64 to, int left)
+{
+	struct blkaddr_batch batch = { 0 };
+	struct defrag_blk *blks;
+	unsigned int i, nr;
+	u64 start, end = from + len, n;
+	int ret = 0;
+
+	/* flush NAT/SIT journal entries and the cached summary blocks */
 	flush_journal_entries(sbi);
+	flush_sum_wb(sbi);
 
-	for (idx = from; idx < from + len; idx++) {
-		u64 target = to;
+	blks = malloc(sizeof(*blks) * min(len, (u64)DEFRAG_WINDOW_BLKS));
+	ASSERT(blks || !len);
 
-		se = get_seg_entry(sbi, GET_SEGNO(sbi, idx));
-		offset = OFFSET_IN_SEG(sbi, idx);
+	for (start = from; start < end; start += n) {
+		n = min(end - start, (u64)DEFRAG_WINDOW_BLKS);
 
-		if (!f2fs_test_bit(offset, (const char *)se->cur_valid_map))
+		nr = defrag_gather(sbi, start, n, blks);
+		if (!nr)
 			continue;
 
-		if (find_next_free_block(sbi, &target, left, se->type, false)) {
-			MSG(0, "Not enough space to migrate blocks");
-			return -1;
+		/* lay out each file's blocks in order, dnode by dnode */
+		defrag_find_owners(sbi, blks, nr);
+		qsort(blks, nr, sizeof(*blks), defrag_owner_cmp);
+
+		if (defrag_place(sbi, blks, nr, to, left)) {
+			ret = -1;
+			break;
 		}
+		defrag_copy(blks, nr);
 
-		if (migrate_block(sbi, idx, target)) {
-			ASSERT_MSG("Found inconsistency: please run FSCK");
-			return -1;
+		for (i = 0; i < nr; i++) {
+			defrag_put_block(sbi, blks[i].from, false);
+			blkaddr_batch_add(sbi, &batch, &blks[i].sum,
+					!IS_DATASEG(blks[i].type), blks[i].to);
+
+			DBG(1, "Migrate %s block %x -> %x\n",
+					IS_DATASEG(blks[i].type) ?
+					"data" : "node",
+					blks[i].from, blks[i].to);
 		}
+		defrag_write_sums(sbi, blks, nr);
+		blkaddr_batch_flush(sbi, &batch);
 	}
+	blkaddr_batch_free(&batch);
+	free(blks);
+	if (ret)
+		return ret;
 
 	/* update curseg info; can update sit->types */
 	move_curseg_info(sbi, to, left);
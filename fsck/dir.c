@@ -15,7 +15,7 @@
  */
 #include "fsck.h"
 #include "node.h"
-#include <search.h>
+#include "access_profile.h"
 
 static int room_for_filename(const u8 *bitmap, int slots, int max_slots)
 {
@@ -459,7 +459,7 @@ static void set_file_temperature(struct f2fs_sb_info *sbi,
 		node_blk->i.i_advise |= FADVISE_HOT_BIT;
 }
 
-static void init_inode_block(struct f2fs_sb_info *sbi,
+void init_inode_block(struct f2fs_sb_info *sbi,
 		struct f2fs_node *node_blk, struct dentry *de)
 {
 	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
@@ -643,77 +643,390 @@ int convert_inline_dentry(struct f2fs_sb_info *sbi, struct f2fs_node *node,
 	return 0;
 }
 
-static int cmp_from_devino(const void *a, const void *b) {
-	u64 devino_a = ((struct hardlink_cache_entry*) a)->from_devino;
-	u64 devino_b = ((struct hardlink_cache_entry*) b)->from_devino;
+#define HARDLINK_MIN_SLOTS	1024
 
-	return (devino_a > devino_b) - (devino_a < devino_b);
+static unsigned int hardlink_hash(u64 devino, unsigned int mask)
+{
+	devino *= 0x9E3779B97F4A7C15ULL;
+	return (unsigned int)(devino >> 32) & mask;
+}
+
+static void hardlink_insert_slot(struct hardlink_cache *cache,
+					struct hardlink_cache_entry *ent)
+{
+	unsigned int i = hardlink_hash(ent->from_devino, cache->mask);
+
+	while (cache->slots[i])
+		i = (i + 1) & cache->mask;
+	cache->slots[i] = ent;
+}
+
+/* keep the load factor under 1/2 */
+static void hardlink_grow(struct hardlink_cache *cache)
+{
+	struct hardlink_cache_entry **old = cache->slots;
+	unsigned int i, old_slots = old ? cache->mask + 1 : 0;
+	unsigned int nr_slots = old ? old_slots * 2 : HARDLINK_MIN_SLOTS;
+
+	cache->slots = calloc(nr_slots, sizeof(*cache->slots));
+	ASSERT(cache->slots);
+	cache->mask = nr_slots - 1;
+
+	for (i = 0; i < old_slots; i++)
+		if (old[i])
+			hardlink_insert_slot(cache, old[i]);
+	free(old);
+}
+
+static struct hardlink_cache_entry *hardlink_new_entry(
+					struct hardlink_cache *cache)
+{
+	struct hardlink_chunk *chunk = cache->chunks;
+
+	if (!chunk || chunk->used == HARDLINK_CHUNK_ENTRIES) {
+		chunk = calloc(1, sizeof(struct hardlink_chunk));
+		ASSERT(chunk);
+		chunk->next = cache->chunks;
+		cache->chunks = chunk;
+	}
+	return chunk->ents + chunk->used++;
+}
+
+void f2fs_init_hardlink_cache(struct f2fs_sb_info *sbi)
+{
+	memset(&sbi->hardlink_cache, 0, sizeof(struct hardlink_cache));
+}
+
+void f2fs_release_hardlink_cache(struct f2fs_sb_info *sbi)
+{
+	struct hardlink_cache *cache = &sbi->hardlink_cache;
+	struct hardlink_chunk *chunk;
+
+	while ((chunk = cache->chunks)) {
+		cache->chunks = chunk->next;
+		free(chunk);
+	}
+	free(cache->slots);
+	f2fs_init_hardlink_cache(sbi);
+}
+
+/* stop and return the first non-zero value returned by @fn */
+int f2fs_for_each_hardlink(struct f2fs_sb_info *sbi,
+		int (*fn)(struct f2fs_sb_info *, struct hardlink_cache_entry *))
+{
+	struct hardlink_chunk *chunk;
+	unsigned int i;
+	int ret;
+
+	for (chunk = sbi->hardlink_cache.chunks; chunk; chunk = chunk->next) {
+		for (i = 0; i < chunk->used; i++) {
+			ret = fn(sbi, chunk->ents + i);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
 }
 
 struct hardlink_cache_entry *f2fs_search_hardlink(struct f2fs_sb_info *sbi,
 						struct dentry *de)
 {
-	struct hardlink_cache_entry *find_hardlink = NULL;
-	struct hardlink_cache_entry *found_hardlink = NULL;
-	void *search_result;
+	struct hardlink_cache *cache = &sbi->hardlink_cache;
+	struct hardlink_cache_entry *ent;
+	unsigned int i;
 
 	/* This might be a hardlink, try to find it in the cache */
-	find_hardlink = calloc(1, sizeof(struct hardlink_cache_entry));
-	find_hardlink->from_devino = de->from_devino;
+	if (cache->slots) {
+		i = hardlink_hash(de->from_devino, cache->mask);
+		while ((ent = cache->slots[i])) {
+			if (ent->from_devino == de->from_devino)
+				return ent;
+			i = (i + 1) & cache->mask;
+		}
+	}
+
+	if (!cache->slots || (cache->nr + 1) * 2 > cache->mask + 1)
+		hardlink_grow(cache);
+
+	ent = hardlink_new_entry(cache);
+	ent->from_devino = de->from_devino;
+	hardlink_insert_slot(cache, ent);
+	cache->nr++;
+	return ent;
+}
 
-	search_result = tsearch(find_hardlink, &(sbi->hardlink_cache),
-				cmp_from_devino);
-	ASSERT(search_result != 0);
+static int update_hardlink_links(struct f2fs_sb_info *sbi,
+					struct hardlink_cache_entry *ent)
+{
+	struct f2fs_node *node_blk;
+	struct node_info ni;
 
-	found_hardlink = *(struct hardlink_cache_entry**) search_result;
-	ASSERT(find_hardlink->from_devino == found_hardlink->from_devino);
+	if (!ent->to_ino || ent->nlink <= 1)
+		return 0;
 
-	/* If it was already in the cache, free the entry we just created */
-	if (found_hardlink != find_hardlink)
-		free(find_hardlink);
+	get_node_info(sbi, ent->to_ino, &ni);
+	if (ni.blk_addr == NULL_ADDR)
+		return 0;
 
-	return found_hardlink;
+	node_blk = calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk);
+	ASSERT(dev_read_block(node_blk, ni.blk_addr) >= 0);
+	node_blk->i.i_links = cpu_to_le32(ent->nlink);
+	ASSERT(write_inode(node_blk, ni.blk_addr) >= 0);
+	free(node_blk);
+	return 0;
 }
 
-int f2fs_create(struct f2fs_sb_info *sbi, struct dentry *de)
+/* set i_links of hard linked files once all their links are made */
+void f2fs_update_hardlinks(struct f2fs_sb_info *sbi)
+{
+	f2fs_for_each_hardlink(sbi, update_hardlink_links);
+}
+
+/*
+ * Dentry blocks of one directory while its entries are being created.
+ * Blocks are read or allocated once, at the same point f2fs_add_link()
+ * would allocate them, and written back by dir_builder_flush() together
+ * with the parent inode.
+ */
+struct dir_builder_blk {
+	struct f2fs_dentry_block *blk;	/* NULL until read or allocated */
+	block_t blkaddr;
+	bool hole;			/* looked up as NULL_ADDR */
+	bool dirty;
+};
+
+struct dir_builder {
+	struct f2fs_sb_info *sbi;
+	struct f2fs_node *parent;
+	struct node_info ni;
+	struct dir_builder_blk *blks;	/* indexed by dentry block index */
+	unsigned int nr_blks;
+};
+
+static int dir_builder_init(struct f2fs_sb_info *sbi, struct dir_builder *db,
+								nid_t pino)
 {
-	struct f2fs_node *parent, *child;
-	struct hardlink_cache_entry *found_hardlink = NULL;
-	struct node_info ni, hardlink_ni;
-	struct f2fs_summary sum;
-	block_t blkaddr = NULL_ADDR;
 	int ret;
 
-	/* Find if there is a */
-	get_node_info(sbi, de->pino, &ni);
-	if (ni.blk_addr == NULL_ADDR) {
-		MSG(0, "No parent directory pino=%x\n", de->pino);
+	memset(db, 0, sizeof(*db));
+	db->sbi = sbi;
+
+	get_node_info(sbi, pino, &db->ni);
+	if (db->ni.blk_addr == NULL_ADDR) {
+		MSG(0, "No parent directory pino=%x\n", pino);
 		return -1;
 	}
 
-	if (de->from_devino)
-		found_hardlink = f2fs_search_hardlink(sbi, de);
+	db->parent = calloc(BLOCK_SZ, 1);
+	ASSERT(db->parent);
 
-	parent = calloc(BLOCK_SZ, 1);
-	ASSERT(parent);
-
-	ret = dev_read_block(parent, ni.blk_addr);
+	ret = dev_read_block(db->parent, db->ni.blk_addr);
 	ASSERT(ret >= 0);
 
 	/* Must convert inline dentry before the following opertions */
-	ret = convert_inline_dentry(sbi, parent, ni.blk_addr);
+	ret = convert_inline_dentry(sbi, db->parent, db->ni.blk_addr);
 	if (ret) {
-		MSG(0, "Convert inline dentry for pino=%x failed.\n", de->pino);
+		MSG(0, "Convert inline dentry for pino=%x failed.\n", pino);
+		free(db->parent);
 		return -1;
 	}
+	return 0;
+}
+
+static struct f2fs_dentry_block *dir_builder_get(struct dir_builder *db,
+						unsigned int bidx, int mode)
+{
+	struct dir_builder_blk *b;
+	struct dnode_of_data dn;
+	nid_t ino = le32_to_cpu(db->parent->footer.ino);
+	int ret;
+
+	if (bidx >= db->nr_blks) {
+		unsigned int nr = max(bidx + 1, db->nr_blks * 2);
+
+		db->blks = realloc(db->blks, nr * sizeof(*db->blks));
+		ASSERT(db->blks);
+		memset(db->blks + db->nr_blks, 0,
+				(nr - db->nr_blks) * sizeof(*db->blks));
+		db->nr_blks = nr;
+	}
+
+	b = db->blks + bidx;
+	if (b->blk || (b->hole && mode == LOOKUP_NODE))
+		return b->blk;
+
+	memset(&dn, 0, sizeof(dn));
+	set_new_dnode(&dn, db->parent, NULL, ino);
+	get_dnode_of_data(db->sbi, &dn, bidx, mode);
+
+	if (dn.data_blkaddr == NULL_ADDR && mode == LOOKUP_NODE) {
+		b->hole = true;
+		goto out;
+	}
+
+	b->blk = calloc(BLOCK_SZ, 1);
+	ASSERT(b->blk);
+
+	if (dn.data_blkaddr == NULL_ADDR) {
+		new_data_block(db->sbi, b->blk, &dn, CURSEG_HOT_DATA);
+		b->dirty = true;
+		if (dn.ndirty) {
+			ret = dev_write_block(dn.node_blk, dn.node_blkaddr);
+			ASSERT(ret >= 0);
+		}
+	} else {
+		ret = dev_read_block(b->blk, dn.data_blkaddr);
+		ASSERT(ret >= 0);
+	}
+	b->blkaddr = dn.data_blkaddr;
+	b->hole = false;
+out:
+	if (dn.node_blk && dn.node_blk != dn.inode_blk)
+		free(dn.node_blk);
+	return b->blk;
+}
+
+static int dir_builder_find(struct dir_builder *db, struct dentry *de)
+{
+	struct f2fs_node *dir = db->parent;
+	unsigned int dir_level = dir->i.i_dir_level;
+	unsigned int max_depth = le32_to_cpu(dir->i.i_current_depth);
+	unsigned int level, nbucket, bidx, end_block;
+	struct f2fs_dentry_block *dentry_blk;
+	struct f2fs_dir_entry *dentry;
+	f2fs_hash_t namehash;
+
+	namehash = f2fs_dentry_hash(get_encoding(db->sbi),
+				IS_CASEFOLDED(&dir->i), de->name, de->len);
+
+	for (level = 0; level < max_depth; level++) {
+		nbucket = dir_buckets(level, dir_level);
+		bidx = dir_block_index(level, dir_level,
+					le32_to_cpu(namehash) % nbucket);
+		end_block = bidx + bucket_blocks(level);
+
+		for (; bidx < end_block; bidx++) {
+			dentry_blk = dir_builder_get(db, bidx, LOOKUP_NODE);
+			if (!dentry_blk)
+				continue;
+
+			dentry = find_in_block(dentry_blk, de->name, de->len,
+							namehash, NULL);
+			if (dentry) {
+				de->ino = le32_to_cpu(dentry->ino);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* same placement as f2fs_add_link(), in the cached blocks */
+static int dir_builder_add(struct dir_builder *db, const unsigned char *name,
+				int name_len, nid_t ino, int file_type)
+{
+	struct f2fs_node *parent = db->parent;
+	unsigned int dir_level = parent->i.i_dir_level;
+	int level = 0, current_depth, bit_pos;
+	int nbucket, nblock, bidx, block;
+	int slots = GET_DENTRY_SLOTS(name_len);
+	f2fs_hash_t dentry_hash = f2fs_dentry_hash(get_encoding(db->sbi),
+						IS_CASEFOLDED(&parent->i),
+						name, name_len);
+	struct f2fs_dentry_block *dentry_blk;
+	struct f2fs_dentry_ptr d;
+
+	current_depth = le32_to_cpu(parent->i.i_current_depth);
+start:
+	if (current_depth == MAX_DIR_HASH_DEPTH) {
+		ERR_MSG("\tError: MAX_DIR_HASH\n");
+		return -ENOSPC;
+	}
+
+	/* Need a new dentry block */
+	if (level == current_depth)
+		++current_depth;
+
+	nbucket = dir_buckets(level, dir_level);
+	nblock = bucket_blocks(level);
+	bidx = dir_block_index(level, dir_level, le32_to_cpu(dentry_hash) % nbucket);
+
+	for (block = bidx; block <= (bidx + nblock - 1); block++) {
+		dentry_blk = dir_builder_get(db, block, ALLOC_NODE);
+		if (!dentry_blk)
+			return -ENOSPC;
+
+		bit_pos = room_for_filename(dentry_blk->dentry_bitmap,
+				slots, NR_DENTRY_IN_BLOCK);
+		if (bit_pos < NR_DENTRY_IN_BLOCK)
+			goto add_dentry;
+	}
+	level ++;
+	goto start;
+
+add_dentry:
+	make_dentry_ptr(&d, NULL, (void *)dentry_blk, 1);
+	f2fs_update_dentry(ino, file_type, &d, name, name_len, dentry_hash, bit_pos);
+	db->blks[block].dirty = true;
+
+	parent->i.i_current_depth = cpu_to_le32(current_depth);
+
+	if (file_type == F2FS_FT_DIR) {
+		u32 links = le32_to_cpu(parent->i.i_links);
+		parent->i.i_links = cpu_to_le32(links + 1);
+	}
+
+	if ((__u64)((block + 1) * F2FS_BLKSIZE) >
+					le64_to_cpu(parent->i.i_size))
+		parent->i.i_size = cpu_to_le64((block + 1) * F2FS_BLKSIZE);
+	return 0;
+}
+
+/* write each dirty dentry block once, then the parent inode */
+static void dir_builder_flush(struct dir_builder *db)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < db->nr_blks; i++) {
+		struct dir_builder_blk *b = db->blks + i;
+
+		if (b->dirty) {
+			ret = dev_write_block(b->blk, b->blkaddr);
+			ASSERT(ret >= 0);
+		}
+		free(b->blk);
+	}
+
+	ret = write_inode(db->parent, db->ni.blk_addr);
+	ASSERT(ret >= 0);
 
-	ret = f2fs_find_entry(sbi, parent, de);
+	free(db->blks);
+	free(db->parent);
+}
+
+static int dir_builder_create(struct dir_builder *db, struct dentry *de)
+{
+	struct f2fs_sb_info *sbi = db->sbi;
+	struct f2fs_node *child;
+	struct hardlink_cache_entry *found_hardlink = NULL;
+	struct node_info hardlink_ni;
+	struct f2fs_summary sum;
+	block_t blkaddr = NULL_ADDR;
+	int ret;
+
+	if (de->from_devino)
+		found_hardlink = f2fs_search_hardlink(sbi, de);
+
+	ret = dir_builder_find(db, de);
 	if (ret) {
 		MSG(0, "Skip the existing \"%s\" pino=%x ERR=%d\n",
 					de->name, de->pino, ret);
 		if (de->file_type == F2FS_FT_REG_FILE)
 			de->ino = 0;
-		goto free_parent_dir;
+		de->profile = 0;
+		return 0;
 	}
 
 	child = calloc(BLOCK_SZ, 1);
@@ -728,12 +1041,12 @@ int f2fs_create(struct f2fs_sb_info *sbi, struct dentry *de)
 		if (hardlink_ni.blk_addr == NULL_ADDR) {
 			MSG(1, "No original inode for hard link to_ino=%x\n",
 				found_hardlink->to_ino);
+			free(child);
 			return -1;
 		}
 
 		/* Use previously-recorded inode */
 		de->ino = found_hardlink->to_ino;
-		blkaddr = hardlink_ni.blk_addr;
 		MSG(1, "Info: Creating \"%s\" as hard link to inode %d\n",
 				de->path, de->ino);
 	} else {
@@ -742,14 +1055,14 @@ int f2fs_create(struct f2fs_sb_info *sbi, struct dentry *de)
 
 	init_inode_block(sbi, child, de);
 
-	ret = f2fs_add_link(sbi, parent, child->i.i_name,
+	ret = dir_builder_add(db, child->i.i_name,
 				le32_to_cpu(child->i.i_namelen),
 				le32_to_cpu(child->footer.ino),
-				map_de_type(le16_to_cpu(child->i.i_mode)),
-				ni.blk_addr, 1);
+				map_de_type(le16_to_cpu(child->i.i_mode)));
 	if (ret) {
 		MSG(0, "Skip the existing \"%s\" pino=%x ERR=%d\n",
 					de->name, de->pino, ret);
+		de->profile = 0;
 		goto free_child_dir;
 	}
 
@@ -758,34 +1071,30 @@ int f2fs_create(struct f2fs_sb_info *sbi, struct dentry *de)
 			MSG(2, "Adding inode %d from %s to hardlink cache\n",
 				de->ino, de->path);
 			found_hardlink->to_ino = de->ino;
+			found_hardlink->nlink = 1;
 		} else {
-			/* Replace child with original block */
-			free(child);
-
-			child = calloc(BLOCK_SZ, 1);
-			ASSERT(child);
-
-			ret = dev_read_block(child, blkaddr);
-			ASSERT(ret >= 0);
-
-			/* Increment links and skip to writing block */
-			child->i.i_links = cpu_to_le32(
-					le32_to_cpu(child->i.i_links) + 1);
+			/* i_links is set by f2fs_update_hardlinks() */
+			found_hardlink->nlink++;
 			MSG(2, "Number of links on inode %d is now %d\n",
-				de->ino, le32_to_cpu(child->i.i_links));
-			goto write_child_dir;
+				de->ino, found_hardlink->nlink);
+			goto free_child_dir;
 		}
 	}
 
+	/* written with the other profiled files once the tree is built */
+	if (de->profile) {
+		profile_defer(de, child, db->ni.version);
+		return 0;
+	}
+
 	/* write child */
-	set_summary(&sum, de->ino, 0, ni.version);
+	set_summary(&sum, de->ino, 0, db->ni.version);
 	ret = reserve_new_block(sbi, &blkaddr, &sum, CURSEG_HOT_NODE, 1);
 	ASSERT(!ret);
 
 	/* update nat info */
 	update_nat_blkaddr(sbi, de->ino, de->ino, blkaddr);
 
-write_child_dir:
 	ret = dev_write_block(child, blkaddr);
 	ASSERT(ret >= 0);
 
@@ -802,11 +1111,48 @@ write_child_dir:
 		de->pino);
 free_child_dir:
 	free(child);
-free_parent_dir:
-	free(parent);
 	return 0;
 }
 
+/*
+ * Create the directories, regular files and symlinks of @de, which all
+ * belong to the same parent, keeping the parent's dentry blocks in memory
+ * so that each of them is searched in memory and written only once.
+ */
+int f2fs_create_entries(struct f2fs_sb_info *sbi, struct dentry *de,
+								int entries)
+{
+	struct dir_builder db;
+	int ret = 0;
+	int i;
+
+	if (!entries)
+		return 0;
+
+	if (dir_builder_init(sbi, &db, de->pino))
+		return -1;
+
+	for (i = 0; i < entries; i++) {
+		ASSERT(de[i].pino == de->pino);
+		if (de[i].file_type != F2FS_FT_DIR &&
+				de[i].file_type != F2FS_FT_REG_FILE &&
+				de[i].file_type != F2FS_FT_SYMLINK)
+			continue;
+
+		ret = dir_builder_create(&db, de + i);
+		if (ret)
+			break;
+	}
+
+	dir_builder_flush(&db);
+	return ret;
+}
+
+int f2fs_create(struct f2fs_sb_info *sbi, struct dentry *de)
+{
+	return f2fs_create_entries(sbi, de, 1);
+}
+
 int f2fs_mkdir(struct f2fs_sb_info *sbi, struct dentry *de)
 {
 	return f2fs_create(sbi, de);
@@ -218,9 +218,46 @@ struct curseg_info {
 	unsigned int next_segno;                /* preallocated segment */
 };
 
+/*
+ * Free space index used by find_next_free_block(): full segments are
+ * skipped a word, or a word of words, at a time, and a search from the
+ * start of the main area resumes at the segment of the last hit for the
+ * same type and direction while no space has come back since.  It also
+ * keeps the count of get_free_segments().
+ */
+struct alloc_cursor {
+	unsigned int segno;	/* no earlier segment fits the type */
+	unsigned int gen;	/* free_seg_index gen when set */
+	bool not_enough;	/* empty segments were skipped */
+	bool valid;
+};
+
+struct free_seg_index {
+	unsigned long *full_map;	/* segment has no free block */
+	unsigned long *full_sum;	/* word of full_map is all set */
+	unsigned long *free_map;	/* usable segment has no valid block */
+	unsigned int nr_words;
+	unsigned int nr_sums;
+	unsigned int nr_free;		/* bits set in free_map */
+	unsigned int gen;		/* bumped when space may come back */
+	struct alloc_cursor cursor[NR_CURSEG_TYPE][2];
+};
+
+/* summary blocks updated outside fsck, written back once per segment */
+#define SUM_WB_CNT	16
+
+struct sum_wb_entry {
+	unsigned int segno;
+	u64 lastused;
+	struct f2fs_summary_block *sum_blk;	/* NULL if unused */
+};
+
 struct f2fs_sm_info {
 	struct sit_info *sit_info;
 	struct curseg_info *curseg_array;
+	struct free_seg_index fsi;
+	struct sum_wb_entry sum_wb[SUM_WB_CNT];
+	u64 sum_wb_tick;
 
 	block_t seg0_blkaddr;
 	block_t main_blkaddr;
@@ -259,6 +296,10 @@ struct dentry {
 	nid_t ino;
 	nid_t pino;
 	u64 from_devino;
+	u8 *data;		/* contents read ahead by sload workers */
+	u64 data_len;
+	struct dedup_group *dedup;	/* identical files, sload -D */
+	u32 profile;		/* rank in the access profile, sload -A */
 };
 
 /* different from dnode_of_data in kernel */
@@ -276,6 +317,24 @@ struct hardlink_cache_entry {
 	u64 from_devino;
 	nid_t to_ino;
 	int nbuild;
+	u32 nlink;		/* links made in the image so far */
+};
+
+#define HARDLINK_CHUNK_ENTRIES	256
+
+/* entries never move, so pointers to them stay valid */
+struct hardlink_chunk {
+	struct hardlink_chunk *next;
+	unsigned int used;
+	struct hardlink_cache_entry ents[HARDLINK_CHUNK_ENTRIES];
+};
+
+/* open addressing with linear probing, keyed by from_devino */
+struct hardlink_cache {
+	struct hardlink_cache_entry **slots;
+	unsigned int mask;	/* number of slots - 1 */
+	unsigned int nr;
+	struct hardlink_chunk *chunks;
 };
 
 struct f2fs_sb_info {
@@ -322,7 +381,7 @@ struct f2fs_sb_info {
 	bool seg_manager_done;
 
 	/* keep track of hardlinks so we can recreate them */
-	void *hardlink_cache;
+	struct hardlink_cache hardlink_cache;
 };
 
 static inline struct f2fs_super_block *F2FS_RAW_SUPER(struct f2fs_sb_info *sbi)
@@ -13,6 +13,8 @@
 #include "xattr.h"
 #include "quotaio.h"
 #include "dedup.h"
+#include "defer.h"
+#include "progress.h"
 #include "extra_fsck.h"
 #include "fsck_debug.h"
 #include "securec.h"
@@ -38,6 +40,7 @@ int f2fs_set_main_bitmap(struct f2fs_sb_info *sbi, u32 blk, int type)
 		DBG(1, "Wrong segment type [0x%x] %x -> %x",
 				GET_SEGNO(sbi, blk), se->type, type);
 		se->type = type;
+		invalidate_alloc_cursors(sbi);
 	}
 	return f2fs_set_bit(BLKOFF_FROM_MAIN(sbi, blk), fsck->main_area_bitmap);
 }
@@ -2049,6 +2052,26 @@ static void nullify_dentry(struct f2fs_dir_entry *dentry, int offs,
 	memset(*filename, 0, F2FS_SLOT_LEN);
 }
 
+/*
+ * Used instead of descending into the child when fsck->no_descend is set:
+ * only make sure the dentry points to an allocated inode.
+ */
+static int chk_dentry_target(struct f2fs_sb_info *sbi, u32 ino, char *en)
+{
+	struct node_info ni;
+
+	get_node_info(sbi, ino, &ni);
+	if (ni.ino != ino || !is_valid_data_blkaddr(ni.blk_addr) ||
+			!IS_VALID_BLK_ADDR(sbi, ni.blk_addr)) {
+		DMD_ADD_ERROR(LOG_TYP_FSCK, PR_NODE_INVALID_BLKADDR);
+		ASSERT_MSG("dentry %s points to unallocated ino 0x%x "
+				"[nat ino 0x%x blk_addr 0x%x]",
+				en, ino, ni.ino, ni.blk_addr);
+		return -EINVAL;
+	}
+	return 0;
+}
+
 static int __chk_dentries(struct f2fs_sb_info *sbi, int casefolded,
 			struct child_info *child,
 			u8 *bitmap, struct f2fs_dir_entry *dentry,
@@ -2068,7 +2091,7 @@ static int __chk_dentries(struct f2fs_sb_info *sbi, int casefolded,
 	int i, slots;
 
 	/* readahead inode blocks */
-	for (i = 0; i < max; i++) {
+	for (i = 0; i < max && !fsck->no_descend; i++) {
 		u32 ino;
 
 		if (test_bit_le(i, bitmap) == 0)
@@ -2212,9 +2235,19 @@ static int __chk_dentries(struct f2fs_sb_info *sbi, int casefolded,
 		cbc.cnt = 0;
 		cbc.cheader_pgofs = CHEADER_PGOFS_NONE;
 		child->i_namelen = name_len;
-		ret = fsck_chk_node_blk(sbi,
+		if (fsck->no_descend) {
+			ret = chk_dentry_target(sbi,
+					le32_to_cpu(dentry[i].ino), en);
+		} else if (progress_skip_dentry(sbi, child, i,
+					le32_to_cpu(dentry[i].ino))) {
+			ret = 0;
+		} else {
+			progress_enter(sbi, child, i);
+			ret = fsck_chk_node_blk(sbi,
 				NULL, le32_to_cpu(dentry[i].ino),
 				ftype, TYPE_INODE, &blk_cnt, &cbc, child);
+			progress_leave(sbi, child, i);
+		}
 
 		if (ret && c.fix_on) {
 			int j;
@@ -2350,7 +2383,9 @@ int fsck_chk_data_blk(struct f2fs_sb_info *sbi, int casefolded,
 		return -EINVAL;
 	}
 
-	if (is_valid_ssa_data_blk(sbi, blk_addr, parent_nid,
+	if (is_defer_data_chk(ftype)) {
+		defer_add_data_blk(sbi, blk_addr, parent_nid, idx_in_node);
+	} else if (is_valid_ssa_data_blk(sbi, blk_addr, parent_nid,
 						idx_in_node, ver)) {
 		DMD_ADD_ERROR(LOG_TYP_FSCK, PR_INVALID_SUM_DATA_BLOCK);
 		ASSERT_MSG("summary data block is not valid. [0x%x]",
@@ -2381,6 +2416,101 @@ int fsck_chk_data_blk(struct f2fs_sb_info *sbi, int casefolded,
 	return 0;
 }
 
+/*
+ * Check a data block saved by a deferred fsck run. Returns 1 if the block
+ * is not owned by @parent_nid anymore, which means the file was changed
+ * after the list was saved, and the entry should be skipped.
+ */
+int fsck_chk_deferred_data_blk(struct f2fs_sb_info *sbi, u32 blk_addr,
+		u32 parent_nid, u16 idx_in_node)
+{
+	struct f2fs_summary sum;
+	struct node_info ni;
+
+	if (!IS_VALID_BLK_ADDR(sbi, blk_addr))
+		return 1;
+
+	sum.nid = cpu_to_le32(parent_nid);
+	sum.ofs_in_node = cpu_to_le16(idx_in_node);
+	if (!is_valid_summary(sbi, &sum, blk_addr))
+		return 1;
+
+	get_node_info(sbi, parent_nid, &ni);
+	if (is_valid_ssa_data_blk(sbi, blk_addr, parent_nid,
+					idx_in_node, ni.version)) {
+		DMD_ADD_ERROR(LOG_TYP_FSCK, PR_INVALID_SUM_DATA_BLOCK);
+		ASSERT_MSG("summary data block is not valid. [0x%x] "
+				"pnid[0x%x] idx[0x%x]", blk_addr,
+				parent_nid, idx_in_node);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Check an inode block without walking its data and child nodes. Its xattr
+ * node and entries are checked as well if @xattr is set.
+ */
+int fsck_chk_inode_shallow(struct f2fs_sb_info *sbi, u32 nid,
+		enum FILE_TYPE ftype, bool xattr)
+{
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	u32 blk_cnt = 1;
+	int ret = -EINVAL;
+
+	node_blk = (struct f2fs_node *)calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk != NULL);
+
+	if (sanity_check_nid(sbi, nid, node_blk, ftype, TYPE_INODE, &ni))
+		goto out;
+
+	if (xattr && (fsck_chk_xattr_blk(sbi, nid,
+			le32_to_cpu(node_blk->i.i_xattr_nid), &blk_cnt) ||
+			fsck_chk_xattr_entries(sbi, node_blk)))
+		goto out;
+
+	if ((c.feature & cpu_to_le32(F2FS_FEATURE_INODE_CHKSUM)) &&
+				f2fs_has_extra_isize(&node_blk->i)) {
+		__u32 provided, calculated;
+
+		provided = le32_to_cpu(node_blk->i.i_inode_checksum);
+		calculated = f2fs_inode_chksum(node_blk);
+		if (provided != calculated) {
+			ASSERT_MSG("ino: 0x%x chksum:0x%x, but calculated one is: 0x%x",
+				nid, provided, calculated);
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	free(node_blk);
+	return ret;
+}
+
+/* check the summary entry of every node block in NAT */
+int fsck_chk_node_summaries(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	u32 nid, blk_addr;
+	int ret = 0;
+
+	for (nid = 0; nid < fsck->nr_nat_entries; nid++) {
+		blk_addr = le32_to_cpu(fsck->entries[nid].block_addr);
+		if (!is_valid_data_blkaddr(blk_addr) ||
+				!IS_VALID_BLK_ADDR(sbi, blk_addr))
+			continue;
+
+		if (is_valid_ssa_node_blk(sbi, nid, blk_addr)) {
+			DMD_ADD_ERROR(LOG_TYP_FSCK, PR_INVALID_SUM_NODE_BLOCK);
+			ASSERT_MSG("summary node block is not valid. [0x%x]",
+					nid);
+			ret = -EINVAL;
+		}
+	}
+	return ret;
+}
+
 int fsck_chk_orphan_node(struct f2fs_sb_info *sbi)
 {
 	u32 blk_cnt = 0;
@@ -3169,6 +3299,7 @@ int check_sit_types(struct f2fs_sb_info *sbi)
 			}
 		}
 	}
+	invalidate_alloc_cursors(sbi);
 	return err;
 }
 
@@ -3309,6 +3440,7 @@ static inline void release_block(struct f2fs_sb_info *sbi, u64 blkaddr, bool dea
 		f2fs_clear_bit(OFFSET_IN_SEG(sbi, blkaddr), (char *)se->cur_valid_map);
 		se->dirty = 1;
 		f2fs_clear_sit_bitmap(sbi, blkaddr);
+		update_free_seg_index(sbi, GET_SEGNO(sbi, blkaddr), true);
 	}
 }
 
@@ -3747,8 +3879,10 @@ int fsck_chk_curseg_info(struct f2fs_sb_info *sbi)
 			ASSERT_MSG("Incorrect curseg [%d]: segno [0x%x] "
 				   "type(SIT) [%d]", i, curseg->segno,
 				   se->type);
-			if (c.fix_on || c.preen_mode)
+			if (c.fix_on || c.preen_mode) {
 				se->type = i;
+				invalidate_alloc_cursors(sbi);
+			}
 			ret = -1;
 		}
 		if (i <= CURSEG_COLD_DATA && IS_SUM_DATA_SEG(sum_blk->footer)) {
@@ -4012,6 +4146,26 @@ int fsck_verify(struct f2fs_sb_info *sbi)
 	return ret;
 }
 
+/* for partial checks, which do not go through fsck_verify */
+void fsck_free_link_lists(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+
+	while (fsck->hard_link_list_head) {
+		struct hard_link_node *node = fsck->hard_link_list_head;
+
+		fsck->hard_link_list_head = node->next;
+		free(node);
+	}
+
+	while (fsck->dedup_inner_list_head) {
+		struct dedup_inner_node *node = fsck->dedup_inner_list_head;
+
+		fsck->dedup_inner_list_head = node->next;
+		free(node);
+	}
+}
+
 void fsck_free(struct f2fs_sb_info *sbi, bool caller_is_fsck)
 {
 	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
@@ -4036,6 +4190,9 @@ void fsck_free(struct f2fs_sb_info *sbi, bool caller_is_fsck)
 	if (fsck->entries)
 		free(fsck->entries);
 
+	defer_free_list(sbi);
+	progress_free(sbi);
+
 	if (tree_mark)
 		free(tree_mark);
 
@@ -30,6 +30,7 @@ enum {
 };
 
 struct quota_ctx;
+struct defer_entry;
 
 #define FSCK_UNMATCHED_EXTENT		0x00000001
 #define FSCK_INLINE_INODE		0x00000002
@@ -108,6 +109,24 @@ struct sum_cache {
 	struct f2fs_summary_block *sum_blk;
 	struct list_head list;
 };
+
+/*
+ * New addresses of moved blocks, applied by blkaddr_batch_flush() once per
+ * owning node block and NAT block.
+ */
+struct blkaddr_update {
+	nid_t nid;		/* owner of a data block, or the node block */
+	u16 ofs_in_node;	/* data blocks only */
+	bool is_node;
+	block_t new_addr;
+	unsigned int seq;	/* order added, the last update wins */
+};
+
+struct blkaddr_batch {
+	struct blkaddr_update *ent;
+	unsigned int nr;
+	unsigned int cap;
+};
 #define MAX_SUM_CACHE_CNT 20
 #define HASHTABLE_SIZE 10
 
@@ -164,6 +183,17 @@ struct f2fs_fsck {
 	/* SSA block cache LRU hash table: [0] for DATA, [1] for NODE */
 	struct list_head sum_cache_head[MAX_TYPE][HASHTABLE_SIZE];
 	int sum_cache_cnt[MAX_TYPE][HASHTABLE_SIZE];
+
+	/* data blocks whose SSA check is deferred, see defer.c */
+	struct defer_entry *defer_entries;
+	u32 nr_defer_entries;
+	u32 defer_entries_cap;
+
+	/* do not walk into children of directories, see target.c */
+	bool no_descend;
+
+	/* progress of the walk saved for a later run, see progress.c */
+	struct fsck_progress *progress;
 };
 
 #define BLOCK_SZ		4096
@@ -235,6 +265,10 @@ extern int fsck_chk_didnode_blk(struct f2fs_sb_info *, struct f2fs_inode *,
 		struct f2fs_compr_blk_cnt *, struct child_info *);
 extern int fsck_chk_data_blk(struct f2fs_sb_info *, int,
 		u32, struct child_info *, int, enum FILE_TYPE, u32, u16, u8, int);
+extern int fsck_chk_deferred_data_blk(struct f2fs_sb_info *, u32, u32, u16);
+extern int fsck_chk_inode_shallow(struct f2fs_sb_info *, u32,
+		enum FILE_TYPE, bool);
+extern int fsck_chk_node_summaries(struct f2fs_sb_info *);
 extern int fsck_chk_dentry_blk(struct f2fs_sb_info *, int,
 		u32, struct child_info *, int, int);
 int fsck_chk_inline_dentries(struct f2fs_sb_info *, struct f2fs_node *,
@@ -251,6 +285,8 @@ void print_cp_state(u32);
 extern void print_node_info(struct f2fs_sb_info *, struct f2fs_node *, int);
 extern void print_inode_info(struct f2fs_sb_info *, struct f2fs_node *, int);
 extern struct seg_entry *get_seg_entry(struct f2fs_sb_info *, unsigned int);
+extern unsigned char *get_seg_bitmap(struct f2fs_sb_info *,
+					struct seg_entry *);
 extern struct f2fs_summary_block *get_sum_block(struct f2fs_sb_info *,
 				unsigned int, int *);
 extern int get_sum_entry(struct f2fs_sb_info *, u32, struct f2fs_summary *);
@@ -268,11 +304,15 @@ extern void fsck_init(struct f2fs_sb_info *, bool);
 extern int fsck_verify(struct f2fs_sb_info *);
 /* only when caller from do_fsck, the caller_is_fsck = true */
 extern void fsck_free(struct f2fs_sb_info *, bool);
+extern void fsck_free_link_lists(struct f2fs_sb_info *);
 extern int f2fs_ra_meta_pages(struct f2fs_sb_info *, block_t, int, int);
 extern int f2fs_do_mount(struct f2fs_sb_info *);
 extern void f2fs_do_umount(struct f2fs_sb_info *);
 extern int f2fs_sparse_initialize_meta(struct f2fs_sb_info *);
 
+extern int flush_sit_journal_entries(struct f2fs_sb_info *);
+extern int flush_nat_journal_entries(struct f2fs_sb_info *);
+extern void flush_sum_wb(struct f2fs_sb_info *);
 extern void flush_journal_entries(struct f2fs_sb_info *);
 extern void update_curseg_info(struct f2fs_sb_info *, int);
 extern void zero_journal_entries(struct f2fs_sb_info *);
@@ -280,12 +320,20 @@ extern void flush_sit_entries(struct f2fs_sb_info *);
 extern void move_curseg_info(struct f2fs_sb_info *, u64, int);
 extern void write_curseg_info(struct f2fs_sb_info *);
 extern int find_next_free_block(struct f2fs_sb_info *, u64 *, int, int, bool);
+extern int start_fresh_section(struct f2fs_sb_info *, int);
+extern void update_free_seg_index(struct f2fs_sb_info *, unsigned int, bool);
+extern void invalidate_alloc_cursors(struct f2fs_sb_info *);
+extern void destroy_free_seg_index(struct f2fs_sb_info *);
 extern void duplicate_checkpoint(struct f2fs_sb_info *);
 extern void write_checkpoint(struct f2fs_sb_info *);
 extern void write_checkpoints(struct f2fs_sb_info *);
 extern void update_superblock(struct f2fs_super_block *, int);
 extern void update_data_blkaddr(struct f2fs_sb_info *, nid_t, u16, block_t);
 extern void update_nat_blkaddr(struct f2fs_sb_info *, nid_t, nid_t, block_t);
+extern void blkaddr_batch_add(struct f2fs_sb_info *, struct blkaddr_batch *,
+			struct f2fs_summary *, bool, block_t);
+extern void blkaddr_batch_flush(struct f2fs_sb_info *, struct blkaddr_batch *);
+extern void blkaddr_batch_free(struct blkaddr_batch *);
 
 extern void print_total_sectors(struct f2fs_super_block *, unsigned int);
 extern void print_raw_sb_info(struct f2fs_super_block *);
@@ -366,11 +414,15 @@ u64 f2fs_write(struct f2fs_sb_info *, nid_t, u8 *, u64, pgoff_t);
 u64 f2fs_write_compress_data(struct f2fs_sb_info *, nid_t, u8 *, u64, pgoff_t);
 u64 f2fs_write_addrtag(struct f2fs_sb_info *, nid_t, pgoff_t, unsigned int);
 void f2fs_filesize_update(struct f2fs_sb_info *, nid_t, u64);
+int bulkread(int, void *, size_t, bool *);
 
 int get_dnode_of_data(struct f2fs_sb_info *, struct dnode_of_data *,
 					pgoff_t, int);
 void make_dentry_ptr(struct f2fs_dentry_ptr *, struct f2fs_node *, void *, int);
+void init_inode_block(struct f2fs_sb_info *, struct f2fs_node *,
+						struct dentry *);
 int f2fs_create(struct f2fs_sb_info *, struct dentry *);
+int f2fs_create_entries(struct f2fs_sb_info *, struct dentry *, int);
 int f2fs_mkdir(struct f2fs_sb_info *, struct dentry *);
 int f2fs_symlink(struct f2fs_sb_info *, struct dentry *);
 int inode_set_selinux(struct f2fs_sb_info *, u32, const char *);
@@ -380,6 +432,11 @@ int f2fs_add_link(struct f2fs_sb_info *, struct f2fs_node *,
 		const unsigned char *, int, nid_t, int, block_t, int);
 struct hardlink_cache_entry *f2fs_search_hardlink(struct f2fs_sb_info *sbi,
 						struct dentry *de);
+void f2fs_init_hardlink_cache(struct f2fs_sb_info *);
+void f2fs_release_hardlink_cache(struct f2fs_sb_info *);
+int f2fs_for_each_hardlink(struct f2fs_sb_info *,
+		int (*)(struct f2fs_sb_info *, struct hardlink_cache_entry *));
+void f2fs_update_hardlinks(struct f2fs_sb_info *);
 void fsck_disconnect_file(struct f2fs_sb_info *sbi, nid_t ino, bool dealloc);
 
 /* xattr.c */
@@ -32,7 +32,10 @@ const char *fsck_time_get_phase_name(enum fsck_time_phase phase)
         [TIME_PHASE_CHK_FULL_FILE] = "FSCK_FULL_FILE",   /* recursive check for all files */
         [TIME_PHASE_FIX_DEDUP] = "FSCK_DEDUP",       /* check dedup inner node */
         [TIME_PHASE_FSCK_VERIFY] = "FSCK_VERIFY_CONSISTENCY",
-        [TIME_PHASE_NODE_XATTR] = "FSCK_XATTR"
+        [TIME_PHASE_NODE_XATTR] = "FSCK_XATTR",
+        [TIME_PHASE_CHK_DEFERRED] = "FSCK_DEFERRED_DATA",
+        [TIME_PHASE_CHK_TARGETED] = "FSCK_TARGETED",
+        [TIME_PHASE_CHK_SUBTREE] = "FSCK_SUBTREE"
     };
 
     if (phase >= TIME_PHASE_MAX) {
@@ -26,6 +26,9 @@ enum fsck_time_phase {
     TIME_PHASE_FIX_DEDUP,       /* check dedup inner node */
     TIME_PHASE_FSCK_VERIFY,
     TIME_PHASE_NODE_XATTR,
+    TIME_PHASE_CHK_DEFERRED,    /* background deferred data check */
+    TIME_PHASE_CHK_TARGETED,    /* check guided by kernel errors */
+    TIME_PHASE_CHK_SUBTREE,     /* check of given subtrees */
     TIME_PHASE_MAX
 };
 
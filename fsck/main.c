@@ -31,6 +31,11 @@
 #include "quotaio.h"
 #include "compress.h"
 #include "dedup.h"
+#include "defer.h"
+#include "target.h"
+#include "subtree.h"
+#include "progress.h"
+#include "f2fs_format_utils.h"
 
 struct f2fs_fsck gfsck;
 
@@ -83,6 +88,16 @@ void fsck_usage()
 	MSG(0, "  --no-kernel-check skips detecting kernel change\n");
 	MSG(0, "  --kernel-check checks kernel change\n");
 	MSG(0, "  --debug-cache to debug cache when -c is used\n");
+	MSG(0, "  --defer-data-check <file> skip data block summary checks"
+			" and save them to file\n");
+	MSG(0, "  --resume-data-check <file> verify data blocks saved by"
+			" --defer-data-check\n");
+	MSG(0, "  --targeted check only what the errors recorded by kernel"
+			" implicate\n");
+	MSG(0, "  --subtree <path|ino[,ino...]> check only the given subtrees,"
+			" can be repeated\n");
+	MSG(0, "  --progress <file> save progress to file periodically,"
+			" and resume from it\n");
 	exit(1);
 }
 
@@ -131,6 +146,7 @@ void resize_usage()
 	MSG(0, "  -C [encoding[:flag1,...]] Support casefolding with optional flags\n");
 	MSG(0, "  -V print the version number and exit\n");
 	MSG(0, "  --meta-no-change do not change meta layout\n");
+	MSG(0, "  --dry-run print the shrink plan without changing the device\n");
 	exit(1);
 }
 
@@ -138,8 +154,12 @@ void sload_usage()
 {
 	MSG(0, "\nUsage: sload.f2fs [options] device\n");
 	MSG(0, "[options]:\n");
+	MSG(0, "  -A access profile [files to place first, in order]\n");
 	MSG(0, "  -C fs_config\n");
+	MSG(0, "  -D share one copy of identical files (dedup feature)\n");
 	MSG(0, "  -f source directory [path of the source directory]\n");
+	MSG(0, "  -F size format the device first [bytes, 0: whole device]\n");
+	MSG(0, "  -j threads to read the source and compress clusters ahead\n");
 	MSG(0, "  -p product out directory\n");
 	MSG(0, "  -s file_contexts\n");
 	MSG(0, "  -S sparse_mode\n");
@@ -149,12 +169,15 @@ void sload_usage()
 	MSG(0, "  -c enable compression (default allow policy)\n");
 	MSG(0, "    ------------ Compression sub-options -----------------\n");
 	MSG(0, "    -L <log-of-blocks-per-cluster>, default 2\n");
-	MSG(0, "    -a <algorithm> compression algorithm, default LZ4\n");
+	MSG(0, "    -a <algorithm>[:<level>] compression algorithm, "
+			"lzo, lz4, lz4hc or zstd, default LZ4\n");
 	MSG(0, "    -x <ext> compress files except for these extensions.\n");
 	MSG(0, "    -i <ext> compress files with these extensions only.\n");
 	MSG(0, "    * -i or -x: use it many times for multiple extensions.\n");
 	MSG(0, "    * -i and -x cannot be used together..\n");
 	MSG(0, "    -m <num> min compressed blocks per cluster\n");
+	MSG(0, "    -k <num> stop compressing a file if its first <num> "
+			"clusters fail -m\n");
 	MSG(0, "    -r read only (to release unused blocks) for compressed "
 			"files\n");
 	MSG(0, "    ------------------------------------------------------\n");
@@ -243,6 +266,11 @@ void f2fs_parse_options(int argc, char *argv[])
 			{"kernel-check", no_argument, 0, 3},
 			{"debug-cache", no_argument, 0, 4},
 			{"permissive", no_argument, 0, 6},
+			{"defer-data-check", required_argument, 0, 7},
+			{"resume-data-check", required_argument, 0, 8},
+			{"targeted", no_argument, 0, 9},
+			{"subtree", required_argument, 0, 10},
+			{"progress", required_argument, 0, 11},
 			{0, 0, 0, 0}
 		};
 
@@ -271,6 +299,31 @@ void f2fs_parse_options(int argc, char *argv[])
 				c.permissive = true;
 				MSG(0, "Info: Enable permissive check\n");
 				break;
+			case 7:
+				c.defer_data_chk = DEFER_CHK_BOOT;
+				c.defer_list = optarg;
+				MSG(0, "Info: Defer data check to %s\n", optarg);
+				break;
+			case 8:
+				c.defer_data_chk = DEFER_CHK_RESUME;
+				c.defer_list = optarg;
+				MSG(0, "Info: Resume data check from %s\n", optarg);
+				break;
+			case 9:
+				c.targeted_chk = true;
+				MSG(0, "Info: Targeted check\n");
+				break;
+			case 10:
+				c.subtrees = realloc(c.subtrees,
+					(c.nr_subtrees + 1) * sizeof(char *));
+				ASSERT(c.subtrees);
+				c.subtrees[c.nr_subtrees++] = optarg;
+				MSG(0, "Info: Check subtree %s\n", optarg);
+				break;
+			case 11:
+				c.progress_file = optarg;
+				MSG(0, "Info: Save progress to %s\n", optarg);
+				break;
 			case 'a':
 				c.auto_fix = 1;
 				MSG(0, "Info: Fix the reported corruption.\n");
@@ -548,6 +601,7 @@ void f2fs_parse_options(int argc, char *argv[])
 		char *token;
 		struct option long_opt[] = {
 			{"meta-no-change", no_argument, 0, 1},
+			{"dry-run", no_argument, 0, 2},
 			{0, 0, 0, 0}
 		};
 
@@ -561,6 +615,10 @@ void f2fs_parse_options(int argc, char *argv[])
 				c.meta_no_change = true;
 				MSG(0, "Info: Meta no change\n");
 				break;
+			case 2:
+				c.dry_run = 1;
+				MSG(0, "Info: Dry run\n");
+				break;
 			case 'd':
 				if (!is_digits(optarg)) {
 					err = EWRONG_OPT;
@@ -622,7 +680,7 @@ void f2fs_parse_options(int argc, char *argv[])
 #endif
 	} else if (!strcmp("sload.f2fs", prog)) {
 #ifdef WITH_SLOAD
-		const char *option_string = "cL:a:i:x:m:rC:d:f:p:s:St:T:VP";
+		const char *option_string = "A:cL:a:i:x:k:m:rC:d:Df:F:j:p:s:St:T:VP";
 #ifdef HAVE_LIBSELINUX
 		int max_nr_opt = (int)sizeof(c.seopt_file) /
 			sizeof(c.seopt_file[0]);
@@ -636,10 +694,12 @@ void f2fs_parse_options(int argc, char *argv[])
 		c.compress.min_blocks = 1;
 		c.compress.filter_ops = &ext_filter;
 		while ((option = getopt(argc, argv, option_string)) != EOF) {
-			unsigned int i;
 			int val;
 
 			switch (option) {
+			case 'A':
+				c.sload_profile = absolute_path(optarg);
+				break;
 			case 'c': /* compression support */
 				c.compress.enabled = true;
 				break;
@@ -659,17 +719,11 @@ void f2fs_parse_options(int argc, char *argv[])
 				break;
 			case 'a': /* compression: choose algorithm */
 				c.compress.required = true;
-				c.compress.alg = MAX_COMPRESS_ALGS;
-				for (i = 0; i < MAX_COMPRESS_ALGS; i++) {
-					if (!strcmp(supported_comp_names[i],
-								optarg)) {
-						c.compress.alg = i;
-						break;
-					}
-				}
-				if (c.compress.alg == MAX_COMPRESS_ALGS) {
+				if (parse_compress_alg(optarg, &c.compress.alg,
+						&c.compress.level)) {
 					MSG(0, "\tError: Unknown compression"
-						" algorithm %s\n", optarg);
+						" algorithm or level %s\n",
+						optarg);
 					error_out(prog);
 				}
 				break;
@@ -704,6 +758,14 @@ void f2fs_parse_options(int argc, char *argv[])
 				}
 				c.compress.min_blocks = val;
 				break;
+			case 'k': /* give up files not compressing well */
+				if (!is_digits(optarg)) {
+					err = EWRONG_OPT;
+					break;
+				}
+				c.compress.required = true;
+				c.compress.probe_clusters = atoi(optarg);
+				break;
 			case 'r': /* for setting FI_COMPRESS_RELEASED */
 				c.compress.required = true;
 				c.compress.readonly = true;
@@ -720,9 +782,28 @@ void f2fs_parse_options(int argc, char *argv[])
 				MSG(0, "Info: Debug level = %d\n",
 						c.dbg_lv);
 				break;
+			case 'D':
+				c.sload_dedup = 1;
+				break;
 			case 'f':
 				c.from_dir = absolute_path(optarg);
 				break;
+			case 'F':
+				if (!is_digits(optarg)) {
+					err = EWRONG_OPT;
+					break;
+				}
+				c.sload_format = 1;
+				c.device_size = strtoull(optarg, &p, 0);
+				c.device_size &= ~((uint64_t)(F2FS_BLKSIZE - 1));
+				break;
+			case 'j':
+				if (!is_digits(optarg)) {
+					err = EWRONG_OPT;
+					break;
+				}
+				c.sload_threads = atoi(optarg);
+				break;
 			case 'p':
 				c.target_out_dir = absolute_path(optarg);
 				break;
@@ -789,6 +870,24 @@ void f2fs_parse_options(int argc, char *argv[])
 				error_out(prog);
 			}
 		}
+		if (err == NOERROR && c.sload_format) {
+			if (c.sparse_mode && !c.device_size) {
+				MSG(0, "\tError: -F needs the size of a sparse"
+					" image\n");
+				error_out(prog);
+			}
+			if (!c.sparse_mode && c.device_size) {
+				c.wanted_sector_size = DEFAULT_SECTOR_SIZE;
+				c.wanted_total_sectors =
+					c.device_size / DEFAULT_SECTOR_SIZE;
+			}
+			if (c.compress.enabled)
+				c.feature |= cpu_to_le32(F2FS_FEATURE_EXTRA_ATTR |
+						F2FS_FEATURE_COMPRESSION);
+			if (c.sload_dedup)
+				c.feature |= cpu_to_le32(F2FS_FEATURE_EXTRA_ATTR |
+						F2FS_FEATURE_DEDUP);
+		}
 #endif /* WITH_SLOAD */
 	} else if (!strcmp("f2fslabel", prog)) {
 #ifdef WITH_LABEL
@@ -866,6 +965,7 @@ static int do_fsck(struct f2fs_sb_info *sbi)
 	u32 flag = le32_to_cpu(ckpt->ckpt_flags);
 	u32 blk_cnt;
 	struct f2fs_compr_blk_cnt cbc;
+	bool resumed;
 	errcode_t ret;
 
 	if (c.permissive) {
@@ -873,10 +973,31 @@ static int do_fsck(struct f2fs_sb_info *sbi)
 		DMD_ADD_ERROR(LOG_TYP_FSCK, PR_PERMISSIVE_FSCK);
 	}
 
+	if (c.defer_data_chk == DEFER_CHK_RESUME) {
+		ret = defer_resume_list(sbi);
+		if (!ret)
+			return FSCK_SUCCESS;
+		if (ret != -EINVAL)
+			return FSCK_OPERATIONAL_ERROR;
+		if (!c.fix_on)
+			return FSCK_ERRORS_LEFT_UNCORRECTED;
+		MSG(0, "Info: Deferred data check failed, check all\n");
+	}
+
 	fsck_init(sbi, true);
 
 	print_cp_state(flag);
 
+	if (c.nr_subtrees) {
+		ret = fsck_chk_subtrees(sbi);
+		fsck_free(sbi, true);
+		if (ret < 0)
+			return FSCK_OPERATIONAL_ERROR;
+		if (ret)
+			return FSCK_ERRORS_LEFT_UNCORRECTED;
+		return c.bug_on ? FSCK_ERROR_CORRECTED : FSCK_SUCCESS;
+	}
+
 	fsck_chk_and_fix_write_pointers(sbi);
 
 	fsck_chk_curseg_info(sbi);
@@ -913,13 +1034,20 @@ static int do_fsck(struct f2fs_sb_info *sbi)
 		c.fix_on = 1;
 	}
 
+	if (c.targeted_chk && !fsck_chk_targeted(sbi)) {
+		fsck_free(sbi, true);
+		return FSCK_SUCCESS;
+	}
+
 	if (c.fix_on || c.bug_on) {
 		DMD_ADD_ERROR(LOG_TYP_FSCK, PR_FULL_DISK_FSCK);
 	}
 
 	fsck_chk_checkpoint(sbi);
 
-	fsck_chk_quota_node(sbi);
+	resumed = c.progress_file && progress_init(sbi);
+	if (!resumed)
+		fsck_chk_quota_node(sbi);
 
 	/* Traverse all block recursively from root inode */
 	blk_cnt = 1;
@@ -933,16 +1061,27 @@ static int do_fsck(struct f2fs_sb_info *sbi)
 			return FSCK_OPERATIONAL_ERROR;
 		}
 	}
-	fsck_chk_orphan_node(sbi);
+	if (resumed)
+		progress_load_quota(sbi);
+	else
+		fsck_chk_orphan_node(sbi);
 
 	TIME_TAG_POINT_START(TIME_PHASE_CHK_FULL_FILE);
+	progress_walk_start(sbi);
 	fsck_chk_node_blk(sbi, NULL, sbi->root_ino_num,
 			F2FS_FT_DIR, TYPE_INODE, &blk_cnt, &cbc, NULL);
+	ret = progress_walk_end(sbi);
 	TIME_TAG_POINT_END(TIME_PHASE_CHK_FULL_FILE);
+	if (ret) {
+		fsck_free(sbi, true);
+		return FSCK_OPERATIONAL_ERROR;
+	}
 	f2fs_fix_dedup_inner_list(sbi);
 	fsck_chk_quota_files(sbi);
 
 	ret = fsck_verify(sbi);
+	if (c.defer_data_chk != DEFER_CHK_NONE)
+		defer_save_list(sbi);
 	fsck_free(sbi, true);
 
 	if (!c.bug_on)
@@ -1081,6 +1220,31 @@ static int init_compr(struct f2fs_sb_info *sbi)
 	return 0;
 }
 
+/*
+ * sload -F: create the file system in this process, as mkfs.f2fs does, and
+ * load it right after.  The blocks mkfs wrote are still in the write-back
+ * journal (or the sparse image in memory), and it zeroed the SIT and NAT
+ * areas, so the mount reads nearly nothing from the device.
+ */
+static int sload_format_device(void)
+{
+	int ret = -1;
+
+	c.func = MKFS;
+	if (f2fs_get_device_info() < 0 || f2fs_get_f2fs_info() < 0)
+		goto out;
+	if (c.zoned_model != F2FS_ZONED_NONE) {
+		MSG(0, "\tError: Use mkfs.f2fs on zoned block devices\n");
+		goto out;
+	}
+	if (c.sparse_mode)
+		c.trim = 0;
+	ret = f2fs_format_device();
+out:
+	c.func = SLOAD;
+	return ret;
+}
+
 static int do_sload(struct f2fs_sb_info *sbi)
 {
 	if (!c.from_dir) {
@@ -1197,6 +1361,15 @@ int main(int argc, char **argv)
 	}
 
 	/* Get device */
+#ifdef WITH_SLOAD
+	if (c.sload_format) {
+		if (sload_format_device() < 0) {
+			SlogExit();
+			ret = -1;
+			goto quick_err;
+		}
+	} else
+#endif
 	if (f2fs_get_device_info() < 0 || f2fs_get_f2fs_info() < 0) {
 		SlogExit();
 		ret = -1;
@@ -1221,6 +1394,8 @@ fsck_again:
 
 	switch (c.func) {
 	case FSCK:
+		/* batch repair writes up to each checkpoint barrier */
+		dev_wb_init();
 		ret = do_fsck(sbi);
 		break;
 #ifdef WITH_DUMP
@@ -308,6 +308,64 @@ void quota_add_inode_usage(quota_ctx_t qctx, f2fs_ino_t ino,
 	}
 }
 
+/*
+ * Called from fsck to save the usage counted so far.
+ */
+void quota_for_each_usage(quota_ctx_t qctx,
+		void (*func)(enum quota_type, qid_t, struct dquot *, void *),
+		void *data)
+{
+	enum quota_type	qtype;
+	dnode_t		*n;
+
+	for (qtype = 0; qtype < MAXQUOTAS; qtype++) {
+		if (!qctx->quota_dict[qtype])
+			continue;
+		for (n = dict_first(qctx->quota_dict[qtype]); n;
+				n = dict_next(qctx->quota_dict[qtype], n))
+			if (dnode_get(n))
+				func(qtype, VOIDPTR_TO_UINT(dnode_getkey(n)),
+							dnode_get(n), data);
+	}
+}
+
+void quota_for_each_linked_inode(quota_ctx_t qctx,
+		void (*func)(f2fs_ino_t, void *), void *data)
+{
+	dnode_t		*n;
+
+	for (n = dict_first(&qctx->linked_inode_dict); n;
+			n = dict_next(&qctx->linked_inode_dict, n))
+		func(VOIDPTR_TO_UINT(dnode_getkey(n)), data);
+}
+
+/*
+ * Called from fsck to restore the usage saved by quota_for_each_usage()
+ * and quota_for_each_linked_inode().
+ */
+errcode_t quota_restore_usage(quota_ctx_t qctx, enum quota_type qtype,
+		qid_t id, qsize_t space, qsize_t inodes)
+{
+	struct dquot	*dq;
+
+	if (qtype >= MAXQUOTAS || !qctx->quota_dict[qtype])
+		return EINVAL;
+
+	dq = get_dq(qctx->quota_dict[qtype], id);
+	if (!dq)
+		return ENOMEM;
+	dq->dq_dqb.dqb_curspace = space;
+	dq->dq_dqb.dqb_curinodes = inodes;
+	return 0;
+}
+
+void quota_restore_linked_inode(quota_ctx_t qctx, f2fs_ino_t ino)
+{
+	if (!dict_lookup(&qctx->linked_inode_dict, UINT_TO_VOIDPTR(ino)))
+		dict_alloc_insert(&qctx->linked_inode_dict,
+					UINT_TO_VOIDPTR(ino), NULL);
+}
+
 struct scan_dquots_data {
 	dict_t		*quota_dict;
 	int             update_limits; /* update limits from disk */
@@ -106,8 +106,27 @@ unsigned int get_usable_seg_count(struct f2fs_sb_info *sbi)
 
 u32 get_free_segments(struct f2fs_sb_info *sbi)
 {
+	struct free_seg_index *fsi = &SM_I(sbi)->fsi;
 	u32 i, free_segs = 0;
 
+	/* the index counts empty current segments too */
+	if (fsi->free_map) {
+		free_segs = fsi->nr_free;
+		for (i = 0; i < NO_CHECK_TYPE; i++) {
+			u32 segno = CURSEG_I(sbi, i)->segno;
+			u32 j;
+
+			for (j = 0; j < i; j++)
+				if (CURSEG_I(sbi, j)->segno == segno)
+					break;
+			if (j == i && segno < MAIN_SEGS(sbi) &&
+					(fsi->free_map[segno / BITS_PER_LONG] &
+					(1UL << (segno % BITS_PER_LONG))))
+				free_segs--;
+		}
+		return free_segs;
+	}
+
 	for (i = 0; i < MAIN_SEGS(sbi); i++) {
 		struct seg_entry *se = get_seg_entry(sbi, i);
 
@@ -309,10 +328,10 @@ void print_inode_info(struct f2fs_sb_info *sbi,
 			DISP_u64(inode, i_compr_blocks);
 			DISP_u32(inode, i_compress_algrithm);
 			DISP_u32(inode, i_log_cluster_size);
-			DISP_u32(inode, i_padding);
+			DISP_u32(inode, i_compress_flag);
 		}
 		if (c.feature & cpu_to_le32(F2FS_FEATURE_DEDUP)) {
-			DISP_u64(inode, i_inner_ino);
+			DISP_u32(inode, i_inner_ino);
 			DISP_u32(inode, i_dedup_flags);
 			DISP_u32(inode, i_dedup_rsvd);
 		}
@@ -1782,6 +1801,7 @@ void reset_curseg(struct f2fs_sb_info *sbi, int type)
 	se = get_seg_entry(sbi, curseg->segno);
 	se->type = type;
 	se->dirty = 1;
+	invalidate_alloc_cursors(sbi);
 }
 
 static void read_compacted_summaries(struct f2fs_sb_info *sbi)
@@ -1904,11 +1924,92 @@ static void read_normal_summaries(struct f2fs_sb_info *sbi, int type)
 	free(sum_blk);
 }
 
+static void write_back_sum_wb(struct f2fs_sb_info *sbi,
+					struct sum_wb_entry *e)
+{
+	int ret;
+
+	ret = dev_write_block(e->sum_blk, GET_SUM_BLKADDR(sbi, e->segno));
+	ASSERT(ret >= 0);
+	free(e->sum_blk);
+	e->sum_blk = NULL;
+}
+
+void flush_sum_wb(struct f2fs_sb_info *sbi)
+{
+	int i;
+
+	for (i = 0; i < SUM_WB_CNT; i++)
+		if (SM_I(sbi)->sum_wb[i].sum_blk)
+			write_back_sum_wb(sbi, &SM_I(sbi)->sum_wb[i]);
+}
+
+static struct sum_wb_entry *lookup_sum_wb(struct f2fs_sb_info *sbi,
+							unsigned int segno)
+{
+	int i;
+
+	for (i = 0; i < SUM_WB_CNT; i++) {
+		struct sum_wb_entry *e = &SM_I(sbi)->sum_wb[i];
+
+		if (e->sum_blk && e->segno == segno)
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * Summary block of @segno kept for update_sum_entry(), or NULL for the
+ * segments of the checkpointed cursegs, whose summaries are in memory.
+ */
+static struct sum_wb_entry *get_sum_wb(struct f2fs_sb_info *sbi,
+							unsigned int segno)
+{
+	struct f2fs_sm_info *sm_i = SM_I(sbi);
+	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
+	struct sum_wb_entry *e, *victim = NULL;
+	int i, ret;
+
+	for (i = 0; i < NR_CURSEG_NODE_TYPE; i++)
+		if (segno == get_cp(cur_node_segno[i]))
+			return NULL;
+	for (i = 0; i < NR_CURSEG_DATA_TYPE; i++)
+		if (segno == get_cp(cur_data_segno[i]))
+			return NULL;
+
+	e = lookup_sum_wb(sbi, segno);
+	if (e)
+		goto out;
+
+	for (i = 0; i < SUM_WB_CNT; i++) {
+		e = &sm_i->sum_wb[i];
+		if (!e->sum_blk) {
+			victim = e;
+			break;
+		}
+		if (!victim || e->lastused < victim->lastused)
+			victim = e;
+	}
+	e = victim;
+	if (e->sum_blk)
+		write_back_sum_wb(sbi, e);
+
+	e->sum_blk = malloc(sizeof(struct f2fs_summary_block));
+	ASSERT(e->sum_blk);
+	ret = dev_read_block(e->sum_blk, GET_SUM_BLKADDR(sbi, segno));
+	ASSERT(ret >= 0);
+	e->segno = segno;
+out:
+	e->lastused = ++sm_i->sum_wb_tick;
+	return e;
+}
+
 void update_sum_entry(struct f2fs_sb_info *sbi, block_t blk_addr,
 					struct f2fs_summary *sum)
 {
 	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
 	struct f2fs_summary_block *sum_blk = NULL;
+	struct sum_wb_entry *e = NULL;
 	u32 segno, offset;
 	int type, ret;
 	struct seg_entry *se;
@@ -1926,6 +2027,10 @@ void update_sum_entry(struct f2fs_sb_info *sbi, block_t blk_addr,
 			sum_blk = get_sum_node_block_from_cache(sbi, segno, &type);
 		else
 			sum_blk = get_sum_data_block_from_cache(sbi, segno, &type);
+	} else {
+		e = get_sum_wb(sbi, segno);
+		if (e)
+			sum_blk = e->sum_blk;
 	}
 	if (!sum_blk)
 		sum_blk = get_sum_block(sbi, segno, &type);
@@ -1933,6 +2038,13 @@ void update_sum_entry(struct f2fs_sb_info *sbi, block_t blk_addr,
 	sum_blk->footer.entry_type = IS_NODESEG(se->type) ? SUM_TYPE_NODE :
 							SUM_TYPE_DATA;
 
+	/* kept ones are written once the segment is full or switched */
+	if (e) {
+		if (se->valid_blocks == sbi->blocks_per_seg)
+			write_back_sum_wb(sbi, e);
+		return;
+	}
+
 	/* write SSA all the time */
 	ret = dev_write_block(sum_blk, GET_SUM_BLKADDR(sbi, segno));
 	ASSERT(ret >= 0);
@@ -2201,6 +2313,7 @@ struct f2fs_summary_block *get_sum_block(struct f2fs_sb_info *sbi,
 	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
 	struct f2fs_summary_block *sum_blk;
 	struct curseg_info *curseg;
+	struct sum_wb_entry *e;
 	int type, ret;
 	u64 ssa_blk;
 
@@ -2248,8 +2361,13 @@ read_ssa_block:
 	sum_blk = calloc(BLOCK_SZ, 1);
 	ASSERT(sum_blk);
 
-	ret = dev_read_block(sum_blk, ssa_blk);
-	ASSERT(ret >= 0);
+	e = lookup_sum_wb(sbi, segno);
+	if (e) {
+		memcpy(sum_blk, e->sum_blk, BLOCK_SZ);
+	} else {
+		ret = dev_read_block(sum_blk, ssa_blk);
+		ASSERT(ret >= 0);
+	}
 
 	if (IS_SUM_NODE_SEG(sum_blk->footer))
 		*ret_type = SEG_TYPE_NODE;
@@ -2407,6 +2525,191 @@ update_cache:
 	}
 }
 
+#define BLKADDR_BATCH_MIN	1024
+#define BLKADDR_BATCH_MAX	(1 << 20)
+
+/* record that the block @sum describes now lives at @new_addr */
+void blkaddr_batch_add(struct f2fs_sb_info *sbi, struct blkaddr_batch *batch,
+			struct f2fs_summary *sum, bool is_node, block_t new_addr)
+{
+	struct blkaddr_update *u;
+
+	if (batch->nr == batch->cap) {
+		unsigned int cap = batch->cap ? batch->cap * 2 :
+							BLKADDR_BATCH_MIN;
+
+		u = NULL;
+		if (cap <= BLKADDR_BATCH_MAX)
+			u = realloc(batch->ent, cap * sizeof(*u));
+		if (u) {
+			batch->ent = u;
+			batch->cap = cap;
+		} else {
+			blkaddr_batch_flush(sbi, batch);
+			ASSERT(batch->cap);
+		}
+	}
+
+	u = &batch->ent[batch->nr];
+	u->nid = le32_to_cpu(sum->nid);
+	u->ofs_in_node = is_node ? 0 : le16_to_cpu(sum->ofs_in_node);
+	u->is_node = is_node;
+	u->new_addr = new_addr;
+	u->seq = batch->nr++;
+}
+
+static int blkaddr_update_cmp(const void *a, const void *b)
+{
+	const struct blkaddr_update *x = a, *y = b;
+
+	/* node blocks first, so that owners are found at their new place */
+	if (x->is_node != y->is_node)
+		return x->is_node ? -1 : 1;
+	if (x->nid != y->nid)
+		return x->nid < y->nid ? -1 : 1;
+	if (x->ofs_in_node != y->ofs_in_node)
+		return x->ofs_in_node < y->ofs_in_node ? -1 : 1;
+	return x->seq < y->seq ? -1 : 1;
+}
+
+/* NAT entries of moved node blocks, sorted by nid: one write per NAT block */
+static void blkaddr_flush_nats(struct f2fs_sb_info *sbi,
+			struct blkaddr_update *u, unsigned int n)
+{
+	struct f2fs_nat_block *nat_block;
+	struct f2fs_nat_entry raw_nat, *entry;
+	pgoff_t block_addr = 0, addr;
+	unsigned int i;
+	int ret;
+
+	nat_block = (struct f2fs_nat_block *)calloc(BLOCK_SZ, 1);
+	ASSERT(nat_block);
+
+	for (i = 0; i < n; i++) {
+		if (lookup_nat_in_journal(sbi, u[i].nid, &raw_nat) >= 0) {
+			update_nat_blkaddr(sbi, 0, u[i].nid, u[i].new_addr);
+			continue;
+		}
+
+		addr = current_nat_addr(sbi, u[i].nid, NULL);
+		if (addr != block_addr) {
+			if (block_addr) {
+				ret = dev_write_block(nat_block, block_addr);
+				ASSERT(ret >= 0);
+			}
+			ret = dev_read_block(nat_block, addr);
+			ASSERT(ret >= 0);
+			block_addr = addr;
+		}
+
+		entry = &nat_block->entries[u[i].nid % NAT_ENTRY_PER_BLOCK];
+		entry->block_addr = cpu_to_le32(u[i].new_addr);
+		if (c.func == FSCK)
+			F2FS_FSCK(sbi)->entries[u[i].nid] = *entry;
+	}
+	if (block_addr) {
+		ret = dev_write_block(nat_block, block_addr);
+		ASSERT(ret >= 0);
+	}
+	free(nat_block);
+}
+
+/* moved data blocks of one node block, like update_data_blkaddr() */
+static void blkaddr_flush_dnode(struct f2fs_sb_info *sbi,
+			struct blkaddr_update *u, unsigned int n,
+			struct f2fs_node *node_blk, struct f2fs_node *inode_blk)
+{
+	struct f2fs_node *inode = node_blk;
+	struct node_info ni, ino_ni;
+	block_t oldaddr, startaddr, endaddr;
+	__le32 *addrs;
+	bool is_inode, drop_extent = false;
+	unsigned int i;
+	int ret;
+
+	get_node_info(sbi, u[0].nid, &ni);
+	ret = dev_read_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+
+	is_inode = node_blk->footer.nid == node_blk->footer.ino;
+	if (is_inode) {
+		addrs = node_blk->i.i_addr + get_extra_isize(node_blk);
+	} else {
+		addrs = node_blk->dn.addr;
+		get_node_info(sbi, le32_to_cpu(node_blk->footer.ino), &ino_ni);
+		ret = dev_read_block(inode_blk, ino_ni.blk_addr);
+		ASSERT(ret >= 0);
+		inode = inode_blk;
+	}
+
+	startaddr = le32_to_cpu(inode->i.i_ext.blk_addr);
+	endaddr = startaddr + le32_to_cpu(inode->i.i_ext.len);
+
+	for (i = 0; i < n; i++) {
+		oldaddr = le32_to_cpu(addrs[u[i].ofs_in_node]);
+		addrs[u[i].ofs_in_node] = cpu_to_le32(u[i].new_addr);
+		if (oldaddr >= startaddr && oldaddr < endaddr)
+			drop_extent = true;
+	}
+	if (drop_extent)
+		inode->i.i_ext.len = 0;
+
+	if (is_inode) {
+		ret = write_inode(node_blk, ni.blk_addr);
+		ASSERT(ret >= 0);
+		return;
+	}
+	ret = dev_write_block(node_blk, ni.blk_addr);
+	ASSERT(ret >= 0);
+	if (drop_extent)
+		ASSERT(write_inode(inode_blk, ino_ni.blk_addr) >= 0);
+}
+
+/*
+ * Apply the recorded addresses: NAT entries first, then the data pointers
+ * of each node block, read and written once for all its moved blocks.
+ */
+void blkaddr_batch_flush(struct f2fs_sb_info *sbi, struct blkaddr_batch *batch)
+{
+	struct blkaddr_update *u = batch->ent;
+	struct f2fs_node *node_blk, *inode_blk;
+	unsigned int i, j, nr_nodes;
+
+	if (!batch->nr)
+		return;
+
+	qsort(u, batch->nr, sizeof(*u), blkaddr_update_cmp);
+
+	for (nr_nodes = 0; nr_nodes < batch->nr && u[nr_nodes].is_node;
+								nr_nodes++)
+		;
+	if (nr_nodes)
+		blkaddr_flush_nats(sbi, u, nr_nodes);
+
+	node_blk = calloc(BLOCK_SZ, 1);
+	inode_blk = calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk && inode_blk);
+
+	for (i = nr_nodes; i < batch->nr; i = j) {
+		for (j = i + 1; j < batch->nr && u[j].nid == u[i].nid; j++)
+			;
+		blkaddr_flush_dnode(sbi, u + i, j - i, node_blk, inode_blk);
+	}
+	free(node_blk);
+	free(inode_blk);
+
+	DBG(1, "Info: Updated %u node and %u data block addresses\n",
+				nr_nodes, batch->nr - nr_nodes);
+	batch->nr = 0;
+}
+
+void blkaddr_batch_free(struct blkaddr_batch *batch)
+{
+	free(batch->ent);
+	batch->ent = NULL;
+	batch->nr = batch->cap = 0;
+}
+
 void get_node_info(struct f2fs_sb_info *sbi, nid_t nid, struct node_info *ni)
 {
 	struct f2fs_nat_entry raw_nat;
@@ -2500,7 +2803,9 @@ static int build_sit_entries(struct f2fs_sb_info *sbi)
 		for (; segno < end && segno < MAIN_SEGS(sbi); segno++) {
 			se = &sit_i->sentries[segno];
 
-			get_current_sit_page(sbi, segno, sit_blk);
+			/* @segno starts on a block, read each block once */
+			if (!SIT_ENTRY_OFFSET(sit_i, segno))
+				get_current_sit_page(sbi, segno, sit_blk);
 			sit = sit_blk->entries[SIT_ENTRY_OFFSET(sit_i, segno)];
 
 			check_block_count(sbi, segno, &sit);
@@ -2564,6 +2869,9 @@ static int early_build_segment_manager(struct f2fs_sb_info *sbi)
 	sm_info->ovp_segments = get_cp(overprov_segment_count);
 	sm_info->main_segments = get_sb(segment_count_main);
 	sm_info->ssa_blkaddr = get_sb(ssa_blkaddr);
+	memset(&sm_info->fsi, 0, sizeof(struct free_seg_index));
+	memset(sm_info->sum_wb, 0, sizeof(sm_info->sum_wb));
+	sm_info->sum_wb_tick = 0;
 
 	if (build_sit_info(sbi) || build_curseg(sbi)) {
 		free(sm_info);
@@ -2684,10 +2992,12 @@ void rewrite_sit_area_bitmap(struct f2fs_sb_info *sbi)
 		ptr += SIT_VBLOCK_MAP_SIZE;
 	}
 
+	/* valid blocks were recounted, build the index again on use */
+	destroy_free_seg_index(sbi);
 	free(sit_blk);
 }
 
-static int flush_sit_journal_entries(struct f2fs_sb_info *sbi)
+int flush_sit_journal_entries(struct f2fs_sb_info *sbi)
 {
 	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_COLD_DATA);
 	struct f2fs_journal *journal = curseg->journal;
@@ -2724,7 +3034,7 @@ static int flush_sit_journal_entries(struct f2fs_sb_info *sbi)
 	return i;
 }
 
-static int flush_nat_journal_entries(struct f2fs_sb_info *sbi)
+int flush_nat_journal_entries(struct f2fs_sb_info *sbi)
 {
 	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_HOT_DATA);
 	struct f2fs_journal *journal = curseg->journal;
@@ -2766,6 +3076,12 @@ void flush_journal_entries(struct f2fs_sb_info *sbi)
 	int n_nats = flush_nat_journal_entries(sbi);
 	int n_sits = flush_sit_journal_entries(sbi);
 
+	/*
+	 * sload -F formatted the image in this process, nothing written
+	 * before the checkpoint at the end of the load has to survive a crash.
+	 */
+	if (c.func == SLOAD && c.sload_format)
+		return;
 	if (n_nats || n_sits)
 		write_checkpoints(sbi);
 }
@@ -2886,28 +3202,198 @@ static bool write_pointer_at_zone_start(struct f2fs_sb_info *UNUSED(sbi),
 
 #endif
 
-int find_next_free_block(struct f2fs_sb_info *sbi, u64 *to, int left,
-						int want_type, bool new_sec)
+static void set_seg_bits(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	struct free_seg_index *fsi = &SM_I(sbi)->fsi;
+	unsigned int w = segno / BITS_PER_LONG;
+	unsigned long mask = 1UL << (segno % BITS_PER_LONG);
+	struct seg_entry *se;
+	bool full = true, free = false;
+
+	if (segno < MAIN_SEGS(sbi)) {
+		se = get_seg_entry(sbi, segno);
+		full = get_seg_vblocks(sbi, se) == sbi->blocks_per_seg;
+		free = !se->valid_blocks && is_usable_seg(sbi, segno);
+	}
+
+	if (full)
+		fsi->full_map[w] |= mask;
+	else
+		fsi->full_map[w] &= ~mask;
+
+	if (free != !!(fsi->free_map[w] & mask)) {
+		fsi->free_map[w] ^= mask;
+		if (free)
+			fsi->nr_free++;
+		else
+			fsi->nr_free--;
+	}
+
+	mask = 1UL << (w % BITS_PER_LONG);
+	if (fsi->full_map[w] == ~0UL)
+		fsi->full_sum[w / BITS_PER_LONG] |= mask;
+	else
+		fsi->full_sum[w / BITS_PER_LONG] &= ~mask;
+}
+
+static int build_free_seg_index(struct f2fs_sb_info *sbi)
+{
+	struct free_seg_index *fsi = &SM_I(sbi)->fsi;
+	unsigned int segno;
+
+	fsi->nr_words = SIZE_ALIGN(MAIN_SEGS(sbi), BITS_PER_LONG);
+	fsi->nr_sums = SIZE_ALIGN(fsi->nr_words, BITS_PER_LONG);
+	fsi->nr_free = 0;
+	fsi->full_map = calloc(fsi->nr_words, sizeof(unsigned long));
+	fsi->full_sum = calloc(fsi->nr_sums, sizeof(unsigned long));
+	fsi->free_map = calloc(fsi->nr_words, sizeof(unsigned long));
+	if (!fsi->full_map || !fsi->full_sum || !fsi->free_map) {
+		destroy_free_seg_index(sbi);
+		return -ENOMEM;
+	}
+
+	/* segments past the main area and words past the map are full */
+	for (segno = 0; segno < fsi->nr_words * BITS_PER_LONG; segno++)
+		set_seg_bits(sbi, segno);
+	if (fsi->nr_words % BITS_PER_LONG)
+		fsi->full_sum[fsi->nr_sums - 1] |=
+				~0UL << (fsi->nr_words % BITS_PER_LONG);
+	fsi->gen++;
+	return 0;
+}
+
+void destroy_free_seg_index(struct f2fs_sb_info *sbi)
+{
+	struct free_seg_index *fsi = &SM_I(sbi)->fsi;
+
+	free(fsi->full_map);
+	free(fsi->full_sum);
+	free(fsi->free_map);
+	fsi->full_map = NULL;
+	fsi->full_sum = NULL;
+	fsi->free_map = NULL;
+	fsi->gen++;
+}
+
+/*
+ * Called after the valid blocks of @segno changed; @freed if some were
+ * released, which may make earlier segments fit again for any cursor.
+ */
+void update_free_seg_index(struct f2fs_sb_info *sbi, unsigned int segno,
+								bool freed)
+{
+	struct free_seg_index *fsi = &SM_I(sbi)->fsi;
+
+	if (freed)
+		fsi->gen++;
+	if (fsi->full_map && segno < MAIN_SEGS(sbi))
+		set_seg_bits(sbi, segno);
+}
+
+/* segment types or current segments changed, cursors may be stale */
+void invalidate_alloc_cursors(struct f2fs_sb_info *sbi)
+{
+	SM_I(sbi)->fsi.gen++;
+}
+
+/* first segment from @segno on in the direction of @left, not full */
+static int next_nonfull_seg(struct free_seg_index *fsi, unsigned int segno,
+								int left)
+{
+	long w = segno / BITS_PER_LONG;
+	long s;
+	unsigned long bits;
+	unsigned int shift = segno % BITS_PER_LONG;
+
+	if (w >= fsi->nr_words)
+		return -1;
+
+	if (!left)
+		bits = ~fsi->full_map[w] & (~0UL << shift);
+	else
+		bits = ~fsi->full_map[w] &
+				(~0UL >> (BITS_PER_LONG - 1 - shift));
+	if (bits)
+		goto found;
+
+	/* whole words of full segments, looked up in the summary */
+	for (w = left ? w - 1 : w + 1; w >= 0 && w < fsi->nr_words;
+						w = left ? w - 1 : w + 1) {
+		s = w / BITS_PER_LONG;
+		shift = w % BITS_PER_LONG;
+		if (!left)
+			bits = ~fsi->full_sum[s] & (~0UL << shift);
+		else
+			bits = ~fsi->full_sum[s] &
+				(~0UL >> (BITS_PER_LONG - 1 - shift));
+		if (!bits) {
+			w = left ? s * BITS_PER_LONG :
+					(s + 1) * BITS_PER_LONG - 1;
+			continue;
+		}
+		w = s * BITS_PER_LONG + (left ? BITS_PER_LONG - 1 -
+				__builtin_clzl(bits) : __builtin_ctzl(bits));
+		bits = ~fsi->full_map[w];
+		goto found;
+	}
+	return -1;
+found:
+	return w * BITS_PER_LONG + (left ? BITS_PER_LONG - 1 -
+				__builtin_clzl(bits) : __builtin_ctzl(bits));
+}
+
+/* first free block from @offset on in the direction of @left, or -1 */
+static int next_free_blkoff(struct f2fs_sb_info *sbi, unsigned char *bitmap,
+						int offset, int left)
+{
+	int step = left ? -1 : 1;
+
+	while (offset >= 0 && offset < (int)sbi->blocks_per_seg) {
+		/* whole bytes in use */
+		if (!(offset & 7) && !left && bitmap[offset >> 3] == 0xff) {
+			offset += 8;
+			continue;
+		}
+		if ((offset & 7) == 7 && left && bitmap[offset >> 3] == 0xff) {
+			offset -= 8;
+			continue;
+		}
+		if (!f2fs_test_bit(offset, (const char *)bitmap))
+			return offset;
+		offset += step;
+	}
+	return -1;
+}
+
+static int __find_next_free_block(struct f2fs_sb_info *sbi, u64 *to,
+			int left, int want_type, bool new_sec, int not_enough)
 {
 	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
+	struct free_seg_index *fsi = &SM_I(sbi)->fsi;
 	struct seg_entry *se;
 	u32 segno;
 	u32 offset;
-	int not_enough = 0;
 	u64 end_blkaddr = (get_sb(segment_count_main) <<
 			get_sb(log_blocks_per_seg)) + get_sb(main_blkaddr);
 
-	if (*to > 0)
-		*to -= left;
-	if (get_free_segments(sbi) <= SM_I(sbi)->reserved_segments + 1)
-		not_enough = 1;
-
 	while (*to >= SM_I(sbi)->main_blkaddr && *to < end_blkaddr) {
 		unsigned short vblocks;
 		unsigned char *bitmap;
 		unsigned char type;
+		int next;
 
 		segno = GET_SEGNO(sbi, *to);
+
+		if (fsi->full_map) {
+			next = next_nonfull_seg(fsi, segno, left);
+			if (next < 0)
+				return -1;
+			if ((u32)next != segno) {
+				segno = next;
+				*to = left ? START_BLOCK(sbi, segno + 1) - 1 :
+							START_BLOCK(sbi, segno);
+			}
+		}
 		offset = OFFSET_IN_SEG(sbi, *to);
 
 		se = get_seg_entry(sbi, segno);
@@ -2916,12 +3402,8 @@ int find_next_free_block(struct f2fs_sb_info *sbi, u64 *to, int left,
 		bitmap = get_seg_bitmap(sbi, se);
 		type = get_seg_type(sbi, se);
 
-		if (vblocks == sbi->blocks_per_seg) {
-next_segment:
-			*to = left ? START_BLOCK(sbi, segno) - 1:
-						START_BLOCK(sbi, segno + 1);
-			continue;
-		}
+		if (vblocks == sbi->blocks_per_seg)
+			goto next_segment;
 		if (!(get_sb(feature) & cpu_to_le32(F2FS_FEATURE_RO)) &&
 						IS_CUR_SEGNO(sbi, segno))
 			goto next_segment;
@@ -2934,7 +3416,8 @@ next_segment:
 
 			for (i = 1; i < sbi->segs_per_sec; i++) {
 				se2 = get_seg_entry(sbi, segno + i);
-				if (get_seg_vblocks(sbi, se2))
+				if (get_seg_vblocks(sbi, se2) ||
+						IS_CUR_SEGNO(sbi, segno + i))
 					break;
 			}
 
@@ -2945,15 +3428,94 @@ next_segment:
 			}
 		}
 
-		if (type == want_type && !new_sec &&
-			!f2fs_test_bit(offset, (const char *)bitmap))
-			return 0;
-
-		*to = left ? *to - 1: *to + 1;
+		/* only the block bitmap differs inside one segment */
+		if (type == want_type && !new_sec) {
+			next = next_free_blkoff(sbi, bitmap, offset, left);
+			if (next >= 0) {
+				*to = START_BLOCK(sbi, segno) + next;
+				return 0;
+			}
+		}
+next_segment:
+		*to = left ? START_BLOCK(sbi, segno) - 1:
+					START_BLOCK(sbi, segno + 1);
 	}
 	return -1;
 }
 
+int find_next_free_block(struct f2fs_sb_info *sbi, u64 *to, int left,
+						int want_type, bool new_sec)
+{
+	struct free_seg_index *fsi = &SM_I(sbi)->fsi;
+	struct alloc_cursor *cur = NULL;
+	u64 from;
+	int not_enough = 0;
+
+	if (!fsi->full_map && sbi->seg_manager_done)
+		build_free_seg_index(sbi);
+
+	/* searches from either end of the main area keep a cursor */
+	if (!new_sec && want_type >= 0 && want_type < NR_CURSEG_TYPE &&
+			c.zoned_model != F2FS_ZONED_HM &&
+			*to == (left ? __end_block_addr(sbi) :
+					SM_I(sbi)->main_blkaddr))
+		cur = &fsi->cursor[want_type][!!left];
+
+	if (*to > 0)
+		*to -= left;
+	if (get_free_segments(sbi) <= SM_I(sbi)->reserved_segments + 1)
+		not_enough = 1;
+
+	from = *to;
+	if (cur && cur->valid && cur->gen == fsi->gen &&
+			(!cur->not_enough || not_enough)) {
+		*to = left ? START_BLOCK(sbi, cur->segno + 1) - 1 :
+					START_BLOCK(sbi, cur->segno);
+		if (!__find_next_free_block(sbi, to, left, want_type,
+						new_sec, not_enough))
+			goto found;
+		*to = from;
+	}
+
+	if (__find_next_free_block(sbi, to, left, want_type, new_sec,
+							not_enough))
+		return -1;
+found:
+	if (cur) {
+		cur->segno = GET_SEGNO(sbi, *to);
+		cur->gen = fsi->gen;
+		cur->not_enough = not_enough;
+		cur->valid = true;
+	}
+	return 0;
+}
+
+/*
+ * Point the allocation cursor of @type at a free section, so the blocks
+ * of the type allocated next are laid out together instead of filling the
+ * partly used segments of the type first.
+ */
+int start_fresh_section(struct f2fs_sb_info *sbi, int type)
+{
+	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
+	struct free_seg_index *fsi = &SM_I(sbi)->fsi;
+	struct alloc_cursor *cur = &fsi->cursor[type][0];
+	u64 to = SM_I(sbi)->main_blkaddr;
+
+	if (c.zoned_model == F2FS_ZONED_HM ||
+			(get_sb(feature) & cpu_to_le32(F2FS_FEATURE_RO)))
+		return -EINVAL;
+
+	if (find_next_free_block(sbi, &to, 0, type, true))
+		return -ENOSPC;
+
+	cur->segno = GET_SEGNO(sbi, to);
+	cur->gen = fsi->gen;
+	cur->not_enough = false;
+	cur->valid = true;
+	return 0;
+}
+
 static void move_one_curseg_info(struct f2fs_sb_info *sbi, u64 from, int left,
 				 int i)
 {
@@ -2964,6 +3526,9 @@ static void move_one_curseg_info(struct f2fs_sb_info *sbi, u64 from, int left,
 	u64 ssa_blk, to;
 	int ret;
 
+	/* the segment switches, so do the kept summary blocks */
+	flush_sum_wb(sbi);
+
 	if ((get_sb(feature) & cpu_to_le32(F2FS_FEATURE_RO))) {
 		if (i != CURSEG_HOT_DATA && i != CURSEG_HOT_NODE)
 			return;
@@ -3227,6 +3792,8 @@ void write_checkpoint(struct f2fs_sb_info *sbi)
 	/* skip orphan blocks */
 	cp_blk_no += orphan_blks;
 
+	flush_sum_wb(sbi);
+
 	/* update summary blocks having nullified journal entries */
 	for (i = 0; i < NO_CHECK_TYPE; i++) {
 		struct curseg_info *curseg = CURSEG_I(sbi, i);
@@ -3937,6 +4504,8 @@ void f2fs_do_umount(struct f2fs_sb_info *sbi)
 	}
 
 	free(sm_i->curseg_array);
+	flush_sum_wb(sbi);
+	destroy_free_seg_index(sbi);
 	free(sbi->sm_info);
 
 	free(sbi->ckpt);
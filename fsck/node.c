@@ -280,6 +280,11 @@ int get_dnode_of_data(struct f2fs_sb_info *sbi, struct dnode_of_data *dn,
 			}
 
 			set_nid(parent, offset[i - 1], nids[i], i == 1);
+		} else if (!nids[i]) {
+			/* a hole: no node is allocated on this path yet */
+			dn->node_blk = calloc(BLOCK_SZ, 1);
+			ASSERT(dn->node_blk);
+			nblk[i] = NULL_ADDR;
 		} else {
 			/* If Sparse file no read API, */
 			struct node_info ni;
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * pipeline.c
+ *
+ * Read-ahead pipeline of sload. The writer, i.e. the main thread, walks
+ * the source tree as before and does every allocation and write in the
+ * same order, so the image is the same as the one built serially. Before
+ * walking the entries of a directory it queues a job for each of them:
+ * subdirectories are scanned and regular files are read into memory by
+ * worker threads in the meantime.
+ *
+ * Jobs of a directory are put in front of the queue, so workers follow
+ * the depth-first order of the writer. File data read ahead is bounded by
+ * PIPE_WINDOW. A job no worker has started yet when the writer needs it
+ * is taken back and done inline, so the writer never waits on the queue.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dirent.h>
+#include "pipeline.h"
+
+#ifndef _WIN32
+struct pipeline {
+	pthread_t threads[PIPE_MAX_THREADS];
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* job queued or window freed */
+	pthread_cond_t done;		/* job finished */
+	struct list_head queue;
+	u64 reserved;			/* bytes held by read jobs */
+	bool quit;
+};
+
+static struct pipeline pipe_ctx;
+
+static int filter_dot(const struct dirent *d)
+{
+	return (strcmp(d->d_name, "..") && strcmp(d->d_name, "."));
+}
+
+int scan_directory(const char *path, struct scan_dir *dir)
+{
+	struct dirent **namelist = NULL;
+	char *full_path;
+	int i, ret;
+
+	dir->ents = NULL;
+	dir->nr = scandir(path, &namelist, filter_dot, (void *)alphasort);
+	if (dir->nr < 0) {
+		dir->nr = -errno;
+		return dir->nr;
+	}
+
+	dir->ents = calloc(dir->nr ? dir->nr : 1, sizeof(struct scan_ent));
+	ASSERT(dir->ents);
+
+	for (i = 0; i < dir->nr; i++) {
+		struct scan_ent *ent = dir->ents + i;
+
+		ent->name = strdup(namelist[i]->d_name);
+		ASSERT(ent->name);
+		free(namelist[i]);
+
+		ret = asprintf(&full_path, "%s/%s", path, ent->name);
+		ASSERT(ret > 0);
+
+		if (lstat(full_path, &ent->st) < 0) {
+			ent->err = -errno;
+		} else if (S_ISLNK(ent->st.st_mode)) {
+			ent->link = calloc(F2FS_BLKSIZE, 1);
+			ASSERT(ent->link);
+			if (readlink(full_path, ent->link,
+						F2FS_BLKSIZE - 1) < 0)
+				ent->err = -errno;
+		}
+		free(full_path);
+	}
+	free(namelist);
+	return dir->nr;
+}
+
+void free_scan_dir(struct scan_dir *dir)
+{
+	int i;
+
+	if (!dir->ents)
+		return;
+
+	for (i = 0; i < dir->nr; i++) {
+		free(dir->ents[i].name);
+		free(dir->ents[i].link);
+	}
+	free(dir->ents);
+	dir->ents = NULL;
+	dir->nr = 0;
+}
+
+/*
+ * Read the whole file; bulkread() continues short reads.  The file must
+ * not have changed size since lstat(), or the writer reads it itself.
+ */
+static int read_file(struct pipe_job *job)
+{
+	int fd, n;
+	char byte;
+
+	fd = open(job->path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	job->data = malloc(job->size);
+	if (!job->data) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	n = bulkread(fd, job->data, job->size, NULL);
+	if (n < 0 || (u64)n < job->size || read(fd, &byte, 1) != 0) {
+		close(fd);
+		return -EAGAIN;
+	}
+	close(fd);
+	return 0;
+}
+
+/* head of the queue if the window allows it, called with the lock held */
+static struct pipe_job *next_job(void)
+{
+	struct pipe_job *job;
+
+	if (list_empty(&pipe_ctx.queue))
+		return NULL;
+
+	job = list_first_entry(&pipe_ctx.queue, struct pipe_job, list);
+	if (job->type == PIPE_READ &&
+			pipe_ctx.reserved + job->size > PIPE_WINDOW)
+		return NULL;
+	return job;
+}
+
+static void *pipe_worker(void *UNUSED(arg))
+{
+	struct pipe_job *job;
+	int err;
+
+	pthread_mutex_lock(&pipe_ctx.lock);
+	while (!pipe_ctx.quit) {
+		job = next_job();
+		if (!job) {
+			pthread_cond_wait(&pipe_ctx.work, &pipe_ctx.lock);
+			continue;
+		}
+		list_del(&job->list);
+		job->state = JOB_RUNNING;
+		if (job->type == PIPE_READ)
+			pipe_ctx.reserved += job->size;
+		pthread_mutex_unlock(&pipe_ctx.lock);
+
+		if (job->type == PIPE_SCAN)
+			err = scan_directory(job->path, &job->dir);
+		else
+			err = read_file(job);
+
+		pthread_mutex_lock(&pipe_ctx.lock);
+		job->err = err < 0 ? err : 0;
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&pipe_ctx.done);
+	}
+	pthread_mutex_unlock(&pipe_ctx.lock);
+	return NULL;
+}
+
+bool pipe_enabled(void)
+{
+	return pipe_ctx.nr_threads > 0;
+}
+
+int pipe_init(int nr_threads)
+{
+	int i;
+
+	if (nr_threads <= 0)
+		return 0;
+	if (nr_threads > PIPE_MAX_THREADS)
+		nr_threads = PIPE_MAX_THREADS;
+
+	memset(&pipe_ctx, 0, sizeof(pipe_ctx));
+	INIT_LIST_HEAD(&pipe_ctx.queue);
+	pthread_mutex_init(&pipe_ctx.lock, NULL);
+	pthread_cond_init(&pipe_ctx.work, NULL);
+	pthread_cond_init(&pipe_ctx.done, NULL);
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&pipe_ctx.threads[i], NULL,
+						pipe_worker, NULL)) {
+			MSG(0, "\tWarning: %d of %d sload threads started\n",
+							i, nr_threads);
+			break;
+		}
+	}
+	pipe_ctx.nr_threads = i;
+	if (!i) {
+		pthread_cond_destroy(&pipe_ctx.done);
+		pthread_cond_destroy(&pipe_ctx.work);
+		pthread_mutex_destroy(&pipe_ctx.lock);
+	}
+	return i;
+}
+
+void pipe_exit(void)
+{
+	int i;
+
+	if (!pipe_enabled())
+		return;
+
+	pthread_mutex_lock(&pipe_ctx.lock);
+	pipe_ctx.quit = true;
+	pthread_cond_broadcast(&pipe_ctx.work);
+	pthread_mutex_unlock(&pipe_ctx.lock);
+
+	for (i = 0; i < pipe_ctx.nr_threads; i++)
+		pthread_join(pipe_ctx.threads[i], NULL);
+	pipe_ctx.nr_threads = 0;
+
+	/* every job is owned, and released, by the directory queuing it */
+	ASSERT(list_empty(&pipe_ctx.queue));
+	pthread_cond_destroy(&pipe_ctx.done);
+	pthread_cond_destroy(&pipe_ctx.work);
+	pthread_mutex_destroy(&pipe_ctx.lock);
+}
+
+struct pipe_job *pipe_new_job(enum pipe_job_type type, const char *path,
+								u64 size)
+{
+	struct pipe_job *job;
+
+	if (!pipe_enabled())
+		return NULL;
+	if (type == PIPE_READ && (!size || size > PIPE_MAX_FILE))
+		return NULL;
+
+	job = calloc(1, sizeof(struct pipe_job));
+	ASSERT(job);
+	job->type = type;
+	job->state = JOB_INLINE;
+	job->path = strdup(path);
+	ASSERT(job->path);
+	job->size = size;
+	return job;
+}
+
+/* put @jobs in front of the queue, keeping their order; NULLs are skipped */
+void pipe_queue(struct pipe_job **jobs, int nr)
+{
+	struct list_head *next;
+	int i;
+
+	if (!pipe_enabled())
+		return;
+
+	pthread_mutex_lock(&pipe_ctx.lock);
+	next = pipe_ctx.queue.next;
+	for (i = 0; i < nr; i++) {
+		if (!jobs[i])
+			continue;
+		jobs[i]->state = JOB_QUEUED;
+		__list_add(&jobs[i]->list, next->prev, next);
+	}
+	pthread_cond_broadcast(&pipe_ctx.work);
+	pthread_mutex_unlock(&pipe_ctx.lock);
+}
+
+/*
+ * Return true if a worker has done @job without error. Otherwise @job is
+ * no longer queued, and the caller does the work itself.
+ */
+bool pipe_wait(struct pipe_job *job)
+{
+	bool ok;
+
+	if (!job)
+		return false;
+
+	pthread_mutex_lock(&pipe_ctx.lock);
+	if (job->state == JOB_QUEUED) {
+		list_del(&job->list);
+		job->state = JOB_INLINE;
+	}
+	while (job->state == JOB_RUNNING)
+		pthread_cond_wait(&pipe_ctx.done, &pipe_ctx.lock);
+	ok = job->state == JOB_DONE && !job->err;
+	pthread_mutex_unlock(&pipe_ctx.lock);
+	return ok;
+}
+
+void pipe_release(struct pipe_job *job)
+{
+	if (!job)
+		return;
+
+	pipe_wait(job);
+	if (job->type == PIPE_READ && job->state == JOB_DONE) {
+		pthread_mutex_lock(&pipe_ctx.lock);
+		pipe_ctx.reserved -= job->size;
+		pthread_cond_broadcast(&pipe_ctx.work);
+		pthread_mutex_unlock(&pipe_ctx.lock);
+	}
+	free_scan_dir(&job->dir);
+	free(job->data);
+	free(job->path);
+	free(job);
+}
+#else
+int scan_directory(const char *UNUSED(path), struct scan_dir *dir)
+{
+	dir->ents = NULL;
+	dir->nr = -EOPNOTSUPP;
+	return dir->nr;
+}
+
+void free_scan_dir(struct scan_dir *UNUSED(dir))
+{
+}
+
+bool pipe_enabled(void)
+{
+	return false;
+}
+
+int pipe_init(int UNUSED(nr_threads))
+{
+	return 0;
+}
+
+void pipe_exit(void)
+{
+}
+
+struct pipe_job *pipe_new_job(enum pipe_job_type UNUSED(type),
+				const char *UNUSED(path), u64 UNUSED(size))
+{
+	return NULL;
+}
+
+void pipe_queue(struct pipe_job **UNUSED(jobs), int UNUSED(nr))
+{
+}
+
+bool pipe_wait(struct pipe_job *UNUSED(job))
+{
+	return false;
+}
+
+void pipe_release(struct pipe_job *UNUSED(job))
+{
+}
+#endif
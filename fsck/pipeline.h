@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * pipeline.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <sys/stat.h>
+#include "fsck.h"
+
+#define PIPE_MAX_THREADS	64
+#ifndef PIPE_WINDOW
+#define PIPE_WINDOW		(64 << 20)	/* file data read ahead, bytes */
+#endif
+#define PIPE_MAX_FILE		(PIPE_WINDOW / 8) /* larger ones read inline */
+
+/* entry of a source directory */
+struct scan_ent {
+	char *name;
+	struct stat st;
+	char *link;		/* target of a symlink */
+	int err;		/* -errno of lstat() or readlink() */
+};
+
+struct scan_dir {
+	struct scan_ent *ents;	/* in alphasort order */
+	int nr;			/* -errno if scandir() failed */
+};
+
+enum pipe_job_type {
+	PIPE_SCAN,		/* scan a directory */
+	PIPE_READ,		/* read a regular file */
+};
+
+enum pipe_job_state {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_INLINE,		/* left to the writer */
+};
+
+struct pipe_job {
+	struct list_head list;
+	enum pipe_job_type type;
+	enum pipe_job_state state;
+	char *path;
+	int err;
+
+	struct scan_dir dir;	/* PIPE_SCAN */
+	u8 *data;		/* PIPE_READ */
+	u64 size;
+};
+
+int scan_directory(const char *path, struct scan_dir *dir);
+void free_scan_dir(struct scan_dir *dir);
+
+bool pipe_enabled(void);
+int pipe_init(int nr_threads);
+void pipe_exit(void);
+struct pipe_job *pipe_new_job(enum pipe_job_type type, const char *path,
+								u64 size);
+void pipe_queue(struct pipe_job **jobs, int nr);
+bool pipe_wait(struct pipe_job *job);
+void pipe_release(struct pipe_job *job);
+#endif /* _PIPELINE_H_ */
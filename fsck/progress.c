@@ -0,0 +1,794 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * progress.c
+ *
+ * Resumable walk of the directory tree. While no error has been found,
+ * the state of the walk is saved to the file given by --progress every
+ * PROGRESS_SAVE_INTERVAL seconds, right after a dentry is done. The record
+ * holds the frontier, i.e. the dentry position in each directory from root
+ * down to the one being walked, along with the bitmaps, counters and lists
+ * built so far.
+ *
+ * A later run loads the record if the checkpoint version and the digests
+ * of NAT and SIT bitmaps still match, and starts over otherwise. The
+ * directories of the frontier were only partly walked, so what they added
+ * themselves is dropped on load, and they are walked again with the
+ * dentries before the frontier counted but not descended into.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <limits.h>
+#include <sys/stat.h>
+#include "progress.h"
+#include "defer.h"
+#include "dedup.h"
+#include "quotaio.h"
+
+struct progress_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+static void buf_add(struct progress_buf *buf, const void *src, size_t len)
+{
+	if (buf->len + len > buf->cap) {
+		size_t cap = buf->cap ? buf->cap : BLOCK_SZ;
+		char *p;
+
+		while (cap < buf->len + len)
+			cap *= 2;
+		p = realloc(buf->data, cap);
+		ASSERT(p);
+		buf->data = p;
+		buf->cap = cap;
+	}
+	memcpy(buf->data + buf->len, src, len);
+	buf->len += len;
+}
+
+static void add_dquot(enum quota_type qtype, qid_t id, struct dquot *dq,
+								void *data)
+{
+	struct progress_dquot e;
+
+	e.qtype = cpu_to_le32(qtype);
+	e.id = cpu_to_le32(id);
+	e.space = cpu_to_le64(dq->dq_dqb.dqb_curspace);
+	e.inodes = cpu_to_le64(dq->dq_dqb.dqb_curinodes);
+	buf_add(data, &e, sizeof(e));
+}
+
+static void add_linked_inode(f2fs_ino_t ino, void *data)
+{
+	__le32 e = cpu_to_le32(ino);
+
+	buf_add(data, &e, sizeof(e));
+}
+
+static void remove_record(void)
+{
+	if (unlink(c.progress_file) && errno != ENOENT)
+		MSG(0, "\tError: failed to remove %s: %s\n",
+					c.progress_file, strerror(errno));
+}
+
+static int write_record(struct progress_head *head, struct progress_buf *buf,
+						struct f2fs_fsck *fsck)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", c.progress_file) >=
+							(int)sizeof(tmp)) {
+		MSG(0, "\tError: progress file path is too long\n");
+		return -1;
+	}
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		MSG(0, "\tError: failed to create %s: %s\n",
+						tmp, strerror(errno));
+		return -1;
+	}
+	if (fwrite(head, sizeof(*head), 1, fp) != 1 ||
+			fwrite(buf->data, buf->len, 1, fp) != 1 ||
+			fwrite(fsck->main_area_bitmap,
+				fsck->main_area_bitmap_sz, 1, fp) != 1 ||
+			fwrite(fsck->nat_area_bitmap,
+				fsck->nat_area_bitmap_sz, 1, fp) != 1 ||
+			fflush(fp) || fsync(fileno(fp))) {
+		MSG(0, "\tError: failed to write %s: %s\n",
+						tmp, strerror(errno));
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(fp);
+
+	if (rename(tmp, c.progress_file)) {
+		MSG(0, "\tError: failed to rename %s: %s\n",
+						tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* @last is the position in the directory being walked */
+static int save_record(struct f2fs_sb_info *sbi, struct progress_pos *last)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct fsck_progress *p = fsck->progress;
+	struct progress_buf buf = { NULL, 0, 0 };
+	struct progress_head head;
+	struct progress_chk chk;
+	struct progress_link e;
+	struct hard_link_node *hl;
+	struct dedup_inner_node *dn;
+	u32 nr_links = 0, nr_dedup = 0;
+	size_t len;
+	u32 crc;
+	int i, ret;
+
+	memset(&head, 0, sizeof(head));
+	head.magic = cpu_to_le32(PROGRESS_MAGIC);
+	head.cp_ver = F2FS_CKPT(sbi)->checkpoint_ver;
+	head.nat_crc = cpu_to_le32(p->nat_crc);
+	head.sit_crc = cpu_to_le32(p->sit_crc);
+	head.defer_data_chk = cpu_to_le32(c.defer_data_chk);
+	head.depth = cpu_to_le32(p->depth + 1);
+
+	buf_add(&buf, p->stack, p->depth * sizeof(struct progress_pos));
+	buf_add(&buf, last, sizeof(*last));
+
+	memset(&chk, 0, sizeof(chk));
+	chk.checked_node_cnt = cpu_to_le64(fsck->chk.checked_node_cnt);
+	chk.valid_blk_cnt = cpu_to_le64(fsck->chk.valid_blk_cnt);
+	chk.valid_node_cnt = cpu_to_le32(fsck->chk.valid_node_cnt);
+	chk.valid_inode_cnt = cpu_to_le32(fsck->chk.valid_inode_cnt);
+	chk.multi_hard_link_files =
+			cpu_to_le32(fsck->chk.multi_hard_link_files);
+	for (i = 0; i < F2FS_MAX_QUOTAS; i++) {
+		chk.qf_szchk_type[i] = cpu_to_le32(qf_szchk_type[i]);
+		chk.qf_last_blkofs[i] = cpu_to_le32(qf_last_blkofs[i]);
+		chk.qf_maxsize[i] = cpu_to_le64(qf_maxsize[i]);
+	}
+	buf_add(&buf, &chk, sizeof(chk));
+
+	e.is_valid = 0;
+	for (hl = fsck->hard_link_list_head; hl; hl = hl->next) {
+		e.nid = cpu_to_le32(hl->nid);
+		e.links = cpu_to_le32(hl->links);
+		e.actual_links = cpu_to_le32(hl->actual_links);
+		buf_add(&buf, &e, sizeof(e));
+		nr_links++;
+	}
+	for (dn = fsck->dedup_inner_list_head; dn; dn = dn->next) {
+		e.nid = cpu_to_le32(dn->nid);
+		e.links = cpu_to_le32(dn->links);
+		e.actual_links = cpu_to_le32(dn->actual_links);
+		e.is_valid = cpu_to_le32(dn->is_valid);
+		buf_add(&buf, &e, sizeof(e));
+		nr_dedup++;
+	}
+	head.nr_links = cpu_to_le32(nr_links);
+	head.nr_dedup = cpu_to_le32(nr_dedup);
+
+	if (fsck->qctx) {
+		len = buf.len;
+		quota_for_each_usage(fsck->qctx, add_dquot, &buf);
+		head.nr_dquots = cpu_to_le32((buf.len - len) /
+					sizeof(struct progress_dquot));
+		len = buf.len;
+		quota_for_each_linked_inode(fsck->qctx, add_linked_inode, &buf);
+		head.nr_linked = cpu_to_le32((buf.len - len) / sizeof(__le32));
+	}
+
+	buf_add(&buf, fsck->defer_entries,
+			fsck->nr_defer_entries * sizeof(struct defer_entry));
+	head.nr_defer = cpu_to_le32(fsck->nr_defer_entries);
+
+	head.main_bitmap_sz = cpu_to_le64(fsck->main_area_bitmap_sz);
+	head.nat_bitmap_sz = cpu_to_le32(fsck->nat_area_bitmap_sz);
+
+	crc = f2fs_cal_crc32(F2FS_SUPER_MAGIC, buf.data, buf.len);
+	crc = f2fs_cal_crc32(crc, fsck->main_area_bitmap,
+					fsck->main_area_bitmap_sz);
+	crc = f2fs_cal_crc32(crc, fsck->nat_area_bitmap,
+					fsck->nat_area_bitmap_sz);
+	head.crc = cpu_to_le32(crc);
+
+	/* repairs kept in the write-back journal must not be skipped */
+	if (c.fix_on && f2fs_fsync_device() < 0) {
+		free(buf.data);
+		return -1;
+	}
+	ret = write_record(&head, &buf, fsck);
+	free(buf.data);
+	if (!ret)
+		DBG(1, "Progress saved, %u directories deep\n", p->depth + 1);
+	return ret;
+}
+
+static void undo_blk(struct f2fs_sb_info *sbi, block_t blkaddr, u32 pgofs,
+								u32 end)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+
+	/* NEW_ADDR is counted but not marked, count it by position */
+	if (blkaddr == NEW_ADDR) {
+		if (pgofs <= end)
+			fsck->chk.valid_blk_cnt--;
+		return;
+	}
+	if (!is_valid_data_blkaddr(blkaddr) ||
+			!IS_VALID_BLK_ADDR(sbi, blkaddr) ||
+			!f2fs_test_main_bitmap(sbi, blkaddr))
+		return;
+
+	f2fs_clear_main_bitmap(sbi, blkaddr);
+	fsck->chk.valid_blk_cnt--;
+}
+
+/* returns false if the node was not reached by the walk */
+static bool undo_node(struct f2fs_sb_info *sbi, nid_t nid,
+					struct f2fs_node *node_blk)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct node_info ni;
+
+	if (!nid || !IS_VALID_NID(sbi, nid))
+		return false;
+
+	get_node_info(sbi, nid, &ni);
+	if (!is_valid_data_blkaddr(ni.blk_addr) ||
+			!IS_VALID_BLK_ADDR(sbi, ni.blk_addr) ||
+			!f2fs_test_main_bitmap(sbi, ni.blk_addr))
+		return false;
+
+	f2fs_clear_main_bitmap(sbi, ni.blk_addr);
+	f2fs_set_bit(nid, fsck->nat_area_bitmap);
+	fsck->chk.valid_blk_cnt--;
+	fsck->chk.valid_node_cnt--;
+
+	if (node_blk)
+		ASSERT(dev_read_block(node_blk, ni.blk_addr) >= 0);
+	return true;
+}
+
+static void undo_tree(struct f2fs_sb_info *sbi, struct f2fs_inode *inode,
+			nid_t nid, int level, u32 *pgofs, u32 end)
+{
+	struct f2fs_node *node_blk;
+	u32 span = ADDRS_PER_BLOCK(inode);
+	int i;
+
+	for (i = 0; i < level; i++)
+		span *= NIDS_PER_BLOCK;
+
+	node_blk = calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk);
+
+	if (!undo_node(sbi, nid, node_blk)) {
+		*pgofs += span;
+		goto out;
+	}
+
+	if (!level) {
+		for (i = 0; i < ADDRS_PER_BLOCK(inode); i++)
+			undo_blk(sbi, le32_to_cpu(node_blk->dn.addr[i]),
+							(*pgofs)++, end);
+		goto out;
+	}
+	for (i = 0; i < NIDS_PER_BLOCK; i++)
+		undo_tree(sbi, inode, le32_to_cpu(node_blk->in.nid[i]),
+						level - 1, pgofs, end);
+out:
+	free(node_blk);
+}
+
+/*
+ * Drop what a directory of the frontier added by itself: its inode, xattr
+ * and index nodes, and the dentry blocks up to @end. Its children have
+ * either been done, or are in the frontier and dropped on their own.
+ */
+static void undo_dir(struct f2fs_sb_info *sbi, nid_t ino, u32 end)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct f2fs_node *node_blk;
+	u32 pgofs = 0;
+	int ofs, idx;
+
+	node_blk = calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk);
+
+	if (!undo_node(sbi, ino, node_blk))
+		goto out;
+	fsck->chk.valid_inode_cnt--;
+
+	undo_node(sbi, le32_to_cpu(node_blk->i.i_xattr_nid), NULL);
+	if (node_blk->i.i_inline & F2FS_INLINE_DENTRY)
+		goto out;
+
+	ofs = get_extra_isize(node_blk);
+	for (idx = 0; idx < ADDRS_PER_INODE(&node_blk->i); idx++)
+		undo_blk(sbi, le32_to_cpu(node_blk->i.i_addr[ofs + idx]),
+							pgofs++, end);
+	for (idx = 0; idx < 5; idx++)
+		undo_tree(sbi, &node_blk->i, le32_to_cpu(node_blk->i.i_nid[idx]),
+				idx < 2 ? 0 : (idx < 4 ? 1 : 2), &pgofs, end);
+out:
+	free(node_blk);
+}
+
+/* each entry of the frontier must still point to the next one */
+static bool chk_frontier(struct f2fs_sb_info *sbi, struct progress_pos *pos,
+							u32 depth)
+{
+	struct f2fs_dentry_ptr d;
+	struct dnode_of_data dn;
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	void *dentry_blk;
+	nid_t ino;
+	u32 i, slot;
+
+	node_blk = calloc(BLOCK_SZ, 1);
+	dentry_blk = calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk && dentry_blk);
+
+	for (i = 0; i < depth; i++) {
+		ino = le32_to_cpu(pos[i].ino);
+		slot = le32_to_cpu(pos[i].slot);
+
+		if (!IS_VALID_NID(sbi, ino))
+			break;
+		get_node_info(sbi, ino, &ni);
+		if (!is_valid_data_blkaddr(ni.blk_addr) ||
+				!IS_VALID_BLK_ADDR(sbi, ni.blk_addr))
+			break;
+		ASSERT(dev_read_block(node_blk, ni.blk_addr) >= 0);
+		if (!S_ISDIR(le16_to_cpu(node_blk->i.i_mode)))
+			break;
+
+		if (node_blk->i.i_inline & F2FS_INLINE_DENTRY) {
+			if (pos[i].pgofs)
+				break;
+			make_dentry_ptr(&d, node_blk,
+					inline_data_addr(node_blk), 2);
+		} else {
+			memset(&dn, 0, sizeof(dn));
+			set_new_dnode(&dn, node_blk, NULL, ino);
+			get_dnode_of_data(sbi, &dn,
+					le32_to_cpu(pos[i].pgofs), LOOKUP_NODE);
+			if (dn.node_blk && dn.node_blk != dn.inode_blk)
+				free(dn.node_blk);
+			if (!is_valid_data_blkaddr(dn.data_blkaddr) ||
+					!IS_VALID_BLK_ADDR(sbi, dn.data_blkaddr))
+				break;
+			ASSERT(dev_read_block(dentry_blk,
+						dn.data_blkaddr) >= 0);
+			make_dentry_ptr(&d, NULL, dentry_blk, 1);
+		}
+
+		if (slot >= (u32)d.max || !test_bit_le(slot, d.bitmap))
+			break;
+		if (i + 1 < depth && le32_to_cpu(d.dentry[slot].ino) !=
+						le32_to_cpu(pos[i + 1].ino))
+			break;
+	}
+
+	free(dentry_blk);
+	free(node_blk);
+	return i == depth;
+}
+
+static void load_links(struct f2fs_sb_info *sbi, struct progress_link *e,
+						u32 nr_links, u32 nr_dedup)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct hard_link_node **hl = &fsck->hard_link_list_head;
+	struct dedup_inner_node **dn = &fsck->dedup_inner_list_head;
+	u32 i;
+
+	/* keep the lists sorted by nid as they were saved */
+	while (*hl)
+		hl = &(*hl)->next;
+	for (i = 0; i < nr_links; i++, e++) {
+		*hl = calloc(sizeof(struct hard_link_node), 1);
+		ASSERT(*hl);
+		(*hl)->nid = le32_to_cpu(e->nid);
+		(*hl)->links = le32_to_cpu(e->links);
+		(*hl)->actual_links = le32_to_cpu(e->actual_links);
+		hl = &(*hl)->next;
+	}
+
+	while (*dn)
+		dn = &(*dn)->next;
+	for (i = 0; i < nr_dedup; i++, e++) {
+		*dn = calloc(sizeof(struct dedup_inner_node), 1);
+		ASSERT(*dn);
+		(*dn)->nid = le32_to_cpu(e->nid);
+		(*dn)->links = le32_to_cpu(e->links);
+		(*dn)->actual_links = le32_to_cpu(e->actual_links);
+		(*dn)->is_valid = le32_to_cpu(e->is_valid);
+		dn = &(*dn)->next;
+	}
+}
+
+static void load_nat_bitmap(struct f2fs_sb_info *sbi, char *bitmap)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	u32 i, nid;
+
+	/* nids reached by the saved walk must not be reused either */
+	for (i = 0; i < fsck->nat_area_bitmap_sz; i++) {
+		if (!(fsck->nat_area_bitmap[i] & ~bitmap[i]))
+			continue;
+		for (nid = i << 3; nid < (i + 1) << 3; nid++)
+			if (IS_VALID_NID(sbi, nid) &&
+					f2fs_test_bit(nid, fsck->nat_area_bitmap) &&
+					!f2fs_test_bit(nid, bitmap))
+				f2fs_set_bit(nid, NM_I(sbi)->nid_bitmap);
+	}
+	memcpy(fsck->nat_area_bitmap, bitmap, fsck->nat_area_bitmap_sz);
+}
+
+static void load_chk(struct f2fs_fsck *fsck, struct progress_chk *chk)
+{
+	int i;
+
+	fsck->chk.checked_node_cnt = le64_to_cpu(chk->checked_node_cnt);
+	fsck->chk.valid_blk_cnt = le64_to_cpu(chk->valid_blk_cnt);
+	fsck->chk.valid_node_cnt = le32_to_cpu(chk->valid_node_cnt);
+	fsck->chk.valid_inode_cnt = le32_to_cpu(chk->valid_inode_cnt);
+	fsck->chk.multi_hard_link_files =
+			le32_to_cpu(chk->multi_hard_link_files);
+	for (i = 0; i < F2FS_MAX_QUOTAS; i++) {
+		qf_szchk_type[i] = le32_to_cpu(chk->qf_szchk_type[i]);
+		qf_last_blkofs[i] = le32_to_cpu(chk->qf_last_blkofs[i]);
+		qf_maxsize[i] = le64_to_cpu(chk->qf_maxsize[i]);
+	}
+}
+
+static int chk_head(struct f2fs_sb_info *sbi, struct progress_head *head,
+							u64 *len)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct fsck_progress *p = fsck->progress;
+
+	if (le32_to_cpu(head->magic) != PROGRESS_MAGIC) {
+		MSG(0, "\tError: %s is not a progress file\n",
+							c.progress_file);
+		return -1;
+	}
+	if (head->cp_ver != F2FS_CKPT(sbi)->checkpoint_ver) {
+		MSG(0, "Info: Checkpoint changed since the progress was "
+							"saved\n");
+		return -1;
+	}
+	if (le32_to_cpu(head->nat_crc) != p->nat_crc ||
+			le32_to_cpu(head->sit_crc) != p->sit_crc ||
+			le64_to_cpu(head->main_bitmap_sz) !=
+					fsck->main_area_bitmap_sz ||
+			le32_to_cpu(head->nat_bitmap_sz) !=
+					fsck->nat_area_bitmap_sz) {
+		MSG(0, "Info: Bitmaps changed since the progress was saved\n");
+		return -1;
+	}
+	if (le32_to_cpu(head->defer_data_chk) != (u32)c.defer_data_chk) {
+		MSG(0, "Info: Progress was saved with other options\n");
+		return -1;
+	}
+	if (!le32_to_cpu(head->depth))
+		return -1;
+
+	*len = (u64)le32_to_cpu(head->depth) * sizeof(struct progress_pos) +
+		sizeof(struct progress_chk) +
+		((u64)le32_to_cpu(head->nr_links) +
+			le32_to_cpu(head->nr_dedup)) *
+				sizeof(struct progress_link) +
+		(u64)le32_to_cpu(head->nr_dquots) *
+				sizeof(struct progress_dquot) +
+		(u64)le32_to_cpu(head->nr_linked) * sizeof(__le32) +
+		(u64)le32_to_cpu(head->nr_defer) * sizeof(struct defer_entry) +
+		fsck->main_area_bitmap_sz + fsck->nat_area_bitmap_sz;
+	return 0;
+}
+
+static int load_record(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct fsck_progress *p = fsck->progress;
+	struct progress_head head;
+	struct defer_entry *de;
+	struct stat st;
+	char *data = NULL, *cur;
+	u64 len;
+	u32 i, nr;
+	FILE *fp;
+	int ret = -1;
+
+	fp = fopen(c.progress_file, "r");
+	if (!fp) {
+		if (errno != ENOENT)
+			MSG(0, "\tError: failed to open %s: %s\n",
+					c.progress_file, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fileno(fp), &st) ||
+			fread(&head, sizeof(head), 1, fp) != 1 ||
+			chk_head(sbi, &head, &len) ||
+			(u64)st.st_size != sizeof(head) + len ||
+			len > INT_MAX)
+		goto out;
+
+	data = malloc(len);
+	ASSERT(data);
+	if (fread(data, len, 1, fp) != 1 || le32_to_cpu(head.crc) !=
+			f2fs_cal_crc32(F2FS_SUPER_MAGIC, data, len)) {
+		MSG(0, "\tError: progress file %s is corrupted\n",
+							c.progress_file);
+		goto out;
+	}
+
+	cur = data;
+	p->frontier_depth = le32_to_cpu(head.depth);
+	len = p->frontier_depth * sizeof(struct progress_pos);
+	p->frontier = malloc(len);
+	ASSERT(p->frontier);
+	memcpy(p->frontier, cur, len);
+	cur += len;
+	if (le32_to_cpu(p->frontier[0].ino) != sbi->root_ino_num ||
+			!chk_frontier(sbi, p->frontier, p->frontier_depth)) {
+		MSG(0, "Info: Saved frontier is not found in the tree\n");
+		free(p->frontier);
+		p->frontier = NULL;
+		p->frontier_depth = 0;
+		goto out;
+	}
+
+	load_chk(fsck, (struct progress_chk *)cur);
+	cur += sizeof(struct progress_chk);
+
+	nr = le32_to_cpu(head.nr_links) + le32_to_cpu(head.nr_dedup);
+	load_links(sbi, (struct progress_link *)cur,
+			le32_to_cpu(head.nr_links), le32_to_cpu(head.nr_dedup));
+	cur += nr * sizeof(struct progress_link);
+
+	p->nr_dquots = le32_to_cpu(head.nr_dquots);
+	len = p->nr_dquots * sizeof(struct progress_dquot);
+	p->dquots = malloc(len ? len : 1);
+	ASSERT(p->dquots);
+	memcpy(p->dquots, cur, len);
+	cur += len;
+
+	p->nr_linked = le32_to_cpu(head.nr_linked);
+	len = p->nr_linked * sizeof(__le32);
+	p->linked = malloc(len ? len : 1);
+	ASSERT(p->linked);
+	memcpy(p->linked, cur, len);
+	cur += len;
+
+	nr = le32_to_cpu(head.nr_defer);
+	de = (struct defer_entry *)cur;
+	for (i = 0; i < nr; i++, de++)
+		defer_add_data_blk(sbi, le32_to_cpu(de->blk_addr),
+				le32_to_cpu(de->nid),
+				le16_to_cpu(de->ofs_in_node));
+	cur = (char *)de;
+
+	memcpy(fsck->main_area_bitmap, cur, fsck->main_area_bitmap_sz);
+	cur += fsck->main_area_bitmap_sz;
+	load_nat_bitmap(sbi, cur);
+
+	for (i = 0; i < p->frontier_depth; i++)
+		undo_dir(sbi, le32_to_cpu(p->frontier[i].ino),
+				le32_to_cpu(p->frontier[i].pgofs));
+	ret = 0;
+out:
+	free(data);
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Called once the bitmaps are built. Returns true if the state of a saved
+ * walk is loaded, in which case the checks before the walk are skipped as
+ * well, as their results are part of the state.
+ */
+bool progress_init(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct fsck_progress *p;
+
+	p = calloc(sizeof(struct fsck_progress), 1);
+	ASSERT(p);
+	fsck->progress = p;
+
+	p->nat_crc = f2fs_cal_crc32(F2FS_SUPER_MAGIC, fsck->nat_area_bitmap,
+						fsck->nat_area_bitmap_sz);
+	p->sit_crc = f2fs_cal_crc32(F2FS_SUPER_MAGIC, fsck->sit_area_bitmap,
+						fsck->sit_area_bitmap_sz);
+	p->bug_on = c.bug_on;
+
+	if (load_record(sbi)) {
+		if (access(c.progress_file, F_OK) == 0)
+			MSG(0, "Info: Saved progress is not usable, "
+							"start over\n");
+		return false;
+	}
+
+	MSG(0, "Info: Resume fsck from %s, %u directories deep\n",
+				c.progress_file, p->frontier_depth);
+	return true;
+}
+
+void progress_load_quota(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct fsck_progress *p = fsck->progress;
+	struct progress_dquot *e;
+	u32 i;
+
+	if (!p || !fsck->qctx)
+		return;
+
+	for (i = 0, e = p->dquots; i < p->nr_dquots; i++, e++)
+		if (quota_restore_usage(fsck->qctx, le32_to_cpu(e->qtype),
+				le32_to_cpu(e->id), le64_to_cpu(e->space),
+				le64_to_cpu(e->inodes)))
+			MSG(0, "\tError: failed to load quota usage of "
+					"id %u\n", le32_to_cpu(e->id));
+	for (i = 0; i < p->nr_linked; i++)
+		quota_restore_linked_inode(fsck->qctx,
+					le32_to_cpu(p->linked[i]));
+}
+
+void progress_walk_start(struct f2fs_sb_info *sbi)
+{
+	struct fsck_progress *p = F2FS_FSCK(sbi)->progress;
+
+	if (!p)
+		return;
+
+	p->walking = true;
+	p->last_save = time(NULL);
+
+	/*
+	 * Errors known before the walk are kept aside, so c.bug_on tells
+	 * whether the walk itself has found any. A walk that found errors is
+	 * never saved, as its state may depend on fixes not written yet.
+	 */
+	if (c.bug_on == p->bug_on)
+		c.bug_on = 0;
+	else
+		MSG(0, "Info: Errors found before the walk, "
+					"its progress is not saved\n");
+}
+
+int progress_walk_end(struct f2fs_sb_info *sbi)
+{
+	struct fsck_progress *p = F2FS_FSCK(sbi)->progress;
+
+	if (!p)
+		return 0;
+
+	p->walking = false;
+	c.bug_on |= p->bug_on;
+
+	if (p->resume_level < p->frontier_depth) {
+		MSG(0, "\tError: Saved progress does not match the tree, "
+							"start over\n");
+		remove_record();
+		return -1;
+	}
+	if (!c.dry_run)
+		remove_record();
+	return 0;
+}
+
+/*
+ * Returns true if the dentry at @slot was done by the saved walk. Such a
+ * dentry is counted by the caller but not walked into again.
+ */
+bool progress_skip_dentry(struct f2fs_sb_info *sbi, struct child_info *child,
+						int slot, nid_t ino)
+{
+	struct fsck_progress *p = F2FS_FSCK(sbi)->progress;
+	struct progress_pos *pos;
+	u32 pgofs;
+
+	if (!p || !p->walking || p->resume_level >= p->frontier_depth)
+		return false;
+
+	pos = &p->frontier[p->resume_level];
+	if (child->p_ino != le32_to_cpu(pos->ino))
+		return false;
+
+	pgofs = le32_to_cpu(pos->pgofs);
+	if (child->pgofs < pgofs || (child->pgofs == pgofs &&
+				(u32)slot < le32_to_cpu(pos->slot)))
+		return true;
+	if (child->pgofs > pgofs || (u32)slot > le32_to_cpu(pos->slot)) {
+		/* the frontier dentry is gone, fail in progress_walk_end() */
+		p->frontier_depth = p->resume_level + 1;
+		return false;
+	}
+
+	if (++p->resume_level == p->frontier_depth)
+		return true;
+	/* walk into the next directory of the frontier */
+	if (ino != le32_to_cpu(p->frontier[p->resume_level].ino))
+		p->frontier_depth = p->resume_level + 1;
+	return false;
+}
+
+void progress_enter(struct f2fs_sb_info *sbi, struct child_info *child,
+						int slot)
+{
+	struct fsck_progress *p = F2FS_FSCK(sbi)->progress;
+	struct progress_pos *pos;
+
+	if (!p || !p->walking)
+		return;
+
+	if (p->depth == p->cap) {
+		u32 cap = p->cap ? p->cap * 2 : 64;
+
+		pos = realloc(p->stack, cap * sizeof(struct progress_pos));
+		ASSERT(pos);
+		p->stack = pos;
+		p->cap = cap;
+	}
+	pos = &p->stack[p->depth++];
+	pos->ino = cpu_to_le32(child->p_ino);
+	pos->pgofs = cpu_to_le32(child->pgofs);
+	pos->slot = cpu_to_le32(slot);
+}
+
+void progress_leave(struct f2fs_sb_info *sbi, struct child_info *child,
+						int slot)
+{
+	struct fsck_progress *p = F2FS_FSCK(sbi)->progress;
+	struct progress_pos pos;
+	time_t now;
+
+	if (!p || !p->walking)
+		return;
+
+	p->depth--;
+	if (c.bug_on || c.dry_run || p->resume_level < p->frontier_depth)
+		return;
+
+	now = time(NULL);
+	if (now - p->last_save < PROGRESS_SAVE_INTERVAL)
+		return;
+
+	pos.ino = cpu_to_le32(child->p_ino);
+	pos.pgofs = cpu_to_le32(child->pgofs);
+	pos.slot = cpu_to_le32(slot);
+	save_record(sbi, &pos);
+	p->last_save = now;
+}
+
+void progress_free(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct fsck_progress *p = fsck->progress;
+
+	if (!p)
+		return;
+
+	free(p->stack);
+	free(p->frontier);
+	free(p->dquots);
+	free(p->linked);
+	free(p);
+	fsck->progress = NULL;
+}
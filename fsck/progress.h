@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * progress.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+#include <time.h>
+#include "fsck.h"
+
+#define PROGRESS_MAGIC		0xF2F5C4E0
+#ifndef PROGRESS_SAVE_INTERVAL
+#define PROGRESS_SAVE_INTERVAL	10	/* seconds between two records */
+#endif
+
+/* on-disk layout of the progress record, little endian */
+struct progress_head {
+	__le32 magic;
+	__le32 crc;		/* crc of everything after the head */
+	__le64 cp_ver;		/* checkpoint version when saved */
+	__le32 nat_crc;		/* digest of NAT bitmap before the walk */
+	__le32 sit_crc;		/* digest of SIT bitmap */
+	__le32 defer_data_chk;	/* mode of the run that saved it */
+	__le32 depth;		/* directories in the frontier */
+	__le32 nr_links;	/* hard linked files seen */
+	__le32 nr_dedup;	/* dedup inner inodes seen */
+	__le32 nr_dquots;	/* quota usage entries */
+	__le32 nr_linked;	/* hard linked inodes counted in quota */
+	__le32 nr_defer;	/* deferred data blocks */
+	__le32 nat_bitmap_sz;
+	__le64 main_bitmap_sz;
+} __attribute__((packed));
+
+/*
+ * Position of the walk in a directory: the dentry at @slot of the dentry
+ * block at @pgofs (0 for inline dentries) is walked into, or, in the last
+ * entry of the frontier, has just been done.
+ */
+struct progress_pos {
+	__le32 ino;
+	__le32 pgofs;
+	__le32 slot;
+} __attribute__((packed));
+
+struct progress_chk {
+	__le64 checked_node_cnt;
+	__le64 valid_blk_cnt;
+	__le32 valid_node_cnt;
+	__le32 valid_inode_cnt;
+	__le32 multi_hard_link_files;
+	__le32 qf_szchk_type[F2FS_MAX_QUOTAS];
+	__le32 qf_last_blkofs[F2FS_MAX_QUOTAS];
+	__le64 qf_maxsize[F2FS_MAX_QUOTAS];
+} __attribute__((packed));
+
+/* entry of hard_link_list or dedup_inner_list */
+struct progress_link {
+	__le32 nid;
+	__le32 links;
+	__le32 actual_links;
+	__le32 is_valid;
+} __attribute__((packed));
+
+struct progress_dquot {
+	__le32 qtype;
+	__le32 id;
+	__le64 space;
+	__le64 inodes;
+} __attribute__((packed));
+
+struct fsck_progress {
+	struct progress_pos *stack;	/* directories being walked */
+	u32 depth;
+	u32 cap;
+
+	struct progress_pos *frontier;	/* where the saved walk stopped */
+	u32 frontier_depth;
+	u32 resume_level;		/* frontier entries reached again */
+
+	/* quota usage to load once the quota context exists */
+	struct progress_dquot *dquots;
+	u32 nr_dquots;
+	__le32 *linked;
+	u32 nr_linked;
+
+	u32 nat_crc;
+	u32 sit_crc;
+	int bug_on;			/* c.bug_on before the walk */
+	bool walking;
+	time_t last_save;
+};
+
+bool progress_init(struct f2fs_sb_info *sbi);
+void progress_load_quota(struct f2fs_sb_info *sbi);
+void progress_walk_start(struct f2fs_sb_info *sbi);
+int progress_walk_end(struct f2fs_sb_info *sbi);
+bool progress_skip_dentry(struct f2fs_sb_info *sbi, struct child_info *child,
+						int slot, nid_t ino);
+void progress_enter(struct f2fs_sb_info *sbi, struct child_info *child,
+						int slot);
+void progress_leave(struct f2fs_sb_info *sbi, struct child_info *child,
+						int slot);
+void progress_free(struct f2fs_sb_info *sbi);
+#endif /* _PROGRESS_H_ */
@@ -222,6 +222,14 @@ void quota_data_sub(quota_ctx_t qctx, struct f2fs_inode *inode, qsize_t space);
 errcode_t quota_write_inode(struct f2fs_sb_info *sbi, enum quota_type qtype);
 void quota_add_inode_usage(quota_ctx_t qctx, f2fs_ino_t ino,
 		struct f2fs_inode* inode);
+void quota_for_each_usage(quota_ctx_t qctx,
+		void (*func)(enum quota_type, qid_t, struct dquot *, void *),
+		void *data);
+void quota_for_each_linked_inode(quota_ctx_t qctx,
+		void (*func)(f2fs_ino_t, void *), void *data);
+errcode_t quota_restore_usage(quota_ctx_t qctx, enum quota_type qtype,
+		qid_t id, qsize_t space, qsize_t inodes);
+void quota_restore_linked_inode(quota_ctx_t qctx, f2fs_ino_t ino);
 void quota_release_context(quota_ctx_t *qctx);
 errcode_t quota_compare_and_update(struct f2fs_sb_info *sbi,
 		enum quota_type qtype, int *usage_inconsistent,
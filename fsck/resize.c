@@ -168,49 +168,75 @@ safe_resize:
 	return 0;
 }
 
+/*
+ * Shift every valid block of the main area up by @offset blocks, from the
+ * end so that no block is overwritten before it is copied.  Each run of
+ * valid blocks in a segment is copied with one read and one write, while
+ * the next segment is read ahead, and the pointers to the moved blocks
+ * are updated in batches, once per owning node and NAT block.
+ */
 static void migrate_main(struct f2fs_sb_info *sbi, unsigned int offset)
 {
-	void *raw = calloc(BLOCK_SZ, 1);
+	struct blkaddr_batch batch = { 0 };
+	struct f2fs_summary_block *sum_blk;
 	struct seg_entry *se;
-	block_t from, to;
-	int i, j, ret;
-	struct f2fs_summary sum;
-
-	ASSERT(raw != NULL);
+	block_t from;
+	void *raw;
+	int i, j, start, type, ret;
 
 	if (offset == 0) {
 		DBG(0, "Info: The address of the main area has not changed, so no migration is required.\n");
-		free(raw);
 		return;
 	}
 
+	raw = malloc(BLOCK_SZ * sbi->blocks_per_seg);
+	ASSERT(raw != NULL);
+
 	for (i = MAIN_SEGS(sbi) - 1; i >= 0; i--) {
 		se = get_seg_entry(sbi, i);
 		if (!se->valid_blocks)
 			continue;
 
-		for (j = sbi->blocks_per_seg - 1; j >= 0; j--) {
-			if (!f2fs_test_bit(j, (const char *)se->cur_valid_map))
+		if (i > 0 && get_seg_entry(sbi, i - 1)->valid_blocks)
+			dev_readahead((u64)START_BLOCK(sbi, i - 1) <<
+						F2FS_BLKSIZE_BITS,
+					BLOCK_SZ * sbi->blocks_per_seg);
+
+		sum_blk = get_sum_block(sbi, i, &type);
+
+		for (j = sbi->blocks_per_seg - 1; j >= 0; j = start - 1) {
+			if (!f2fs_test_bit(j, (const char *)se->cur_valid_map)) {
+				start = j;
 				continue;
+			}
 
-			from = START_BLOCK(sbi, i) + j;
-			ret = dev_read_block(raw, from);
-			ASSERT(ret >= 0);
+			/* the run of valid blocks ending at @j */
+			for (start = j; start > 0 && f2fs_test_bit(start - 1,
+					(const char *)se->cur_valid_map); start--)
+				;
 
-			to = from + offset;
-			ret = dev_write_block(raw, to);
+			from = START_BLOCK(sbi, i) + start;
+			ret = dev_read(raw, (u64)from << F2FS_BLKSIZE_BITS,
+					(j - start + 1) << F2FS_BLKSIZE_BITS);
 			ASSERT(ret >= 0);
 
-			get_sum_entry(sbi, from, &sum);
+			ret = dev_write(raw,
+					(u64)(from + offset) << F2FS_BLKSIZE_BITS,
+					(j - start + 1) << F2FS_BLKSIZE_BITS);
+			ASSERT(ret >= 0);
 
-			if (IS_DATASEG(se->type))
-				update_data_blkaddr(sbi, le32_to_cpu(sum.nid),
-					le16_to_cpu(sum.ofs_in_node), to);
-			else
-				update_nat_blkaddr(sbi, 0,
-						le32_to_cpu(sum.nid), to);
+			for (; from <= START_BLOCK(sbi, i) + j; from++)
+				blkaddr_batch_add(sbi, &batch,
+					&sum_blk->entries[OFFSET_IN_SEG(sbi, from)],
+					!IS_DATASEG(se->type), from + offset);
 		}
+
+		if (type == SEG_TYPE_NODE || type == SEG_TYPE_DATA ||
+				type == SEG_TYPE_MAX)
+			free(sum_blk);
 	}
+	blkaddr_batch_flush(sbi, &batch);
+	blkaddr_batch_free(&batch);
 	free(raw);
 	DBG(0, "Info: Done to migrate Main area: main_blkaddr = 0x%x -> 0x%x\n",
 				START_BLOCK(sbi, 0),
@@ -795,6 +821,413 @@ static int f2fs_resize_grow(struct f2fs_sb_info *sbi)
 	return 0;
 }
 
+/*
+ * Shrink vacates the main segments from @start_segno on.  Their valid
+ * blocks are moved into the free sections in front, a whole section per
+ * segment type so the blocks keep their temperature and are written with
+ * large I/Os, and only the rest into the free blocks of partly used
+ * segments of the same type.  NO_CHECK_TYPE free sections are left for
+ * the current segments.
+ */
+struct shrink_plan {
+	unsigned int start_segno;		/* first segment to vacate */
+	unsigned int nr_segs[NO_CHECK_TYPE];	/* segments with valid blocks */
+	block_t nr_blocks[NO_CHECK_TYPE];	/* valid blocks to move */
+	block_t nr_runs;			/* runs of valid blocks */
+	unsigned int nr_free_secs;		/* free sections in front */
+	block_t nr_holes[NO_CHECK_TYPE];	/* free blocks of partly used segs */
+	unsigned int use_secs[NO_CHECK_TYPE];	/* free sections to fill */
+	block_t use_holes[NO_CHECK_TYPE];	/* blocks to put in partly used segs */
+	unsigned int nr_dnodes;			/* node blocks pointing to data */
+	unsigned int nr_nat_blks;		/* NAT blocks pointing to nodes */
+};
+
+struct shrink_target {
+	unsigned int segno;			/* segment being filled */
+	unsigned int segs_left;			/* in the section being filled */
+	unsigned int hole_segno;		/* next segment to look for holes */
+};
+
+static const char *shrink_type_name[NO_CHECK_TYPE] = {
+	"hot data", "warm data", "cold data",
+	"hot node", "warm node", "cold node",
+};
+
+static bool shrink_free_sec(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	unsigned int i;
+
+	for (i = 0; i < sbi->segs_per_sec; i++) {
+		if (get_seg_entry(sbi, segno + i)->valid_blocks ||
+				IS_CUR_SEGNO(sbi, segno + i) ||
+				!is_usable_seg(sbi, segno + i))
+			return false;
+	}
+	return true;
+}
+
+static bool shrink_hole_seg(struct f2fs_sb_info *sbi, unsigned int segno,
+								int type)
+{
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+
+	return se->type == type && se->valid_blocks &&
+		se->valid_blocks < sbi->blocks_per_seg &&
+		!IS_CUR_SEGNO(sbi, segno) && is_usable_seg(sbi, segno);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned int count_unique(u32 *v, unsigned int n)
+{
+	unsigned int i, nr = 0;
+
+	qsort(v, n, sizeof(u32), cmp_u32);
+	for (i = 0; i < n; i++)
+		if (!i || v[i] != v[i - 1])
+			nr++;
+	return nr;
+}
+
+static int plan_shrink(struct f2fs_sb_info *sbi, struct shrink_plan *plan,
+						unsigned int start_segno)
+{
+	block_t blks_per_sec = sbi->blocks_per_seg * sbi->segs_per_sec;
+	struct f2fs_summary_block *sum_blk;
+	struct seg_entry *se;
+	unsigned int segno, free_secs, nr_data = 0, nr_node = 0;
+	u32 *owners, *nat_blks;
+	block_t left = 0;
+	int i, j, type;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->start_segno = start_segno;
+
+	for (segno = start_segno; segno < MAIN_SEGS(sbi); segno++)
+		left += get_seg_entry(sbi, segno)->valid_blocks;
+	owners = malloc(sizeof(u32) * (left + 1));
+	nat_blks = malloc(sizeof(u32) * (left + 1));
+	ASSERT(owners && nat_blks);
+
+	for (segno = start_segno; segno < MAIN_SEGS(sbi); segno++) {
+		se = get_seg_entry(sbi, segno);
+		if (!se->valid_blocks)
+			continue;
+		if (se->type >= NO_CHECK_TYPE) {
+			MSG(0, "\tError: Segment %u has invalid type %u\n",
+							segno, se->type);
+			free(owners);
+			free(nat_blks);
+			return -EINVAL;
+		}
+		plan->nr_segs[se->type]++;
+		plan->nr_blocks[se->type] += se->valid_blocks;
+
+		sum_blk = get_sum_block(sbi, segno, &type);
+		for (j = 0; j < (int)sbi->blocks_per_seg; j++) {
+			nid_t nid = le32_to_cpu(sum_blk->entries[j].nid);
+
+			if (!f2fs_test_bit(j, (const char *)se->cur_valid_map))
+				continue;
+			if (!j || !f2fs_test_bit(j - 1,
+					(const char *)se->cur_valid_map))
+				plan->nr_runs++;
+			if (IS_DATASEG(se->type))
+				owners[nr_data++] = nid;
+			else
+				nat_blks[nr_node++] = NAT_BLOCK_OFFSET(nid);
+		}
+		if (type == SEG_TYPE_NODE || type == SEG_TYPE_DATA ||
+				type == SEG_TYPE_MAX)
+			free(sum_blk);
+	}
+	plan->nr_dnodes = count_unique(owners, nr_data);
+	plan->nr_nat_blks = count_unique(nat_blks, nr_node);
+	free(owners);
+	free(nat_blks);
+
+	for (segno = 0; segno < start_segno; segno += sbi->segs_per_sec) {
+		if (shrink_free_sec(sbi, segno)) {
+			plan->nr_free_secs++;
+			continue;
+		}
+		for (j = 0; j < (int)sbi->segs_per_sec; j++) {
+			se = get_seg_entry(sbi, segno + j);
+			for (i = 0; i < NO_CHECK_TYPE; i++)
+				if (shrink_hole_seg(sbi, segno + j, i))
+					plan->nr_holes[i] += sbi->blocks_per_seg -
+							se->valid_blocks;
+		}
+	}
+
+	free_secs = plan->nr_free_secs > NO_CHECK_TYPE ?
+				plan->nr_free_secs - NO_CHECK_TYPE : 0;
+	for (i = 0; i < NO_CHECK_TYPE; i++) {
+		left = plan->nr_blocks[i];
+		plan->use_secs[i] = left / blks_per_sec;
+		if (plan->use_secs[i] > free_secs)
+			plan->use_secs[i] = free_secs;
+		free_secs -= plan->use_secs[i];
+		left -= plan->use_secs[i] * blks_per_sec;
+
+		/* the rest goes to the holes if it fits, keeping sections */
+		if (left > plan->nr_holes[i] && free_secs) {
+			plan->use_secs[i]++;
+			free_secs--;
+			left = 0;
+		}
+		plan->use_holes[i] = left;
+	}
+	return 0;
+}
+
+static int print_shrink_plan(struct f2fs_sb_info *sbi,
+					struct shrink_plan *plan)
+{
+	block_t nr_blocks = 0;
+	unsigned int nr_segs = 0, nr_meta;
+	int i, err = 0;
+
+	for (i = 0; i < NO_CHECK_TYPE; i++) {
+		nr_blocks += plan->nr_blocks[i];
+		nr_segs += plan->nr_segs[i] + plan->use_secs[i] *
+							sbi->segs_per_sec;
+	}
+	/* plus the SSA and SIT blocks of the vacated and filled segments */
+	nr_meta = plan->nr_dnodes + plan->nr_nat_blks + 2 * nr_segs;
+
+	MSG(0, "Info: Shrink plan: vacate segments %u - %u\n",
+			plan->start_segno, MAIN_SEGS(sbi) - 1);
+	for (i = 0; i < NO_CHECK_TYPE; i++) {
+		if (!plan->nr_blocks[i])
+			continue;
+		MSG(0, "Info:   %-9s: %u blocks in %u segments -> "
+			"%u free sections, %u blocks in partly used segments\n",
+			shrink_type_name[i], plan->nr_blocks[i],
+			plan->nr_segs[i], plan->use_secs[i],
+			plan->use_holes[i]);
+		if (plan->use_holes[i] > plan->nr_holes[i]) {
+			MSG(0, "\tError: No space for %u %s blocks\n",
+				plan->use_holes[i] - plan->nr_holes[i],
+				shrink_type_name[i]);
+			err = -ENOSPC;
+		}
+	}
+	MSG(0, "Info: Shrink cost: copy %u blocks (%"PRIu64" MB) in %u runs, "
+		"rewrite %u node and %u NAT blocks, "
+		"about %u metadata blocks in total, 1 checkpoint\n",
+		nr_blocks, (u64)nr_blocks >> (20 - F2FS_BLKSIZE_BITS),
+		plan->nr_runs, plan->nr_dnodes, plan->nr_nat_blks, nr_meta);
+	return err;
+}
+
+/* free blocks at the target of @type, 0 if there is no space left */
+static block_t next_shrink_target(struct f2fs_sb_info *sbi,
+			struct shrink_plan *plan, struct shrink_target *tgt,
+			unsigned int *free_segno, int type, block_t *blkaddr)
+{
+	struct shrink_target *t = &tgt[type];
+	struct seg_entry *se;
+	unsigned int i, off, end;
+
+	while (1) {
+		if (t->segno != NULL_SEGNO) {
+			se = get_seg_entry(sbi, t->segno);
+			for (off = 0; off < sbi->blocks_per_seg &&
+					f2fs_test_bit(off,
+					(const char *)se->cur_valid_map); off++)
+				;
+			for (end = off; end < sbi->blocks_per_seg &&
+					!f2fs_test_bit(end,
+					(const char *)se->cur_valid_map); end++)
+				;
+			if (off < end) {
+				*blkaddr = START_BLOCK(sbi, t->segno) + off;
+				return end - off;
+			}
+			if (t->segs_left) {
+				t->segno++;
+				t->segs_left--;
+				continue;
+			}
+			t->segno = NULL_SEGNO;
+		}
+
+		if (plan->use_secs[type]) {
+			while (*free_segno < plan->start_segno &&
+					!shrink_free_sec(sbi, *free_segno))
+				*free_segno += sbi->segs_per_sec;
+			if (*free_segno >= plan->start_segno)
+				return 0;
+			plan->use_secs[type]--;
+			t->segno = *free_segno;
+			t->segs_left = sbi->segs_per_sec - 1;
+			*free_segno += sbi->segs_per_sec;
+			for (i = 0; i < sbi->segs_per_sec; i++)
+				get_seg_entry(sbi, t->segno + i)->type = type;
+			continue;
+		}
+
+		for (; t->hole_segno < plan->start_segno; t->hole_segno++)
+			if (shrink_hole_seg(sbi, t->hole_segno, type))
+				break;
+		if (t->hole_segno >= plan->start_segno)
+			return 0;
+		t->segno = t->hole_segno++;
+		t->segs_left = 0;
+	}
+}
+
+static void shrink_move_block(struct f2fs_sb_info *sbi, block_t from,
+		block_t to, struct f2fs_summary *sum, struct blkaddr_batch *batch)
+{
+	struct seg_entry *se;
+	unsigned char type;
+
+	se = get_seg_entry(sbi, GET_SEGNO(sbi, from));
+	type = se->type;
+	se->valid_blocks--;
+	f2fs_clear_bit(OFFSET_IN_SEG(sbi, from), (char *)se->cur_valid_map);
+	se->dirty = 1;
+	update_free_seg_index(sbi, GET_SEGNO(sbi, from), true);
+
+	se = get_seg_entry(sbi, GET_SEGNO(sbi, to));
+	se->valid_blocks++;
+	f2fs_set_bit(OFFSET_IN_SEG(sbi, to), (char *)se->cur_valid_map);
+	se->dirty = 1;
+	update_free_seg_index(sbi, GET_SEGNO(sbi, to), false);
+
+	update_sum_entry(sbi, to, sum);
+	blkaddr_batch_add(sbi, batch, sum, !IS_DATASEG(type), to);
+}
+
+/*
+ * Carry out @plan: each run of valid blocks is read at once and written
+ * in as few pieces as the targets allow, the SSA blocks are written once
+ * per segment, and the node and NAT blocks once when all blocks are moved.
+ */
+static int migrate_shrink(struct f2fs_sb_info *sbi, struct shrink_plan *plan)
+{
+	struct shrink_target tgt[NO_CHECK_TYPE];
+	struct blkaddr_batch batch = { 0 };
+	struct f2fs_summary_block *sum_blk;
+	struct seg_entry *se;
+	unsigned int segno, free_segno = 0;
+	block_t from, to, len, done, n;
+	void *raw;
+	int i, j, start, type, ret, err = 0;
+
+	for (i = 0; i < NO_CHECK_TYPE; i++) {
+		tgt[i].segno = NULL_SEGNO;
+		tgt[i].segs_left = 0;
+		tgt[i].hole_segno = 0;
+	}
+
+	raw = malloc(BLOCK_SZ * sbi->blocks_per_seg);
+	ASSERT(raw != NULL);
+
+	for (segno = plan->start_segno; segno < MAIN_SEGS(sbi) && !err;
+								segno++) {
+		se = get_seg_entry(sbi, segno);
+		if (!se->valid_blocks)
+			continue;
+
+		sum_blk = get_sum_block(sbi, segno, &type);
+
+		for (j = 0; j < (int)sbi->blocks_per_seg && !err; j++) {
+			if (!f2fs_test_bit(j, (const char *)se->cur_valid_map))
+				continue;
+
+			/* the run of valid blocks starting at @j */
+			for (start = j++; j < (int)sbi->blocks_per_seg &&
+					f2fs_test_bit(j,
+					(const char *)se->cur_valid_map); j++)
+				;
+
+			from = START_BLOCK(sbi, segno) + start;
+			n = j - start;
+			ret = dev_read(raw, (u64)from << F2FS_BLKSIZE_BITS,
+						n << F2FS_BLKSIZE_BITS);
+			ASSERT(ret >= 0);
+
+			for (done = 0; done < n; done += len) {
+				len = next_shrink_target(sbi, plan, tgt,
+						&free_segno, se->type, &to);
+				if (!len) {
+					MSG(0, "Not enough space to migrate blocks\n");
+					err = -ENOSPC;
+					break;
+				}
+				if (len > n - done)
+					len = n - done;
+
+				ret = dev_write(raw + done * BLOCK_SZ,
+					(u64)to << F2FS_BLKSIZE_BITS,
+					len << F2FS_BLKSIZE_BITS);
+				ASSERT(ret >= 0);
+
+				for (i = 0; i < (int)len; i++)
+					shrink_move_block(sbi, from + done + i,
+						to + i, &sum_blk->entries[
+						start + done + i], &batch);
+			}
+		}
+
+		if (type == SEG_TYPE_NODE || type == SEG_TYPE_DATA ||
+				type == SEG_TYPE_MAX)
+			free(sum_blk);
+	}
+	free(raw);
+
+	blkaddr_batch_flush(sbi, &batch);
+	blkaddr_batch_free(&batch);
+
+	/* update curseg info; can update sit->types */
+	move_curseg_info(sbi, START_BLOCK(sbi, plan->start_segno), 1);
+	zero_journal_entries(sbi);
+	write_curseg_info(sbi);
+
+	/* flush dirty sit entries */
+	flush_sit_entries(sbi);
+	return err;
+}
+
+/*
+ * rebuild_checkpoint() writes the only checkpoint of the shrink, so set
+ * what write_checkpoint() would have set in the current one.
+ */
+static void prepare_shrink_checkpoint(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
+	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
+	u32 flags = CP_UMOUNT_FLAG;
+	int i, ret;
+
+	flags |= get_cp(ckpt_flags) & (CP_ORPHAN_PRESENT_FLAG |
+			CP_TRIMMED_FLAG | CP_DISABLED_FLAG |
+			CP_LARGE_NAT_BITMAP_FLAG);
+	set_cp(ckpt_flags, flags);
+
+	for (i = 0; i < NO_CHECK_TYPE; i++) {
+		struct curseg_info *curseg = CURSEG_I(sbi, i);
+
+		if (i == CURSEG_HOT_DATA || i == CURSEG_COLD_DATA)
+			memcpy(&curseg->sum_blk->journal, curseg->journal,
+				sizeof(struct f2fs_journal));
+
+		if (get_sb(feature) & cpu_to_le32(F2FS_FEATURE_RO))
+			continue;
+		ret = dev_write_block(curseg->sum_blk,
+				GET_SUM_BLKADDR(sbi, curseg->segno));
+		ASSERT(ret >= 0);
+	}
+}
+
 static int f2fs_resize_shrink(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
@@ -802,11 +1235,13 @@ static int f2fs_resize_shrink(struct f2fs_sb_info *sbi)
 	struct f2fs_super_block *new_sb = &new_sb_raw;
 	block_t old_end_blkaddr, old_main_blkaddr;
 	block_t new_end_blkaddr, new_main_blkaddr, tmp_end_blkaddr;
+	struct shrink_plan plan;
 	unsigned int offset;
 	int err = -1;
 
-	/* flush NAT/SIT journal entries */
-	flush_journal_entries(sbi);
+	/* flush NAT/SIT journal entries, checkpointed with the new size */
+	flush_nat_journal_entries(sbi);
+	flush_sit_journal_entries(sbi);
 
 	memcpy(new_sb, F2FS_RAW_SUPER(sbi), sizeof(*new_sb));
 	if (get_new_sb(new_sb))
@@ -833,13 +1268,34 @@ static int f2fs_resize_shrink(struct f2fs_sb_info *sbi)
 			get_newsb(log_blocks_per_seg)) + get_newsb(main_blkaddr);
 
 	tmp_end_blkaddr = new_end_blkaddr + offset;
-	err = f2fs_defragment(sbi, tmp_end_blkaddr,
-				old_end_blkaddr - tmp_end_blkaddr,
-				tmp_end_blkaddr, 1);
-	MSG(0, "Try to do defragement: %s\n", err ? "Insufficient Space": "Done");
+	if (c.zoned_model == F2FS_ZONED_HM) {
+		err = f2fs_defragment(sbi, tmp_end_blkaddr,
+					old_end_blkaddr - tmp_end_blkaddr,
+					tmp_end_blkaddr, 1);
+		MSG(0, "Try to do defragement: %s\n", err ? "Insufficient Space": "Done");
 
-	if (err) {
-		return -ENOSPC;
+		if (err) {
+			return -ENOSPC;
+		}
+	} else {
+		err = plan_shrink(sbi, &plan,
+				GET_SEGNO(sbi, tmp_end_blkaddr));
+		if (!err)
+			err = print_shrink_plan(sbi, &plan);
+		if (err)
+			return err;
+		if (c.dry_run)
+			return 0;
+
+		err = migrate_shrink(sbi, &plan);
+		MSG(0, "Try to do defragement: %s\n", err ? "Insufficient Space": "Done");
+
+		if (err) {
+			/* keep the moved blocks at the old size */
+			write_checkpoint(sbi);
+			return -ENOSPC;
+		}
+		prepare_shrink_checkpoint(sbi);
 	}
 
 	update_superblock(new_sb, SB_MASK_ALL);
@@ -876,6 +1332,10 @@ int f2fs_resize(struct f2fs_sb_info *sbi)
 			return f2fs_resize_shrink(sbi);
 		}
 	else if (((c.target_sectors * c.sector_size >> get_sb(log_blocksize)) > get_sb(block_count)) || c.force) {
+		if (c.dry_run) {
+			MSG(0, "\tError: --dry-run only plans a shrink\n");
+			return -1;
+		}
 		f2fs_enable_large_nat_bitmap(sbi, target_size, cur_size);
 		return f2fs_resize_grow(sbi);
 	} else {
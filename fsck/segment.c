@@ -19,6 +19,8 @@
 #include "fsck.h"
 #include "node.h"
 #include "quotaio.h"
+#include "compress.h"
+#include "dedup_build.h"
 
 int reserve_new_block(struct f2fs_sb_info *sbi, block_t *to,
 			struct f2fs_summary *sum, int type, bool is_inode)
@@ -107,6 +109,7 @@ int reserve_new_block(struct f2fs_sb_info *sbi, block_t *to,
 		}
 	}
 	se->dirty = 1;
+	update_free_seg_index(sbi, GET_SEGNO(sbi, blkaddr), false);
 
 	/* read/write SSA */
 	*to = (block_t)blkaddr;
@@ -252,6 +255,21 @@ u64 f2fs_read(struct f2fs_sb_info *sbi, nid_t ino, u8 *buffer,
 	return read_count;
 }
 
+static bool in_same_device(block_t a, block_t b)
+{
+	int i;
+
+	if (c.ndevs <= 1)
+		return true;
+
+	for (i = 0; i < c.ndevs; i++)
+		if (c.devices[i].start_blkaddr <= a &&
+				c.devices[i].end_blkaddr >= a)
+			return c.devices[i].start_blkaddr <= b &&
+				c.devices[i].end_blkaddr >= b;
+	return false;
+}
+
 /*
  * Do not call this function directly.  Instead, call one of the following:
  *     u64 f2fs_write();
@@ -270,9 +288,13 @@ static u64 f2fs_write_ex(struct f2fs_sb_info *sbi, nid_t ino, u8 *buffer,
 	u64 written_count;
 	u64 remained_blkentries;
 	block_t blkaddr;
+	block_t run_addr = NULL_ADDR;	/* full blocks not written yet */
+	u64 run_blks = 0;
+	u8 *run_buf = NULL;
 	void* index_node = NULL;
 	int idirty = 0;
 	int err;
+	bool fresh;
 	bool has_data = (addr_type == WR_NORMAL
 			|| addr_type == WR_COMPRESS_DATA);
 
@@ -329,6 +351,7 @@ static u64 f2fs_write_ex(struct f2fs_sb_info *sbi, nid_t ino, u8 *buffer,
 		}
 
 		blkaddr = datablock_addr(dn.node_blk, dn.ofs_in_node);
+		fresh = false;
 		if (blkaddr == NULL_ADDR || blkaddr == NEW_ADDR) {
 			err = new_data_block(sbi, blk_buffer,
 						&dn, CURSEG_WARM_DATA);
@@ -336,6 +359,7 @@ static u64 f2fs_write_ex(struct f2fs_sb_info *sbi, nid_t ino, u8 *buffer,
 				break;
 			blkaddr = dn.data_blkaddr;
 			idirty |= dn.idirty;
+			fresh = true;
 		}
 
 		off_in_blk = offset % BLOCK_SZ;
@@ -345,12 +369,29 @@ static u64 f2fs_write_ex(struct f2fs_sb_info *sbi, nid_t ino, u8 *buffer,
 
 		/* Write data to single block. */
 		if (len_in_blk < BLOCK_SZ) {
-			ASSERT(dev_read_block(blk_buffer, blkaddr) >= 0);
+			/* new_data_block() left blk_buffer zeroed */
+			if (!fresh)
+				ASSERT(dev_read_block(blk_buffer,
+							blkaddr) >= 0);
 			memcpy(blk_buffer + off_in_blk, buffer, len_in_blk);
 			ASSERT(dev_write_block(blk_buffer, blkaddr) >= 0);
 		} else {
-			/* Direct write */
-			ASSERT(dev_write_block(buffer, blkaddr) >= 0);
+			/*
+			 * Direct write, merged with the previous full blocks
+			 * while both the file and the disk stay contiguous.
+			 */
+			if (run_blks && (blkaddr != run_addr + run_blks ||
+					!in_same_device(run_addr, blkaddr))) {
+				ASSERT(dev_write(run_buf,
+					(u64)run_addr << F2FS_BLKSIZE_BITS,
+					run_blks << F2FS_BLKSIZE_BITS) >= 0);
+				run_blks = 0;
+			}
+			if (!run_blks) {
+				run_addr = blkaddr;
+				run_buf = buffer;
+			}
+			run_blks++;
 		}
 
 		offset += len_in_blk;
@@ -363,6 +404,9 @@ static u64 f2fs_write_ex(struct f2fs_sb_info *sbi, nid_t ino, u8 *buffer,
 			ASSERT(dev_write_block(dn.node_blk, dn.node_blkaddr)
 					>= 0);
 	}
+	if (run_blks)
+		ASSERT(dev_write(run_buf, (u64)run_addr << F2FS_BLKSIZE_BITS,
+					run_blks << F2FS_BLKSIZE_BITS) >= 0);
 	if (addr_type == WR_NORMAL && offset > le64_to_cpu(inode->i.i_size)) {
 		inode->i.i_size = cpu_to_le64(offset);
 		idirty = 1;
@@ -419,25 +463,29 @@ void f2fs_filesize_update(struct f2fs_sb_info *sbi, nid_t ino, u64 filesize)
 }
 
 #define MAX_BULKR_RETRY 5
+#define BULK_WRITE_SZ	(256 * BLOCK_SZ)	/* file data read per write */
 int bulkread(int fd, void *rbuf, size_t rsize, bool *eof)
 {
+	char *p = rbuf;
 	int n = 0;
 	int retry = MAX_BULKR_RETRY;
-	int cur;
+	ssize_t cur = 0;
 
 	if (!rsize)
 		return 0;
 
 	if (eof != NULL)
 		*eof = false;
-	while (rsize && (cur = read(fd, rbuf, rsize)) != 0) {
-		if (cur == -1) {
+	/* short reads are continued where they stopped */
+	while (rsize && (cur = read(fd, p, rsize)) != 0) {
+		if (cur < 0) {
 			if (errno == EINTR && retry--)
 				continue;
 			return -1;
 		}
 		retry = MAX_BULKR_RETRY;
 
+		p += cur;
 		rsize -= cur;
 		n += cur;
 	}
@@ -446,6 +494,24 @@ int bulkread(int fd, void *rbuf, size_t rsize, bool *eof)
 	return n;
 }
 
+/* bulkread() from @fd, or from the contents sload has read ahead */
+static int read_source(struct dentry *de, int fd, u64 pos, void *buf,
+						size_t len, bool *eof)
+{
+	size_t avail;
+
+	if (!de->data)
+		return bulkread(fd, buf, len, eof);
+
+	avail = pos < de->data_len ? de->data_len - pos : 0;
+	if (eof != NULL)
+		*eof = len > avail;
+	if (len > avail)
+		len = avail;
+	memcpy(buf, de->data + pos, len);
+	return len;
+}
+
 u64 f2fs_fix_mutable(struct f2fs_sb_info *sbi, nid_t ino, pgoff_t offset,
 		unsigned int compressed)
 {
@@ -588,10 +654,17 @@ int f2fs_build_file(struct f2fs_sb_info *sbi, struct dentry *de)
 		found_hardlink->nbuild++;
 	}
 
-	fd = open(de->full_path, O_RDONLY);
-	if (fd < 0) {
-		MSG(0, "Skip: Fail to open %s\n", de->full_path);
-		return -1;
+	if (de->dedup)
+		return dedup_build_file(sbi, de);
+
+	if (de->data) {
+		fd = -1;
+	} else {
+		fd = open(de->full_path, O_RDONLY);
+		if (fd < 0) {
+			MSG(0, "Skip: Fail to open %s\n", de->full_path);
+			return -1;
+		}
 	}
 
 	/* inline_data support */
@@ -614,7 +687,7 @@ int f2fs_build_file(struct f2fs_sb_info *sbi, struct dentry *de)
 			node_blk->i.i_extra_isize =
 					cpu_to_le16(calc_extra_isize());
 		}
-		n = read(fd, buffer, BLOCK_SZ);
+		n = read_source(de, fd, 0, buffer, BLOCK_SZ, NULL);
 		ASSERT((unsigned long)n == de->size);
 		memcpy(inline_data_addr(node_blk), buffer, de->size);
 		node_blk->i.i_size = cpu_to_le64(de->size);
@@ -623,9 +696,11 @@ int f2fs_build_file(struct f2fs_sb_info *sbi, struct dentry *de)
 #ifdef WITH_SLOAD
 	} else if (c.func == SLOAD && c.compress.enabled &&
 			c.compress.filter_ops->filter(de->full_path)) {
-		bool eof = false;
-		u8 *rbuf = c.compress.cc.rbuf;
-		unsigned int cblocks = 0;
+		struct compress_slot *slot;
+		struct compress_ctx *cc;
+		bool eof = false, skip = false, compressed;
+		unsigned int cblocks = 0, tried = 0, failed = 0;
+		u64 roff = 0;
 
 		node_blk = calloc(BLOCK_SZ, 1);
 		ASSERT(node_blk);
@@ -637,42 +712,78 @@ int f2fs_build_file(struct f2fs_sb_info *sbi, struct dentry *de)
 		node_blk->i.i_compress_algrithm = c.compress.alg;
 		node_blk->i.i_log_cluster_size =
 				c.compress.cc.log_cluster_size;
+		node_blk->i.i_compress_flag = cpu_to_le16(c.compress.level <<
+						COMPRESS_LEVEL_OFFSET);
 		node_blk->i.i_flags = cpu_to_le32(F2FS_COMPR_FL);
 		if (c.compress.readonly)
 			node_blk->i.i_inline |= F2FS_COMPRESS_RELEASED;
 		ASSERT(write_inode(node_blk, ni.blk_addr) >= 0);
 
-		while (!eof && (n = bulkread(fd, rbuf, c.compress.cc.rlen,
-				&eof)) > 0) {
-			int ret = c.compress.ops->compress(&c.compress.cc);
+		n = 0;
+		for (;;) {
 			u64 wlen;
-			u32 csize = ALIGN_UP(c.compress.cc.clen +
-					COMPRESS_HEADER_SIZE, BLOCK_SZ);
+			u32 csize;
 			unsigned int cur_cblk;
+			int len;
+
+			/* keep the compression window full */
+			while (!eof && (slot = compress_slot_get())) {
+				len = read_source(de, fd, roff, slot->cc.rbuf,
+						c.compress.cc.rlen, &eof);
+				if (len <= 0) {
+					if (len < 0)
+						n = len;
+					eof = true;
+					break;
+				}
+				slot->len = len;
+				roff += len;
+				compress_slot_submit(slot, skip);
+			}
+
+			slot = compress_slot_wait();
+			if (!slot)
+				break;
+			cc = &slot->cc;
+			csize = ALIGN_UP(cc->clen + COMPRESS_HEADER_SIZE,
+								BLOCK_SZ);
+			compressed = !skip && !slot->ret && slot->len >=
+				csize + BLOCK_SZ * c.compress.min_blocks;
+
+			/*
+			 * Give up the rest of the file if its first clusters
+			 * all fail; those compressed ahead are dropped too.
+			 */
+			if (!skip && slot->len == cc->rlen &&
+					tried < c.compress.probe_clusters) {
+				tried++;
+				if (!compressed &&
+					++failed == c.compress.probe_clusters)
+					skip = true;
+			}
 
-			if (ret || n < c.compress.cc.rlen ||
-				n < (int)(csize + BLOCK_SZ *
-						c.compress.min_blocks)) {
-				wlen = f2fs_write(sbi, de->ino, rbuf, n, off);
-				ASSERT((int)wlen == n);
+			if (!compressed) {
+				wlen = f2fs_write(sbi, de->ino, cc->rbuf,
+							slot->len, off);
+				ASSERT(wlen == slot->len);
 			} else {
 				wlen = f2fs_write_addrtag(sbi, de->ino, off,
 						WR_COMPRESS_ADDR);
 				ASSERT(!wlen);
 				wlen = f2fs_write_compress_data(sbi, de->ino,
-						(u8 *)c.compress.cc.cbuf,
+						(u8 *)cc->cbuf,
 						csize, off + BLOCK_SZ);
 				ASSERT(wlen == csize);
-				c.compress.ops->reset(&c.compress.cc);
-				cur_cblk = (c.compress.cc.rlen - csize) /
-								BLOCK_SZ;
+				c.compress.ops->reset(cc);
+				cur_cblk = (cc->rlen - csize) / BLOCK_SZ;
 				cblocks += cur_cblk;
 				wlen = f2fs_fix_mutable(sbi, de->ino,
 						off + BLOCK_SZ + csize,
 						cur_cblk);
 				ASSERT(!wlen);
 			}
-			off += n;
+			off += slot->len;
+			compress_slot_put(slot);
 		}
 		if (n == -1) {
 			fprintf(stderr, "Load file '%s' failed: ",
@@ -700,14 +811,22 @@ int f2fs_build_file(struct f2fs_sb_info *sbi, struct dentry *de)
 			}
 		}
 #endif
+	} else if (de->data) {
+		n = f2fs_write(sbi, de->ino, de->data, de->data_len, 0);
+		off = de->data_len;
 	} else {
-		while ((n = read(fd, buffer, BLOCK_SZ)) > 0) {
-			f2fs_write(sbi, de->ino, buffer, n, off);
+		u8 *wbuf = malloc(BULK_WRITE_SZ);
+
+		ASSERT(wbuf);
+		while ((n = bulkread(fd, wbuf, BULK_WRITE_SZ, NULL)) > 0) {
+			f2fs_write(sbi, de->ino, wbuf, n, off);
 			off += n;
 		}
+		free(wbuf);
 	}
 
-	close(fd);
+	if (fd >= 0)
+		close(fd);
 	if (n < 0)
 		return -1;
 
@@ -15,6 +15,10 @@
 #define _GNU_SOURCE
 #endif
 #include "fsck.h"
+#include "pipeline.h"
+#include "compress.h"
+#include "dedup_build.h"
+#include "access_profile.h"
 #include <libgen.h>
 #include <dirent.h>
 #ifdef HAVE_MNTENT_H
@@ -40,30 +44,10 @@ static fs_config_f fs_config_func = NULL;
 #include <private/fs_config.h>
 #endif
 
-static int filter_dot(const struct dirent *d)
-{
-	return (strcmp(d->d_name, "..") && strcmp(d->d_name, "."));
-}
-
 static int f2fs_make_directory(struct f2fs_sb_info *sbi,
 				int entries, struct dentry *de)
 {
-	int ret = 0;
-	int i = 0;
-
-	for (i = 0; i < entries; i++) {
-		if (de[i].file_type == F2FS_FT_DIR)
-			ret = f2fs_mkdir(sbi, de + i);
-		else if (de[i].file_type == F2FS_FT_REG_FILE)
-			ret = f2fs_create(sbi, de + i);
-		else if (de[i].file_type == F2FS_FT_SYMLINK)
-			ret = f2fs_symlink(sbi, de + i);
-
-		if (ret)
-			break;
-	}
-
-	return ret;
+	return f2fs_create_entries(sbi, de, entries);
 }
 #endif
 
@@ -141,13 +125,11 @@ static int set_perms_and_caps(struct dentry *de)
 	return 0;
 }
 
-static void set_inode_metadata(struct dentry *de)
+static void set_inode_metadata(struct dentry *de, struct scan_ent *ent)
 {
-	struct stat stat;
-	int ret;
+	struct stat stat = ent->st;
 
-	ret = lstat(de->full_path, &stat);
-	if (ret < 0) {
+	if (ent->err < 0) {
 		ERR_MSG("lstat failure\n");
 		ASSERT(0);
 	}
@@ -162,6 +144,11 @@ static void set_inode_metadata(struct dentry *de)
 			de->from_devino <<= 32;
 			de->from_devino |= stat.st_ino;
 		}
+		if (c.sload_dedup)
+			de->dedup = dedup_lookup(stat.st_dev, stat.st_ino);
+		/* other links of a hard link need its inode to be written */
+		if (c.sload_profile && stat.st_nlink == 1)
+			de->profile = profile_rank(de->path);
 		de->file_type = F2FS_FT_REG_FILE;
 	} else if (S_ISDIR(stat.st_mode)) {
 		de->file_type = F2FS_FT_DIR;
@@ -175,10 +162,8 @@ static void set_inode_metadata(struct dentry *de)
 		de->file_type = F2FS_FT_SOCK;
 	} else if (S_ISLNK(stat.st_mode)) {
 		de->file_type = F2FS_FT_SYMLINK;
-		de->link = calloc(F2FS_BLKSIZE, 1);
-		ASSERT(de->link);
-		ret = readlink(de->full_path, de->link, F2FS_BLKSIZE - 1);
-		ASSERT(ret >= 0);
+		de->link = ent->link;
+		ent->link = NULL;
 	} else {
 		ERR_MSG("unknown file type on %s", de->path);
 		ASSERT(0);
@@ -202,14 +187,21 @@ static void set_inode_metadata(struct dentry *de)
 
 static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 			const char *dir_path, const char *target_out_dir,
-			nid_t dir_ino)
+			nid_t dir_ino, struct pipe_job *scan)
 {
 	int entries = 0;
 	struct dentry *dentries;
-	struct dirent **namelist = NULL;
+	struct scan_dir dir;
+	struct pipe_job **jobs = NULL;
 	int i = 0, ret = 0;
 
-	entries = scandir(full_path, &namelist, filter_dot, (void *)alphasort);
+	if (pipe_wait(scan)) {
+		dir = scan->dir;
+		scan->dir.ents = NULL;
+	} else {
+		scan_directory(full_path, &dir);
+	}
+	entries = dir.nr;
 	if (entries < 0) {
 		ERR_MSG("No entries in %s\n", full_path);
 		return -ENOENT;
@@ -219,35 +211,61 @@ static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 	ASSERT(dentries);
 
 	for (i = 0; i < entries; i++) {
-		dentries[i].name = (unsigned char *)strdup(namelist[i]->d_name);
-		if (dentries[i].name == NULL) {
-			ERR_MSG("Skip: ENOMEM\n");
-			continue;
-		}
+		dentries[i].name = (unsigned char *)dir.ents[i].name;
+		dir.ents[i].name = NULL;
 		dentries[i].len = strlen((char *)dentries[i].name);
 
 		ret = asprintf(&dentries[i].path, "%s%s",
-					dir_path, namelist[i]->d_name);
+					dir_path, dentries[i].name);
 		ASSERT(ret > 0);
 		ret = asprintf(&dentries[i].full_path, "%s/%s",
-					full_path, namelist[i]->d_name);
+					full_path, dentries[i].name);
 		ASSERT(ret > 0);
-		free(namelist[i]);
 
-		set_inode_metadata(dentries + i);
+		set_inode_metadata(dentries + i, dir.ents + i);
 
 		dentries[i].pino = dir_ino;
 	}
 
-	free(namelist);
+	free_scan_dir(&dir);
 
 	ret = f2fs_make_directory(sbi, entries, dentries);
 	if (ret)
 		goto out_free;
 
+	/* let workers scan subdirectories and read files meanwhile */
+	if (pipe_enabled() && entries) {
+		jobs = calloc(entries, sizeof(struct pipe_job *));
+		ASSERT(jobs);
+		for (i = 0; i < entries; i++) {
+			/* a later copy of a deduplicated file is not read */
+			if (dentries[i].dedup && dentries[i].dedup->inner_ino)
+				continue;
+			if (dentries[i].profile)
+				continue;
+			if (dentries[i].file_type == F2FS_FT_REG_FILE)
+				jobs[i] = pipe_new_job(PIPE_READ,
+						dentries[i].full_path,
+						dentries[i].size);
+			else if (dentries[i].file_type == F2FS_FT_DIR)
+				jobs[i] = pipe_new_job(PIPE_SCAN,
+						dentries[i].full_path, 0);
+		}
+		pipe_queue(jobs, entries);
+	}
+
 	for (i = 0; i < entries; i++) {
-		if (dentries[i].file_type == F2FS_FT_REG_FILE) {
+		struct pipe_job *job = jobs ? jobs[i] : NULL;
+
+		if (dentries[i].profile) {
+			/* built by build_profile_files() */
+		} else if (dentries[i].file_type == F2FS_FT_REG_FILE) {
+			if (pipe_wait(job)) {
+				dentries[i].data = job->data;
+				dentries[i].data_len = job->size;
+			}
 			f2fs_build_file(sbi, dentries + i);
+			dentries[i].data = NULL;
 		} else if (dentries[i].file_type == F2FS_FT_DIR) {
 			char *subdir_full_path = NULL;
 			char *subdir_dir_path = NULL;
@@ -262,7 +280,7 @@ static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 			ret = build_directory(sbi, subdir_full_path,
 						subdir_dir_path,
 						target_out_dir,
-						dentries[i].ino);
+						dentries[i].ino, job);
 			free(subdir_full_path);
 			free(subdir_dir_path);
 
@@ -276,11 +294,16 @@ static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 		} else {
 			MSG(1, "Error unknown file type\n");
 		}
+		pipe_release(job);
+		if (jobs)
+			jobs[i] = NULL;
 
-		ret = set_selinux_xattr(sbi, dentries[i].path,
+		if (!dentries[i].profile) {
+			ret = set_selinux_xattr(sbi, dentries[i].path,
 					dentries[i].ino, dentries[i].mode);
-		if (ret)
-			goto out_free;
+			if (ret)
+				goto out_free;
+		}
 
 		free(dentries[i].path);
 		free(dentries[i].full_path);
@@ -288,18 +311,76 @@ static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 	}
 out_free:
 	for (; i < entries; i++) {
+		if (jobs)
+			pipe_release(jobs[i]);
 		free(dentries[i].path);
 		free(dentries[i].full_path);
 		free((void *)dentries[i].name);
 	}
 
+	free(jobs);
 	free(dentries);
 	return 0;
 }
+
+/* build the files of the access profile in the order of first access */
+static int build_profile_files(struct f2fs_sb_info *sbi)
+{
+	struct profile_file *files;
+	struct pipe_job **jobs = NULL;
+	int nr, i, ret = 0;
+
+	nr = profile_place(sbi, &files);
+	if (nr <= 0)
+		return nr;
+
+	if (pipe_enabled()) {
+		jobs = calloc(nr, sizeof(struct pipe_job *));
+		ASSERT(jobs);
+		for (i = 0; i < nr; i++) {
+			struct dentry *de = &files[i].de;
+
+			if (de->dedup && de->dedup->inner_ino)
+				continue;
+			jobs[i] = pipe_new_job(PIPE_READ, de->full_path,
+								de->size);
+		}
+		pipe_queue(jobs, nr);
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct pipe_job *job = jobs ? jobs[i] : NULL;
+		struct dentry *de = &files[i].de;
+
+		if (pipe_wait(job)) {
+			de->data = job->data;
+			de->data_len = job->size;
+		}
+		f2fs_build_file(sbi, de);
+		de->data = NULL;
+		pipe_release(job);
+		if (jobs)
+			jobs[i] = NULL;
+
+		ret = set_selinux_xattr(sbi, de->path, de->ino, de->mode);
+		if (ret)
+			break;
+	}
+
+	for (; jobs && i < nr; i++)
+		pipe_release(jobs[i]);
+	free(jobs);
+	return ret;
+}
 #else
 static int build_directory(struct f2fs_sb_info *sbi, const char *full_path,
 			const char *dir_path, const char *target_out_dir,
-			nid_t dir_ino)
+			nid_t dir_ino, struct pipe_job *scan)
+{
+	return -1;
+}
+
+static int build_profile_files(struct f2fs_sb_info *sbi)
 {
 	return -1;
 }
@@ -361,10 +442,56 @@ int f2fs_sload(struct f2fs_sb_info *sbi)
 	flush_journal_entries(sbi);
 
 	/* initialize empty hardlink cache */
-	sbi->hardlink_cache = 0;
+	f2fs_init_hardlink_cache(sbi);
+
+	if (c.sload_dedup) {
+		if (!(c.feature & cpu_to_le32(F2FS_FEATURE_DEDUP))) {
+			ERR_MSG("Dedup requires the dedup feature\n");
+			return -EINVAL;
+		}
+		ret = dedup_scan(c.from_dir);
+		if (ret) {
+			dedup_finish(sbi);
+			ERR_MSG("Failed to scan for duplicates: %d\n", ret);
+			return ret;
+		}
+	}
+
+	if (c.sload_profile) {
+		ret = profile_load(c.sload_profile);
+		if (ret) {
+			dedup_finish(sbi);
+			profile_exit();
+			ERR_MSG("Failed to load access profile %s: %d\n",
+						c.sload_profile, ret);
+			return ret;
+		}
+	}
+
+	if (c.sload_threads > 0 && pipe_init(c.sload_threads) > 0)
+		MSG(0, "Info: sload with %d threads\n", c.sload_threads);
+	if (c.compress.enabled) {
+		ret = compress_pool_init(c.sload_threads);
+		if (ret) {
+			pipe_exit();
+			dedup_finish(sbi);
+			profile_exit();
+			ERR_MSG("Failed to set up compression: %d\n", ret);
+			return ret;
+		}
+	}
 
 	ret = build_directory(sbi, c.from_dir, "/",
-					c.target_out_dir, F2FS_ROOT_INO(sbi));
+				c.target_out_dir, F2FS_ROOT_INO(sbi), NULL);
+	if (!ret)
+		ret = build_profile_files(sbi);
+	compress_pool_exit();
+	pipe_exit();
+	dedup_finish(sbi);
+	profile_exit();
+	if (!ret)
+		f2fs_update_hardlinks(sbi);
+	f2fs_release_hardlink_cache(sbi);
 	if (ret) {
 		ERR_MSG("Failed to build due to %d\n", ret);
 		return ret;
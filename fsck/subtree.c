@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * subtree.c
+ *
+ * Check the subtrees given by --subtree only. Each subtree is resolved from
+ * a path or an inode number and walked with fsck_chk_node_blk(), so only
+ * the blocks reachable from it get their ownership checked. Instead of the
+ * volume-wide fsck_verify(), the blocks found are checked against SIT.
+ *
+ * In fix mode, errors are fixed in place during the walk. Nodes and blocks
+ * released by the fix are reclaimed by a full check scheduled for the next
+ * run, as NAT and SIT can not be rebuilt from a partial walk.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "subtree.h"
+#include "extra_fsck.h"
+
+struct subtree_roots {
+	nid_t *ino;
+	int nr;
+	int cap;
+};
+
+static void add_root(struct subtree_roots *roots, nid_t ino)
+{
+	if (roots->nr == roots->cap) {
+		int cap = roots->cap ? roots->cap * 2 : 8;
+		nid_t *p = realloc(roots->ino, cap * sizeof(nid_t));
+
+		ASSERT(p);
+		roots->ino = p;
+		roots->cap = cap;
+	}
+	roots->ino[roots->nr++] = ino;
+}
+
+static int chk_root_ino(struct f2fs_sb_info *sbi, nid_t ino, const char *spec)
+{
+	struct node_info ni;
+
+	if (IS_VALID_NID(sbi, ino)) {
+		get_node_info(sbi, ino, &ni);
+		if (ni.ino == ino && is_valid_data_blkaddr(ni.blk_addr))
+			return 0;
+	}
+	MSG(0, "\tError: %s: ino 0x%x is not an allocated inode\n", spec, ino);
+	return -1;
+}
+
+static int resolve_path(struct f2fs_sb_info *sbi, const char *spec,
+					struct subtree_roots *roots)
+{
+	char *path = strdup(spec);
+	nid_t ino;
+	int ret;
+
+	ASSERT(path);
+	/* f2fs_find_path() tokenizes the path in place */
+	ret = f2fs_find_path(sbi, path, &ino);
+	free(path);
+	if (ret) {
+		MSG(0, "\tError: %s: no such file or directory\n", spec);
+		return -1;
+	}
+	if (chk_root_ino(sbi, ino, spec))
+		return -1;
+
+	add_root(roots, ino);
+	return 0;
+}
+
+static int parse_ino_list(struct f2fs_sb_info *sbi, const char *spec,
+					struct subtree_roots *roots)
+{
+	const char *p = spec;
+	unsigned long ino;
+	char *end;
+
+	while (*p) {
+		errno = 0;
+		ino = strtoul(p, &end, 0);
+		if (end == p || errno || ino > UINT32_MAX ||
+				(*end && *end != ',')) {
+			MSG(0, "\tError: invalid inode list %s\n", spec);
+			return -1;
+		}
+		if (chk_root_ino(sbi, ino, spec))
+			return -1;
+
+		add_root(roots, ino);
+		p = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+/*
+ * Skip a root that is given twice or lies in another subtree, the nodes in
+ * it would be visited twice otherwise. Ancestors are found through i_pino.
+ */
+static bool is_nested(struct f2fs_sb_info *sbi, struct subtree_roots *roots,
+					int idx, struct f2fs_node *node_blk)
+{
+	nid_t ino = roots->ino[idx], pino;
+	struct node_info ni;
+	int depth, i;
+
+	for (i = 0; i < idx; i++)
+		if (roots->ino[i] == ino)
+			return true;
+
+	for (depth = 0; depth < SUBTREE_MAX_DEPTH; depth++) {
+		if (ino == F2FS_ROOT_INO(sbi))
+			break;
+
+		get_node_info(sbi, ino, &ni);
+		if (!is_valid_data_blkaddr(ni.blk_addr) ||
+				!IS_VALID_BLK_ADDR(sbi, ni.blk_addr))
+			break;
+		if (dev_read_block(node_blk, ni.blk_addr) < 0)
+			break;
+
+		pino = le32_to_cpu(node_blk->i.i_pino);
+		if (!pino || pino == ino || !IS_VALID_NID(sbi, pino))
+			break;
+		ino = pino;
+
+		for (i = 0; i < roots->nr; i++)
+			if (i != idx && roots->ino[i] == ino)
+				return true;
+	}
+	return false;
+}
+
+/* every block reached from the subtrees must be valid in SIT */
+static u32 chk_reached_blocks(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	u64 sz = min(fsck->main_area_bitmap_sz, (u64)fsck->sit_area_bitmap_sz);
+	u32 nr_missing = 0;
+	u64 i, j;
+
+	for (i = 0; i < sz; i++) {
+		if (!(fsck->main_area_bitmap[i] & ~fsck->sit_area_bitmap[i]))
+			continue;
+
+		for (j = i << 3; j < (i + 1) << 3; j++) {
+			if (!f2fs_test_bit(j, fsck->main_area_bitmap) ||
+					f2fs_test_bit(j, fsck->sit_area_bitmap))
+				continue;
+			if (nr_missing++ < 16)
+				MSG(0, "\tError: blk_addr 0x%"PRIx64" is used "
+					"but invalid in SIT\n",
+					SM_I(sbi)->main_blkaddr + j);
+		}
+	}
+	return nr_missing;
+}
+
+/*
+ * Returns -1 if the subtrees can not be resolved, 1 if inconsistencies are
+ * left in them, and 0 otherwise.
+ */
+int fsck_chk_subtrees(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	struct subtree_roots roots = { NULL, 0, 0 };
+	struct f2fs_compr_blk_cnt cbc;
+	struct f2fs_node *node_blk;
+	struct hard_link_node *node;
+	u32 blk_cnt, nr_missing, nr_outer_links = 0;
+	int i, ret = 0;
+
+	for (i = 0; i < c.nr_subtrees && !ret; i++) {
+		if (c.subtrees[i][0] == '/')
+			ret = resolve_path(sbi, c.subtrees[i], &roots);
+		else
+			ret = parse_ino_list(sbi, c.subtrees[i], &roots);
+	}
+	if (ret)
+		goto out;
+
+	node_blk = (struct f2fs_node *)calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk != NULL);
+
+	TIME_TAG_POINT_START(TIME_PHASE_CHK_SUBTREE);
+	for (i = 0; i < roots.nr; i++) {
+		nid_t ino = roots.ino[i];
+		struct node_info ni;
+
+		if (is_nested(sbi, &roots, i, node_blk)) {
+			MSG(0, "Info: Subtree of ino 0x%x is covered by "
+					"another one\n", ino);
+			continue;
+		}
+
+		get_node_info(sbi, ino, &ni);
+		ret = dev_read_block(node_blk, ni.blk_addr);
+		ASSERT(ret >= 0);
+
+		MSG(0, "Info: Check subtree of ino 0x%x\n", ino);
+		blk_cnt = 1;
+		cbc.cnt = 0;
+		cbc.cheader_pgofs = CHEADER_PGOFS_NONE;
+		fsck_chk_node_blk(sbi, NULL, ino,
+				map_de_type(le16_to_cpu(node_blk->i.i_mode)),
+				TYPE_INODE, &blk_cnt, &cbc, NULL);
+	}
+	TIME_TAG_POINT_END(TIME_PHASE_CHK_SUBTREE);
+	free(node_blk);
+
+	/* links from outside the subtrees are not visited, not an error */
+	for (node = fsck->hard_link_list_head; node; node = node->next)
+		nr_outer_links++;
+	if (nr_outer_links)
+		MSG(0, "Info: %u files have links outside the subtrees\n",
+							nr_outer_links);
+	fsck_free_link_lists(sbi);
+
+	nr_missing = chk_reached_blocks(sbi);
+	MSG(0, "[FSCK] Subtree blocks valid in SIT                   ");
+	if (!nr_missing) {
+		MSG(0, " [Ok..]\n");
+	} else {
+		MSG(0, " [Fail] [0x%x]\n", nr_missing);
+		DMD_ADD_MSG_ERROR(LOG_TYP_FSCK, PR_SIT_INVALID_BLOCK_BITMAP,
+					"nr_missing=%u", nr_missing);
+		c.bug_on = 1;
+	}
+
+	if (c.bug_on && c.fix_on && f2fs_dev_is_writable()) {
+		MSG(0, "Info: Schedule a full check to reclaim the space "
+				"released by the fix\n");
+		SetExtraFlag(sbi->raw_super, EXTRA_NEED_FSCK_FLAG);
+	}
+
+	ret = (c.bug_on && (!c.fix_on || nr_missing)) ? 1 : 0;
+out:
+	free(roots.ino);
+	return ret;
+}
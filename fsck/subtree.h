@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * subtree.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _SUBTREE_H_
+#define _SUBTREE_H_
+
+#include "fsck.h"
+
+#define SUBTREE_MAX_DEPTH	4096	/* bound of the i_pino walk */
+
+int fsck_chk_subtrees(struct f2fs_sb_info *sbi);
+#endif /* _SUBTREE_H_ */
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * target.c
+ *
+ * Targeted check guided by the errors recorded by kernel. The error bits in
+ * s_errors and the stop reasons in s_stop_reason are mapped to the
+ * structures they implicate, and only those are checked: NAT/SIT against
+ * CP, summary blocks, and the inodes of the implicated class, without
+ * walking the whole tree. Any inconsistency found here makes fsck fall back
+ * to a full check.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "target.h"
+#include "dedup.h"
+
+static const unsigned char error_target[ERROR_MAX] = {
+	[ERROR_CORRUPTED_CLUSTER]		= TGT_COMPRESS,
+	[ERROR_FAIL_DECOMPRESSION]		= TGT_COMPRESS,
+	[ERROR_INVALID_BLKADDR]			= TGT_FULL,
+	[ERROR_CORRUPTED_DIRENT]		= TGT_DENTRY,
+	[ERROR_CORRUPTED_INODE]			= TGT_INODE,
+	[ERROR_INCONSISTENT_SUMMARY]		= TGT_SSA,
+	[ERROR_INCONSISTENT_FOOTER]		= TGT_META | TGT_SSA | TGT_INODE,
+	[ERROR_INCONSISTENT_SUM_TYPE]		= TGT_SSA,
+	[ERROR_CORRUPTED_JOURNAL]		= TGT_META,
+	[ERROR_INCONSISTENT_NODE_COUNT]		= TGT_META,
+	[ERROR_INCONSISTENT_BLOCK_COUNT]	= TGT_META | TGT_SSA,
+	[ERROR_INVALID_CURSEG]			= TGT_META,
+	[ERROR_INCONSISTENT_SIT]		= TGT_META | TGT_SSA,
+	[ERROR_CORRUPTED_VERITY_XATTR]		= TGT_XATTR,
+	[ERROR_CORRUPTED_XATTR]			= TGT_XATTR,
+};
+
+static const unsigned char stop_reason_target[STOP_CP_REASON_MAX] = {
+	[STOP_CP_REASON_SHUTDOWN]		= 0,
+	[STOP_CP_REASON_FAULT_INJECT]		= TGT_FULL,
+	[STOP_CP_REASON_META_PAGE]		= TGT_META | TGT_SSA,
+	[STOP_CP_REASON_WRITE_FAIL]		= TGT_FULL,
+	[STOP_CP_REASON_CORRUPTED_SUMMARY]	= TGT_SSA,
+	[STOP_CP_REASON_UPDATE_INODE]		= TGT_INODE,
+	[STOP_CP_REASON_FLUSH_FAIL]		= TGT_FULL,
+};
+
+static const char *target_name[] = {
+	"meta", "ssa", "inode", "dentry", "compress", "xattr",
+};
+
+unsigned int fsck_get_target_mask(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
+	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
+	unsigned int mask = 0;
+	bool recorded = false;
+	int i;
+
+	/* quota usage can only be rebuilt by walking all files */
+	if (c.bug_on || is_set_ckpt_flags(cp, CP_QUOTA_NEED_FSCK_FLAG))
+		return TGT_FULL;
+
+	for (i = 0; i < MAX_F2FS_ERRORS * BITS_PER_BYTE; i++) {
+		if (!test_bit_le(i, sb->s_errors))
+			continue;
+		/* unknown to this version */
+		mask |= i < ERROR_MAX ? error_target[i] : TGT_FULL;
+		recorded = true;
+	}
+
+	for (i = 0; i < MAX_STOP_REASON; i++) {
+		if (!sb->s_stop_reason[i])
+			continue;
+		mask |= i < STOP_CP_REASON_MAX ? stop_reason_target[i] :
+								TGT_FULL;
+		recorded = true;
+	}
+
+	/* kernel asked for fsck without telling why */
+	if (!recorded && (is_set_ckpt_flags(cp, CP_FSCK_FLAG) ||
+				is_set_ckpt_flags(cp, CP_ERROR_FLAG)))
+		return TGT_FULL;
+
+	return mask | TGT_META;
+}
+
+static void print_targets(unsigned int mask)
+{
+	unsigned int i;
+
+	MSG(0, "Info: Targeted check for:");
+	for (i = 0; i < sizeof(target_name) / sizeof(target_name[0]); i++)
+		if (mask & (1 << i))
+			MSG(0, " %s", target_name[i]);
+	MSG(0, "\n");
+}
+
+static int chk_block_count(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+
+	if (fsck->chk.sit_valid_blocks != sbi->total_valid_block_count) {
+		DMD_ADD_ERROR(LOG_TYP_FSCK, PR_VALID_BLOCK_COUNT_MISMATCH_WITH_CP);
+		ASSERT_MSG("valid block does not match: sit_valid_blocks %"PRIu64
+				", valid_block_count %u",
+				fsck->chk.sit_valid_blocks,
+				sbi->total_valid_block_count);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int chk_ssa(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_summary_block *sum_blk;
+	struct seg_entry *se;
+	unsigned int segno;
+	int type, ret = 0;
+
+	/* node summaries are checked entry by entry below */
+	for (segno = 0; segno < MAIN_SEGS(sbi); segno++) {
+		se = get_seg_entry(sbi, segno);
+		if (!se->valid_blocks || IS_NODESEG(se->type))
+			continue;
+
+		sum_blk = get_sum_data_block_from_cache(sbi, segno, &type);
+		if (!sum_blk) {
+			/* saved to cache, freed when cache is destroyed */
+			sum_blk = get_sum_block(sbi, segno, &type);
+		}
+
+		if (type != SEG_TYPE_DATA && type != SEG_TYPE_CUR_DATA) {
+			DMD_ADD_ERROR(LOG_TYP_FSCK, PR_INVALID_SUM_DATA_BLOCK);
+			ASSERT_MSG("Summary footer is not for data segment 0x%x",
+					segno);
+			ret = -EINVAL;
+		}
+	}
+
+	if (fsck_chk_node_summaries(sbi))
+		ret = -EINVAL;
+	return ret;
+}
+
+static unsigned int inode_target(struct f2fs_node *node_blk,
+					enum FILE_TYPE ftype)
+{
+	unsigned int tgt = TGT_INODE;
+
+	if (ftype == F2FS_FT_DIR)
+		tgt |= TGT_DENTRY;
+	if (le32_to_cpu(node_blk->i.i_flags) & F2FS_COMPR_FL)
+		tgt |= TGT_COMPRESS;
+	if (node_blk->i.i_xattr_nid ||
+			(node_blk->i.i_inline & F2FS_INLINE_XATTR))
+		tgt |= TGT_XATTR;
+	return tgt;
+}
+
+/*
+ * Check every inode not visited yet whose class is targeted. Directories
+ * and compressed files get the same check as in a full run except that
+ * dentries are not followed; others only get their inode block checked.
+ */
+static int chk_inodes(struct f2fs_sb_info *sbi, unsigned int mask)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	bool dedup_supported = c.feature & cpu_to_le32(F2FS_FEATURE_DEDUP);
+	struct f2fs_compr_blk_cnt cbc;
+	struct f2fs_node *node_blk;
+	struct node_info ni;
+	u32 nid, blk_cnt;
+	int ret = 0;
+
+	node_blk = (struct f2fs_node *)calloc(BLOCK_SZ, 1);
+	ASSERT(node_blk != NULL);
+
+	fsck->no_descend = true;
+	for (nid = 0; nid < fsck->nr_nat_entries; nid++) {
+		enum FILE_TYPE ftype;
+		unsigned int tgt;
+
+		if (le32_to_cpu(fsck->entries[nid].ino) != nid ||
+				!fsck->entries[nid].block_addr ||
+				!f2fs_test_bit(nid, fsck->nat_area_bitmap))
+			continue;
+
+		get_node_info(sbi, nid, &ni);
+		if (!is_valid_data_blkaddr(ni.blk_addr) ||
+				!IS_VALID_BLK_ADDR(sbi, ni.blk_addr)) {
+			/* let sanity check report it */
+			if (fsck_chk_inode_shallow(sbi, nid,
+						F2FS_FT_UNKNOWN, false))
+				ret = -EINVAL;
+			continue;
+		}
+
+		if (dev_read_block(node_blk, ni.blk_addr) < 0) {
+			ret = -EIO;
+			break;
+		}
+
+		/* checked through their outer inodes only */
+		if (dedup_supported && f2fs_is_deduped_inode(node_blk) &&
+				f2fs_is_inner_inode(node_blk))
+			continue;
+
+		ftype = map_de_type(le16_to_cpu(node_blk->i.i_mode));
+		tgt = inode_target(node_blk, ftype) & mask;
+
+		if (tgt & (TGT_DENTRY | TGT_COMPRESS)) {
+			blk_cnt = 1;
+			cbc.cnt = 0;
+			cbc.cheader_pgofs = CHEADER_PGOFS_NONE;
+			if (fsck_chk_node_blk(sbi, NULL, nid, ftype,
+					TYPE_INODE, &blk_cnt, &cbc, NULL))
+				ret = -EINVAL;
+		} else if (tgt) {
+			if (fsck_chk_inode_shallow(sbi, nid, ftype,
+						tgt & TGT_XATTR))
+				ret = -EINVAL;
+		}
+	}
+	fsck->no_descend = false;
+
+	free(node_blk);
+	return ret;
+}
+
+/* drop what the targeted pass collected so that a full check starts clean */
+static void reset_fsck_state(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+	u32 wp_fixed = fsck->chk.wp_fixed;
+	u32 wp_inconsistent_zones = fsck->chk.wp_inconsistent_zones;
+
+	fsck_free(sbi, false);
+	memset(&fsck->chk, 0, sizeof(fsck->chk));
+	fsck->chk.wp_fixed = wp_fixed;
+	fsck->chk.wp_inconsistent_zones = wp_inconsistent_zones;
+	fsck->nat_valid_inode_cnt = 0;
+	fsck_init(sbi, false);
+
+	c.bug_on = 0;
+}
+
+/* everything recorded by kernel was checked, forget about it */
+static void clear_error_records(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
+	struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
+	struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
+
+	if (is_set_ckpt_flags(cp, CP_FSCK_FLAG) ||
+			is_set_ckpt_flags(cp, CP_ERROR_FLAG)) {
+		/* the tree was not walked, keep the counters of current CP */
+		fsck->chk.valid_blk_cnt = sbi->total_valid_block_count;
+		fsck->chk.valid_node_cnt = sbi->total_valid_node_count;
+		fsck->chk.valid_inode_cnt = sbi->total_valid_inode_count;
+		write_checkpoints(sbi);
+	}
+
+	if (c.abnormal_stop)
+		memset(sb->s_stop_reason, 0, MAX_STOP_REASON);
+
+	if (c.fs_errors)
+		memset(sb->s_errors, 0, MAX_F2FS_ERRORS);
+
+	if (c.abnormal_stop || c.fs_errors)
+		update_superblock(sb, SB_MASK_ALL);
+}
+
+/*
+ * Returns 0 if the targeted structures are consistent, 1 if the recorded
+ * errors can not be narrowed down, and -EINVAL if an inconsistency was
+ * found, in which case fsck state is reset so that the caller can go on
+ * with a full check.
+ */
+int fsck_chk_targeted(struct f2fs_sb_info *sbi)
+{
+	unsigned int mask = fsck_get_target_mask(sbi);
+	int fix_on = c.fix_on;
+	int ret;
+
+	if (mask & TGT_FULL) {
+		MSG(0, "Info: Recorded errors can not be narrowed down, "
+				"check all\n");
+		return 1;
+	}
+	print_targets(mask);
+
+	/* this pass only reports, repair is left to a full fsck */
+	c.fix_on = 0;
+	TIME_TAG_POINT_START(TIME_PHASE_CHK_TARGETED);
+	ret = fsck_chk_meta(sbi);
+	if (!ret)
+		ret = chk_block_count(sbi);
+	if (!ret && (mask & TGT_SSA))
+		ret = chk_ssa(sbi);
+	if (!ret && (mask & ~(TGT_META | TGT_SSA)))
+		ret = chk_inodes(sbi, mask);
+	TIME_TAG_POINT_END(TIME_PHASE_CHK_TARGETED);
+	c.fix_on = fix_on;
+
+	/* links are not verified without a full walk */
+	fsck_free_link_lists(sbi);
+
+	if (ret || c.bug_on) {
+		DMD_ADD_ERROR(LOG_TYP_FSCK, PR_FSCK_META_MISMATCH);
+		MSG(0, "[FSCK] Targeted check   [Fail]\n");
+		MSG(0, "\tError: inconsistency found, force check all\n");
+		reset_fsck_state(sbi);
+		return -EINVAL;
+	}
+	MSG(0, "[FSCK] Targeted check   [Ok..]\n");
+
+	if (c.fix_on && f2fs_dev_is_writable())
+		clear_error_records(sbi);
+	return 0;
+}
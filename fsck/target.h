@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * target.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TARGET_H_
+#define _TARGET_H_
+
+#include "fsck.h"
+
+/* subsystems implicated by the errors recorded by kernel */
+#define TGT_META	0x01	/* NAT, SIT and their counters in CP */
+#define TGT_SSA		0x02	/* summary types and node summaries */
+#define TGT_INODE	0x04	/* inode blocks */
+#define TGT_DENTRY	0x08	/* directories */
+#define TGT_COMPRESS	0x10	/* compressed files */
+#define TGT_XATTR	0x20	/* files with xattrs */
+#define TGT_FULL	0x80	/* can not be narrowed down */
+
+unsigned int fsck_get_target_mask(struct f2fs_sb_info *sbi);
+int fsck_chk_targeted(struct f2fs_sb_info *sbi);
+#endif /* _TARGET_H_ */
@@ -139,6 +139,7 @@ struct compress_data {
 	u8 cdata[];			/* compressed data */
 };
 #define COMPRESS_HEADER_SIZE	(sizeof(struct compress_data))
+#define COMPRESS_LEVEL_OFFSET	8	/* of level in i_compress_flag */
 /* compress context */
 struct compress_ctx {
 	unsigned int cluster_size;	/* page count in cluster */
@@ -460,12 +461,14 @@ typedef struct  {
 	void (*init)(struct compress_ctx *cc);
 	int (*compress)(struct compress_ctx *cc);
 	void (*reset)(struct compress_ctx *cc);
+	void (*exit)(struct compress_ctx *cc);
 } compress_ops;
 
 /* Should be aligned to supported_comp_names and support_comp_ops */
 enum compress_algorithms {
 	COMPR_LZO,
 	COMPR_LZ4,
+	COMPR_ZSTD,
 	MAX_COMPRESS_ALGS,
 };
 
@@ -487,8 +490,10 @@ typedef struct {
 	bool readonly;			/* readonly to release blocks */
 	struct compress_ctx cc;		/* work context */
 	enum compress_algorithms alg;	/* algorithm to compress */
+	unsigned int level;		/* 0 for the default, lz4hc if lz4 */
 	compress_ops *ops;		/* ops per algorithm */
 	unsigned int min_blocks;	/* save more blocks than this */
+	unsigned int probe_clusters;	/* give up a file if these fail */
 	enum filter_policy filter;	/* filter to try compression */
 	filter_ops *filter_ops;		/* filter ops */
 } compress_config_t;
@@ -575,6 +580,8 @@ struct f2fs_configuration {
 	uint32_t lpf_ino;
 	uint32_t root_uid;
 	uint32_t root_gid;
+	char *save_template;		/* format template to write */
+	char *load_template;		/* format template to replay */
 
 	/* defragmentation parameters */
 	int defrag_shrink;
@@ -592,6 +599,10 @@ struct f2fs_configuration {
 	int nr_opt;
 #endif
 	int preserve_perms;
+	int sload_threads;
+	int sload_dedup;
+	char *sload_profile;
+	int sload_format;		/* format the device first */
 
 	/* resize parameters */
 	int safe_resize;
@@ -607,6 +618,20 @@ struct f2fs_configuration {
 	bool permissive;
 	bool record_fsync_failed;
 	bool meta_no_change;
+
+	/* deferred data block check for fsck */
+	int defer_data_chk;
+	char *defer_list;
+
+	/* check only what the errors recorded by kernel implicate */
+	bool targeted_chk;
+
+	/* paths or inode lists of the subtrees to check */
+	char **subtrees;
+	int nr_subtrees;
+
+	/* file to save the progress of fsck to, and resume from */
+	char *progress_file;
 };
 
 #ifdef CONFIG_64BIT
@@ -1135,7 +1160,7 @@ struct f2fs_inode {
 			__le64 i_compr_blocks;	/* # of compressed blocks */
 			__u8 i_compress_algrithm;	/* compress algrithm */
 			__u8 i_log_cluster_size;	/* log of cluster size */
-			__le16 i_padding;		/* padding */
+			__le16 i_compress_flag;		/* compress flag and level */
 			__le32 i_inner_ino;		/* for layered inode */
 			__le32 i_dedup_flags;	/* dedup file attributes */
 			__le32 i_dedup_rsvd;	/* reserved for dedup */
@@ -1535,6 +1560,9 @@ extern int f2fs_fsync_device(void);
 
 extern void dcache_init(void);
 extern void dcache_release(void);
+extern void dev_wb_init(void);
+extern int dev_wb_walk(int (*)(void *, __u64, void *), void *);
+extern void dev_mark_zeroed(__u64, __u64, __u64, unsigned int);
 
 extern int dev_read(void *, __u64, size_t);
 #ifdef POSIX_FADV_WILLNEED
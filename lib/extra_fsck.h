@@ -18,6 +18,7 @@ struct ExtraFlagsBlock {
 
 #define EXTRA_NEED_FSCK_FLAG    0x4653434b      // ascii of "FSCK"
 
+void SetExtraFlag(struct f2fs_super_block *sb, unsigned int flag);
 void ClearExtraFlag(struct f2fs_super_block *sb, unsigned int flag);
 void CheckExtraFlag(struct f2fs_super_block *sb, unsigned int flag);
 
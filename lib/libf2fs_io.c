@@ -41,16 +41,62 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
 #include "f2fs_fs.h"
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#else
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#endif
+
 struct f2fs_configuration c;
 
 #ifdef HAVE_SPARSE_SPARSE_H
 #include <sparse/sparse.h>
 struct sparse_file *f2fs_sparse_file;
-static char **blocks;
+
+/*
+ * The blocks of a sparse image are kept in chunks of SPARSE_CHUNK_BLKS
+ * blocks, whose data is allocated when one of their blocks is first
+ * written with anything but zeroes. Zero blocks only take a bit, and the
+ * data of a chunk is contiguous, so it is handed to libsparse as is.
+ *
+ * Past SPARSE_RESIDENT_CHUNKS chunks with data in memory, the least
+ * recently written chunk of the main area is moved to a spill file next
+ * to the image, where its blocks are read and written from then on, and
+ * which libsparse reads when the image is written out. Chunks of the
+ * metadata areas, rewritten by every checkpoint, stay in memory.
+ */
+#define SPARSE_CHUNK_BITS	9
+#define SPARSE_CHUNK_BLKS	(1 << SPARSE_CHUNK_BITS)	/* 2MB */
+#define SPARSE_CHUNK_BYTES	(SPARSE_CHUNK_BLKS * F2FS_BLKSIZE)
+#define SPARSE_RESIDENT_CHUNKS	64
+
+struct sparse_chunk {
+	char *data;				/* NULL until a block has data */
+	char data_map[SPARSE_CHUNK_BLKS / 8];	/* block holds data */
+	char zero_map[SPARSE_CHUNK_BLKS / 8];	/* block is filled with 0 */
+	uint64_t nr;
+	off64_t spill_ofs;			/* data in the spill file */
+	bool spilled;
+	struct sparse_chunk *prev, *next;	/* resident, latest first */
+};
+
+static struct sparse_chunk **chunks;
+static uint64_t nr_chunks;
 uint64_t blocks_count;
-static char *zeroed_block;
+
+static struct sparse_chunk *resident_head, *resident_tail;
+static unsigned int nr_resident;
+static uint64_t meta_chunks;		/* chunks before the main area */
+static bool meta_known;
+static int spill_fd = -1;
+static off64_t spill_size;
+static bool spill_failed;		/* keep all chunks in memory */
 #endif
 
 static int __get_device_fd(__u64 *offset)
@@ -78,6 +124,448 @@ static inline off64_t lseek64(int fd, __u64 offset, int set)
 }
 #endif
 
+/* ---------- areas known to read as zeros -------------------------------- */
+/*
+ * mkfs zeroes the SIT and NAT areas, and the few blocks it writes there
+ * afterwards stay in the write-back journal.  When sload.f2fs -F mounts
+ * the image it has just formatted, reads inside them are answered with
+ * zeros and the journal instead of going to the device.  An area is
+ * forgotten once a write to it reaches the device, and all of them once
+ * the journal is written out.
+ */
+#define ZERO_MAX_AREAS		4
+
+struct zero_area {
+	__u64 start;		/* byte offset of the first extent */
+	__u64 len;		/* bytes per extent */
+	__u64 stride;		/* bytes from one extent to the next */
+	unsigned int count;	/* number of extents */
+};
+
+static struct zero_area zero_areas[ZERO_MAX_AREAS];
+static int nr_zero_areas;
+
+/* @count extents of @len bytes, @stride bytes apart from @start, are zero */
+void dev_mark_zeroed(__u64 start, __u64 len, __u64 stride, unsigned int count)
+{
+	struct zero_area *za;
+
+	if (c.sparse_mode || !len || !count ||
+			nr_zero_areas == ZERO_MAX_AREAS)
+		return;
+
+	za = &zero_areas[nr_zero_areas++];
+	za->start = start;
+	za->len = len;
+	za->stride = count > 1 ? stride : len;
+	za->count = count;
+}
+
+static bool zero_area_read(void *buf, __u64 offset, size_t len)
+{
+	int i;
+
+	for (i = 0; i < nr_zero_areas; i++) {
+		struct zero_area *za = &zero_areas[i];
+		__u64 rel = offset - za->start;
+
+		if (offset < za->start || rel / za->stride >= za->count ||
+				rel % za->stride + len > za->len)
+			continue;
+		memset(buf, 0, len);
+		return true;
+	}
+	return false;
+}
+
+static void zero_area_drop(__u64 offset, size_t len)
+{
+	int i = 0;
+
+	while (i < nr_zero_areas) {
+		struct zero_area *za = &zero_areas[i];
+		__u64 idx = 0;
+
+		/* first extent ending past @offset */
+		if (offset >= za->start + za->len)
+			idx = (offset - za->start - za->len) / za->stride + 1;
+		if (idx >= za->count ||
+				za->start + idx * za->stride >= offset + len) {
+			i++;
+			continue;
+		}
+		*za = zero_areas[--nr_zero_areas];
+	}
+}
+
+/* ---------- write-back journal for fsck repairs and mkfs ----------------- */
+/*
+ * Repairs, and mkfs past the SIT and NAT areas, write single blocks
+ * scattered over the device.  Once enabled, block aligned writes are
+ * kept here instead: a later write of a block replaces the earlier one,
+ * and reads see the kept blocks.  wb_flush()
+ * writes them out sorted by address with vectored writes; runs that fail
+ * stay kept for the next flush and the error is returned.  It runs first
+ * in f2fs_fsync_device(), so every barrier orders the same writes as when
+ * they were written through.
+ */
+#define WB_HASH_SIZE		4096
+#define WB_MIN_BLOCKS		256
+#define WB_MAX_BLOCKS		16384	/* flush early beyond 64MB */
+#ifndef IOV_MAX
+#define IOV_MAX			1024
+#endif
+
+struct wb_entry {
+	int fd;
+	off64_t blk;		/* block address in the device of @fd */
+	long next;		/* next entry in the hash chain, or -1 */
+};
+
+static bool wb_enabled;
+static bool wb_exit_registered;
+static struct wb_entry *wb_ent;
+static char *wb_buf;		/* block data, indexed like wb_ent */
+static long wb_hash[WB_HASH_SIZE];
+static long wb_nr;
+static long wb_cap;
+
+static uint64_t wb_nwrite;	/* blocks written by the callers */
+static uint64_t wb_nflush;	/* blocks written out */
+static uint64_t wb_niov;	/* vectored writes issued */
+
+static inline char *wb_addr(long entry)
+{
+	return wb_buf + F2FS_BLKSIZE * entry;
+}
+
+static inline long *wb_head(int fd, off64_t blk)
+{
+	return &wb_hash[(blk + fd) % WB_HASH_SIZE];
+}
+
+static long wb_find(int fd, off64_t blk)
+{
+	long entry;
+
+	for (entry = *wb_head(fd, blk); entry >= 0; entry = wb_ent[entry].next)
+		if (wb_ent[entry].blk == blk && wb_ent[entry].fd == fd)
+			return entry;
+	return -1;
+}
+
+static void wb_reset(void)
+{
+	memset(wb_hash, 0xff, sizeof(wb_hash));
+	wb_nr = 0;
+}
+
+static int wb_grow(void)
+{
+	long cap = wb_cap ? wb_cap * 2 : WB_MIN_BLOCKS;
+	struct wb_entry *ent;
+	char *buf;
+
+	if (cap > WB_MAX_BLOCKS)
+		return -1;
+	ent = realloc(wb_ent, cap * sizeof(struct wb_entry));
+	if (!ent)
+		return -1;
+	wb_ent = ent;
+	buf = realloc(wb_buf, cap * F2FS_BLKSIZE);
+	if (!buf)
+		return -1;
+	wb_buf = buf;
+	wb_cap = cap;
+	return 0;
+}
+
+static int wb_write_run(int fd, struct iovec *iov, int cnt, off64_t offset)
+{
+#ifdef HAVE_PWRITEV
+	ssize_t ret;
+
+	wb_niov++;
+	while (cnt) {
+		ret = pwritev64(fd, iov, cnt, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		offset += ret;
+
+		/* short write: skip what went out and retry the rest */
+		while (cnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+#else
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		wb_niov++;
+		if (pwrite64(fd, iov[i].iov_base, iov[i].iov_len, offset) < 0)
+			return -1;
+		offset += iov[i].iov_len;
+	}
+#endif
+	return 0;
+}
+
+static int wb_cmp(const void *a, const void *b)
+{
+	const struct wb_entry *x = &wb_ent[*(const long *)a];
+	const struct wb_entry *y = &wb_ent[*(const long *)b];
+
+	if (x->fd != y->fd)
+		return x->fd < y->fd ? -1 : 1;
+	if (x->blk != y->blk)
+		return x->blk < y->blk ? -1 : 1;
+	return 0;
+}
+
+static int wb_idx_cmp(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the kept entries, sorted by device and address */
+static long *wb_sorted(void)
+{
+	long *order;
+	long i;
+
+	order = malloc(wb_nr * sizeof(long));
+	if (!order)
+		return NULL;
+	for (i = 0; i < wb_nr; i++)
+		order[i] = i;
+	qsort(order, wb_nr, sizeof(long), wb_cmp);
+	return order;
+}
+
+/*
+ * keep only the @nkeep entries listed in @keep, which failed to be written
+ * and are retried by the next flush
+ */
+static void wb_keep(long *keep, long nkeep)
+{
+	long i;
+
+	qsort(keep, nkeep, sizeof(long), wb_idx_cmp);
+	wb_reset();
+	for (i = 0; i < nkeep; i++) {
+		struct wb_entry *e = &wb_ent[i];
+
+		/* entries only move down, @keep is ascending */
+		if (keep[i] != i) {
+			*e = wb_ent[keep[i]];
+			memcpy(wb_addr(i), wb_addr(keep[i]), F2FS_BLKSIZE);
+		}
+		e->next = *wb_head(e->fd, e->blk);
+		*wb_head(e->fd, e->blk) = i;
+	}
+	wb_nr = nkeep;
+}
+
+static int wb_flush(void)
+{
+	struct iovec *iov;
+	long *order;
+	long start, nkeep = 0;
+	int i, cnt, ret = 0;
+
+	if (!wb_nr)
+		return 0;
+
+	/* the kept blocks are no longer the only ones written there */
+	nr_zero_areas = 0;
+
+	order = wb_sorted();
+	iov = malloc(IOV_MAX * sizeof(struct iovec));
+	if (!order || !iov) {
+		MSG(0, "\tError: Malloc Failed for write-back flush!!!\n");
+		free(order);
+		free(iov);
+		return -1;
+	}
+
+	for (start = 0; start < wb_nr; start += cnt) {
+		struct wb_entry *first = &wb_ent[order[start]];
+
+		/* one run of consecutive blocks on the same device */
+		for (cnt = 0; start + cnt < wb_nr && cnt < IOV_MAX; cnt++) {
+			struct wb_entry *e = &wb_ent[order[start + cnt]];
+
+			if (e->fd != first->fd || e->blk != first->blk + cnt)
+				break;
+			iov[cnt].iov_base = wb_addr(order[start + cnt]);
+			iov[cnt].iov_len = F2FS_BLKSIZE;
+		}
+		if (wb_write_run(first->fd, iov, cnt,
+				first->blk * F2FS_BLKSIZE) < 0) {
+			MSG(0, "\tError: Could not write back %d blocks!!!\n",
+									cnt);
+			/* still write the other runs, keep this one */
+			for (i = 0; i < cnt; i++)
+				order[nkeep++] = order[start + i];
+			ret = -1;
+			continue;
+		}
+		wb_nflush += cnt;
+	}
+	free(iov);
+
+	DBG(1, "\tWrite-back: %"PRIu64" writes, %"PRIu64" blocks in "
+			"%"PRIu64" I/Os\n", wb_nwrite, wb_nflush, wb_niov);
+	wb_keep(order, nkeep);
+	free(order);
+	return ret;
+}
+
+static void wb_exit(void)
+{
+	if (wb_enabled && wb_flush() < 0)
+		MSG(0, "\tError: Lost repair writes at exit!!!\n");
+	wb_enabled = false;
+	free(wb_ent);
+	free(wb_buf);
+	wb_ent = NULL;
+	wb_buf = NULL;
+	wb_cap = 0;
+}
+
+/* keep @len aligned bytes at @offset of @fd in the journal */
+static int wb_add(int fd, void *buf, off64_t offset, size_t len)
+{
+	off64_t blk = offset / F2FS_BLKSIZE;
+	char *p = buf;
+
+	for (; len; len -= F2FS_BLKSIZE, p += F2FS_BLKSIZE, blk++) {
+		long entry = wb_find(fd, blk);
+
+		wb_nwrite++;
+		if (entry < 0) {
+			if (wb_nr == wb_cap && wb_grow() < 0 && wb_flush() < 0)
+				return -1;
+			entry = wb_nr++;
+			wb_ent[entry].fd = fd;
+			wb_ent[entry].blk = blk;
+			wb_ent[entry].next = *wb_head(fd, blk);
+			*wb_head(fd, blk) = entry;
+		}
+		memcpy(wb_addr(entry), p, F2FS_BLKSIZE);
+	}
+	return 0;
+}
+
+static void wb_copy(long entry, void *buf, off64_t offset,
+		size_t byte_count, bool is_write)
+{
+	off64_t blk_start = wb_ent[entry].blk * F2FS_BLKSIZE;
+	off64_t start = max(offset, blk_start);
+	off64_t end = min(offset + (off64_t)byte_count,
+					blk_start + F2FS_BLKSIZE);
+
+	if (is_write)
+		memcpy(wb_addr(entry) + (start - blk_start),
+				(char *)buf + (start - offset), end - start);
+	else
+		memcpy((char *)buf + (start - offset),
+				wb_addr(entry) + (start - blk_start), end - start);
+}
+
+/*
+ * read: copy kept blocks over what was read from the device
+ * write: update kept blocks with data written around the journal
+ */
+static void wb_update_rw(int fd, void *buf, off64_t offset,
+		size_t byte_count, bool is_write)
+{
+	off64_t first = offset / F2FS_BLKSIZE;
+	off64_t last = (offset + byte_count - 1) / F2FS_BLKSIZE;
+	off64_t blk;
+	long entry;
+
+	if (!wb_nr || !byte_count)
+		return;
+
+	/* large ranges are faster to match entry by entry */
+	if (last - first >= wb_nr) {
+		for (entry = 0; entry < wb_nr; entry++)
+			if (wb_ent[entry].fd == fd &&
+					wb_ent[entry].blk >= first &&
+					wb_ent[entry].blk <= last)
+				wb_copy(entry, buf, offset, byte_count,
+								is_write);
+		return;
+	}
+
+	for (blk = first; blk <= last; blk++) {
+		entry = wb_find(fd, blk);
+		if (entry >= 0)
+			wb_copy(entry, buf, offset, byte_count, is_write);
+	}
+}
+
+/*
+ * Keep block aligned writes of fsck repairs or mkfs in memory until the
+ * next f2fs_fsync_device() or f2fs_finalize_device().
+ */
+void dev_wb_init(void)
+{
+	if (wb_enabled || c.sparse_mode || c.zoned_model == F2FS_ZONED_HM)
+		return;
+	if (wb_grow() < 0)
+		return;
+
+	wb_reset();
+	wb_nwrite = wb_nflush = wb_niov = 0;
+	wb_enabled = true;
+
+	if (!wb_exit_registered) {
+		wb_exit_registered = true;
+		atexit(wb_exit);
+	}
+}
+
+/*
+ * Call @fn on each kept block of the first device, in address order. This
+ * fails once blocks were written out, as they are not all kept then.
+ */
+int dev_wb_walk(int (*fn)(void *priv, __u64 blkaddr, void *buf), void *priv)
+{
+	long *order;
+	long i;
+	int ret = 0;
+
+	if (!wb_enabled || wb_nflush)
+		return -1;
+	if (!wb_nr)
+		return 0;
+
+	order = wb_sorted();
+	if (!order)
+		return -ENOMEM;
+
+	for (i = 0; i < wb_nr && !ret; i++) {
+		struct wb_entry *e = &wb_ent[order[i]];
+
+		if (e->fd == c.devices[0].fd)
+			ret = fn(priv, e->blk, wb_addr(order[i]));
+	}
+	free(order);
+	return ret;
+}
+
 /* ---------- dev_cache, Least Used First (LUF) policy  ------------------- */
 /*
  * Least used block will be the first victim to be replaced when max hash
@@ -287,6 +775,9 @@ static int dcache_io_read(int fd, long entry, off64_t offset, off64_t blk)
 		MSG(0, "\n read() fail.\n");
 		return -1;
 	}
+	/* the device is behind the write-back journal */
+	wb_update_rw(fd, dcache_buf + entry * F2FS_BLKSIZE, offset,
+							F2FS_BLKSIZE, false);
 	dcache_lastused[entry] = ++dcache_usetick;
 	dcache_valid[entry] = true;
 	dcache_blk[entry] = blk;
@@ -400,54 +891,223 @@ int dev_read_version(void *buf, __u64 offset, size_t len)
 }
 
 #ifdef HAVE_SPARSE_SPARSE_H
-static int sparse_read_blk(__u64 block, int count, void *buf)
+static struct sparse_chunk *sparse_get_chunk(__u64 block, bool alloc)
+{
+	struct sparse_chunk *chunk;
+	uint64_t nr = block >> SPARSE_CHUNK_BITS;
+
+	if (block >= blocks_count)
+		return NULL;
+
+	chunk = chunks[nr];
+	if (!chunk && alloc) {
+		chunk = calloc(1, sizeof(struct sparse_chunk));
+		if (chunk)
+			chunk->nr = nr;
+		chunks[nr] = chunk;
+	}
+	return chunk;
+}
+
+static void sparse_unlink_resident(struct sparse_chunk *chunk)
+{
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		resident_head = chunk->next;
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+	else
+		resident_tail = chunk->prev;
+	chunk->prev = chunk->next = NULL;
+	nr_resident--;
+}
+
+static void sparse_link_resident(struct sparse_chunk *chunk)
+{
+	chunk->next = resident_head;
+	if (resident_head)
+		resident_head->prev = chunk;
+	else
+		resident_tail = chunk;
+	resident_head = chunk;
+	nr_resident++;
+}
+
+/* the main area starts after the metadata, as the superblock says */
+static void sparse_find_meta(void)
+{
+	struct f2fs_super_block *sb;
+	struct sparse_chunk *chunk = chunks[0];
+
+	if (!chunk || !chunk->data || !f2fs_test_bit(0, chunk->data_map))
+		return;
+
+	sb = (struct f2fs_super_block *)(chunk->data + F2FS_SUPER_OFFSET);
+	if (le32_to_cpu(sb->magic) != F2FS_SUPER_MAGIC)
+		return;
+
+	meta_chunks = SIZE_ALIGN(le32_to_cpu(sb->main_blkaddr),
+						SPARSE_CHUNK_BLKS);
+	meta_known = true;
+}
+
+static int sparse_open_spill(void)
+{
+	char name[PATH_MAX];
+
+	if (snprintf(name, sizeof(name), "%s.spill.XXXXXX",
+				c.devices[0].path) >= (int)sizeof(name))
+		return -ENAMETOOLONG;
+
+	spill_fd = mkstemp(name);
+	if (spill_fd < 0) {
+		MSG(0, "\tInfo: Failed to create %s, keep the image in memory\n",
+									name);
+		spill_failed = true;
+		return -errno;
+	}
+	unlink(name);
+	return 0;
+}
+
+static int sparse_spill(struct sparse_chunk *chunk)
+{
+	if (spill_fd < 0 && sparse_open_spill())
+		return -1;
+
+	if (pwrite64(spill_fd, chunk->data, SPARSE_CHUNK_BYTES,
+					spill_size) != SPARSE_CHUNK_BYTES)
+		return -1;
+
+	sparse_unlink_resident(chunk);
+	free(chunk->data);
+	chunk->data = NULL;
+	chunk->spill_ofs = spill_size;
+	chunk->spilled = true;
+	spill_size += SPARSE_CHUNK_BYTES;
+	return 0;
+}
+
+/* @chunk was just written, keep the others within the resident limit */
+static int sparse_touch(struct sparse_chunk *chunk)
+{
+	struct sparse_chunk *victim;
+
+	if (spill_failed || (meta_known && chunk->nr < meta_chunks))
+		return 0;
+
+	if (chunk->prev || chunk == resident_head) {
+		sparse_unlink_resident(chunk);
+		sparse_link_resident(chunk);
+		return 0;
+	}
+	sparse_link_resident(chunk);
+
+	while (nr_resident > SPARSE_RESIDENT_CHUNKS) {
+		if (!meta_known)
+			sparse_find_meta();
+
+		victim = resident_tail;
+		if (meta_known && victim->nr < meta_chunks) {
+			sparse_unlink_resident(victim);
+			continue;
+		}
+		if (sparse_spill(victim))
+			return spill_failed ? 0 : -EIO;
+	}
+	return 0;
+}
+
+static bool sparse_zero_block(const char *buf)
 {
+	const uint64_t *p = (const uint64_t *)buf;
 	int i;
+
+	for (i = 0; i < F2FS_BLKSIZE / sizeof(uint64_t); i++)
+		if (p[i])
+			return false;
+	return true;
+}
+
+static int sparse_read_blk(__u64 block, int count, void *buf)
+{
+	struct sparse_chunk *chunk;
 	char *out = buf;
-	__u64 cur_block;
+	unsigned int ofs;
+	int i;
 
-	for (i = 0; i < count; ++i) {
-		cur_block = block + i;
-		if (blocks[cur_block])
-			memcpy(out + (i * F2FS_BLKSIZE),
-					blocks[cur_block], F2FS_BLKSIZE);
-		else if (blocks)
-			memset(out + (i * F2FS_BLKSIZE), 0, F2FS_BLKSIZE);
+	for (i = 0; i < count; ++i, out += F2FS_BLKSIZE) {
+		chunk = sparse_get_chunk(block + i, false);
+		ofs = (block + i) & (SPARSE_CHUNK_BLKS - 1);
+		if (!chunk || !f2fs_test_bit(ofs, chunk->data_map))
+			memset(out, 0, F2FS_BLKSIZE);
+		else if (!chunk->spilled)
+			memcpy(out, chunk->data + ofs * F2FS_BLKSIZE,
+							F2FS_BLKSIZE);
+		else if (pread64(spill_fd, out, F2FS_BLKSIZE, chunk->spill_ofs +
+				ofs * F2FS_BLKSIZE) != F2FS_BLKSIZE)
+			return -1;
 	}
 	return 0;
 }
 
 static int sparse_write_blk(__u64 block, int count, const void *buf)
 {
-	int i;
-	__u64 cur_block;
+	struct sparse_chunk *chunk;
 	const char *in = buf;
+	unsigned int ofs;
+	int i;
 
-	for (i = 0; i < count; ++i) {
-		cur_block = block + i;
-		if (blocks[cur_block] == zeroed_block)
-			blocks[cur_block] = NULL;
-		if (!blocks[cur_block]) {
-			blocks[cur_block] = calloc(1, F2FS_BLKSIZE);
-			if (!blocks[cur_block])
-				return -ENOMEM;
+	for (i = 0; i < count; ++i, in += F2FS_BLKSIZE) {
+		chunk = sparse_get_chunk(block + i, true);
+		if (!chunk)
+			return block + i >= blocks_count ? -EINVAL : -ENOMEM;
+		ofs = (block + i) & (SPARSE_CHUNK_BLKS - 1);
+
+		if (sparse_zero_block(in)) {
+			f2fs_clear_bit(ofs, chunk->data_map);
+			f2fs_set_bit(ofs, chunk->zero_map);
+			continue;
 		}
-		memcpy(blocks[cur_block], in + (i * F2FS_BLKSIZE),
-				F2FS_BLKSIZE);
+
+		if (chunk->spilled) {
+			if (pwrite64(spill_fd, in, F2FS_BLKSIZE,
+					chunk->spill_ofs + ofs * F2FS_BLKSIZE) !=
+							F2FS_BLKSIZE)
+				return -EIO;
+		} else {
+			if (!chunk->data) {
+				chunk->data = malloc(SPARSE_CHUNK_BYTES);
+				if (!chunk->data)
+					return -ENOMEM;
+			}
+			memcpy(chunk->data + ofs * F2FS_BLKSIZE, in,
+							F2FS_BLKSIZE);
+		}
+		f2fs_set_bit(ofs, chunk->data_map);
+		f2fs_clear_bit(ofs, chunk->zero_map);
+
+		if (!chunk->spilled && sparse_touch(chunk))
+			return -EIO;
 	}
 	return 0;
 }
 
 static int sparse_write_zeroed_blk(__u64 block, int count)
 {
+	struct sparse_chunk *chunk;
+	unsigned int ofs;
 	int i;
-	__u64 cur_block;
 
 	for (i = 0; i < count; ++i) {
-		cur_block = block + i;
-		if (blocks[cur_block])
+		chunk = sparse_get_chunk(block + i, true);
+		if (!chunk)
+			return block + i >= blocks_count ? -EINVAL : -ENOMEM;
+		ofs = (block + i) & (SPARSE_CHUNK_BLKS - 1);
+		if (f2fs_test_bit(ofs, chunk->data_map))
 			continue;
-		blocks[cur_block] = zeroed_block;
+		f2fs_set_bit(ofs, chunk->zero_map);
 	}
 	return 0;
 }
@@ -467,35 +1127,71 @@ static int sparse_import_segment(void *UNUSED(priv), const void *data, int len,
 	return sparse_write_blk(block, nr_blocks, data);
 }
 
-static int sparse_merge_blocks(uint64_t start, uint64_t num, int zero)
+static int sparse_add_fill(uint64_t *start, uint64_t *len)
 {
-	char *buf;
-	uint64_t i;
+	int ret = 0;
 
-	if (zero) {
-		blocks[start] = NULL;
-		return sparse_file_add_fill(f2fs_sparse_file, 0x0,
-					F2FS_BLKSIZE * num, start);
-	}
+	if (*len)
+		ret = sparse_file_add_fill(f2fs_sparse_file, 0x0,
+					*len * F2FS_BLKSIZE, *start);
+	*len = 0;
+	return ret;
+}
 
-	buf = calloc(num, F2FS_BLKSIZE);
-	if (!buf) {
-		fprintf(stderr, "failed to alloc %llu\n",
-			(unsigned long long)num * F2FS_BLKSIZE);
-		return -ENOMEM;
-	}
+/*
+ * Add the blocks to the sparse file in order: runs of data straight from
+ * the chunks or the spill file, and runs of zero blocks, which may span
+ * chunks, as fills.
+ */
+static int sparse_add_chunks(void)
+{
+	struct sparse_chunk *chunk;
+	uint64_t nr, block, fill_start = 0, fill_len = 0;
+	unsigned int ofs, end;
+	int ret = 0;
 
-	for (i = 0; i < num; i++) {
-		memcpy(buf + i * F2FS_BLKSIZE, blocks[start + i], F2FS_BLKSIZE);
-		free(blocks[start + i]);
-		blocks[start + i] = NULL;
-	}
+	for (nr = 0; nr < nr_chunks && !ret; nr++) {
+		chunk = chunks[nr];
+		if (!chunk)
+			continue;
 
-	/* free_sparse_blocks will release this buf. */
-	blocks[start] = buf;
+		for (ofs = 0; ofs < SPARSE_CHUNK_BLKS && !ret; ofs = end) {
+			block = (nr << SPARSE_CHUNK_BITS) + ofs;
+			end = ofs + 1;
+
+			if (f2fs_test_bit(ofs, chunk->zero_map)) {
+				if (fill_start + fill_len != block)
+					ret = sparse_add_fill(&fill_start,
+								&fill_len);
+				if (!fill_len)
+					fill_start = block;
+				fill_len++;
+				continue;
+			}
 
-	return sparse_file_add_data(f2fs_sparse_file, blocks[start],
-					F2FS_BLKSIZE * num, start);
+			ret = sparse_add_fill(&fill_start, &fill_len);
+			if (ret || !f2fs_test_bit(ofs, chunk->data_map))
+				continue;
+
+			while (end < SPARSE_CHUNK_BLKS &&
+					f2fs_test_bit(end, chunk->data_map))
+				end++;
+			if (chunk->spilled)
+				ret = sparse_file_add_fd(f2fs_sparse_file,
+					spill_fd,
+					chunk->spill_ofs + ofs * F2FS_BLKSIZE,
+					(uint64_t)(end - ofs) * F2FS_BLKSIZE,
+					block);
+			else
+				ret = sparse_file_add_data(f2fs_sparse_file,
+					chunk->data + ofs * F2FS_BLKSIZE,
+					(uint64_t)(end - ofs) * F2FS_BLKSIZE,
+					block);
+		}
+	}
+	if (!ret)
+		ret = sparse_add_fill(&fill_start, &fill_len);
+	return ret;
 }
 #else
 static int sparse_read_blk(__u64 UNUSED(block),
@@ -529,6 +1225,12 @@ int dev_read(void *buf, __u64 offset, size_t len)
 	if (fd < 0)
 		return fd;
 
+	if (nr_zero_areas && fd == c.devices[0].fd &&
+			zero_area_read(buf, offset, len)) {
+		wb_update_rw(fd, buf, (off64_t)offset, len, false);
+		return 0;
+	}
+
 	/* err = 1: cache not available, fall back to non-cache R/W */
 	/* err = 0: success, err=-1: I/O error */
 	err = dcache_read(fd, buf, (off64_t)offset, len);
@@ -536,6 +1238,7 @@ int dev_read(void *buf, __u64 offset, size_t len)
 		return err;
 	if (pread64(fd, buf, len, offset) < 0)
 		return -1;
+	wb_update_rw(fd, buf, (off64_t)offset, len, false);
 	return 0;
 }
 
@@ -577,6 +1280,13 @@ int dev_write(void *buf, __u64 offset, size_t len)
 	 */
 	if (dcache_update_cache(fd, buf, (off64_t)offset, len) < 0)
 		return -1;
+	if (wb_enabled) {
+		if (!(offset % F2FS_BLKSIZE) && !(len % F2FS_BLKSIZE))
+			return wb_add(fd, buf, (off64_t)offset, len);
+		wb_update_rw(fd, buf, (off64_t)offset, len, true);
+	}
+	if (nr_zero_areas)
+		zero_area_drop(offset, len);
 	if (pwrite64(fd, buf, len, offset) < 0)
 		return -1;
 	return 0;
@@ -609,6 +1319,9 @@ int dev_fill(void *buf, __u64 offset, size_t len)
 	/* Only allow fill to zero */
 	if (*((__u8*)buf))
 		return -1;
+	wb_update_rw(fd, buf, (off64_t)offset, len, true);
+	if (nr_zero_areas)
+		zero_area_drop(offset, len);
 	if (pwrite64(fd, buf, len, offset) < 0)
 		return -1;
 	return 0;
@@ -633,7 +1346,12 @@ int f2fs_fsync_device(void)
 {
 #ifdef HAVE_FSYNC
 	int i;
+#endif
 
+	/* kept repair writes go out before the barrier */
+	if (wb_flush() < 0)
+		return -1;
+#ifdef HAVE_FSYNC
 	for (i = 0; i < c.ndevs; i++) {
 		if (fsync(c.devices[i].fd) < 0) {
 			MSG(0, "\tError: Could not conduct fsync!!!\n");
@@ -666,15 +1384,10 @@ int f2fs_init_sparse_file(void)
 		return -1;
 	}
 	blocks_count = c.device_size / F2FS_BLKSIZE;
-	blocks = calloc(blocks_count, sizeof(char *));
-	if (!blocks) {
-		MSG(0, "\tError: Calloc Failed for blocks!!!\n");
-		return -1;
-	}
-
-	zeroed_block = calloc(1, F2FS_BLKSIZE);
-	if (!zeroed_block) {
-		MSG(0, "\tError: Calloc Failed for zeroed block!!!\n");
+	nr_chunks = SIZE_ALIGN(blocks_count, SPARSE_CHUNK_BLKS);
+	chunks = calloc(nr_chunks, sizeof(struct sparse_chunk *));
+	if (!chunks) {
+		MSG(0, "\tError: Calloc Failed for chunks!!!\n");
 		return -1;
 	}
 
@@ -689,20 +1402,28 @@ int f2fs_init_sparse_file(void)
 void f2fs_release_sparse_blocks(void)
 {
 #ifdef HAVE_SPARSE_SPARSE_H
-	int j;
-
-	if (blocks != NULL) {
-		for (j = 0; j < blocks_count; j++) {
-			if (blocks[j]) {
-				free(blocks[j]);
-				blocks[j] = NULL;
-			} else {
+	uint64_t j;
+
+	if (chunks != NULL) {
+		for (j = 0; j < nr_chunks; j++) {
+			if (!chunks[j])
 				continue;
-			}
+			free(chunks[j]->data);
+			free(chunks[j]);
 		}
-		free(blocks);
-		blocks = NULL;
+		free(chunks);
+		chunks = NULL;
 	}
+
+	resident_head = resident_tail = NULL;
+	nr_resident = 0;
+	meta_known = false;
+	if (spill_fd >= 0) {
+		close(spill_fd);
+		spill_fd = -1;
+	}
+	spill_size = 0;
+	spill_failed = false;
 #endif
 }
 
@@ -716,27 +1437,18 @@ void f2fs_release_sparse_resource(void)
 		}
 
 		f2fs_release_sparse_blocks();
-
-		if (zeroed_block != NULL) {
-			free(zeroed_block);
-			zeroed_block = NULL;
-		}
 	}
 #endif
 }
 
-#define MAX_CHUNK_SIZE		(1 * 1024 * 1024 * 1024ULL)
-#define MAX_CHUNK_COUNT		(MAX_CHUNK_SIZE / F2FS_BLKSIZE)
 int f2fs_finalize_device(void)
 {
 	int i;
 	int ret = 0;
+	int wb_ret = 0;
 
 #ifdef HAVE_SPARSE_SPARSE_H
 	if (c.sparse_mode) {
-		int64_t chunk_start = (blocks[0] == NULL) ? -1 : 0;
-		uint64_t j;
-
 		if (c.func != MKFS) {
 			sparse_file_destroy(f2fs_sparse_file);
 			ret = ftruncate(c.devices[0].fd, 0);
@@ -746,47 +1458,8 @@ int f2fs_finalize_device(void)
 							c.device_size);
 		}
 
-		for (j = 0; j < blocks_count; ++j) {
-			if (chunk_start != -1) {
-				if (j - chunk_start >= MAX_CHUNK_COUNT) {
-					ret = sparse_merge_blocks(chunk_start,
-							j - chunk_start, 0);
-					ASSERT(!ret);
-					chunk_start = -1;
-				}
-			}
-
-			if (chunk_start == -1) {
-				if (!blocks[j])
-					continue;
-
-				if (blocks[j] == zeroed_block) {
-					ret = sparse_merge_blocks(j, 1, 1);
-					ASSERT(!ret);
-				} else {
-					chunk_start = j;
-				}
-			} else {
-				if (blocks[j] && blocks[j] != zeroed_block)
-					continue;
-
-				ret = sparse_merge_blocks(chunk_start,
-						j - chunk_start, 0);
-				ASSERT(!ret);
-
-				if (blocks[j] == zeroed_block) {
-					ret = sparse_merge_blocks(j, 1, 1);
-					ASSERT(!ret);
-				}
-
-				chunk_start = -1;
-			}
-		}
-		if (chunk_start != -1) {
-			ret = sparse_merge_blocks(chunk_start,
-						blocks_count - chunk_start, 0);
-			ASSERT(!ret);
-		}
+		ret = sparse_add_chunks();
+		ASSERT(!ret);
 
 		sparse_file_write(f2fs_sparse_file, c.devices[0].fd,
 				/*gzip*/0, /*sparse*/1, /*crc*/0);
@@ -794,6 +1467,11 @@ int f2fs_finalize_device(void)
 		f2fs_release_sparse_resource();
 	}
 #endif
+	if (wb_enabled) {
+		wb_ret = wb_flush();
+		wb_exit();
+	}
+
 	/*
 	 * We should call fsync() to flush out all the dirty pages
 	 * in the block device page cache.
@@ -816,5 +1494,5 @@ int f2fs_finalize_device(void)
 	}
 	close(c.kd);
 
-	return ret;
+	return ret < 0 ? ret : wb_ret;
 }
@@ -442,14 +442,41 @@ int f2fs_reset_zone(int i, void *blkzone)
 	return ret;
 }
 
+/*
+ * Reset the zones of a range with one command. If the kernel only takes
+ * one zone at a time, reset them one by one.
+ */
+static int f2fs_reset_zone_range(struct device_info *dev, uint64_t sector,
+				uint64_t nr_sectors, uint64_t zone_sectors)
+{
+	struct blk_zone_range range;
+	uint64_t end = sector + nr_sectors;
+
+	range.sector = sector;
+	range.nr_sectors = nr_sectors;
+	if (!ioctl(dev->fd, BLKRESETZONE, &range))
+		return 0;
+	if (nr_sectors <= zone_sectors)
+		return -errno;
+
+	for (; sector < end; sector += zone_sectors) {
+		range.sector = sector;
+		range.nr_sectors = min(zone_sectors, end - sector);
+		if (ioctl(dev->fd, BLKRESETZONE, &range))
+			return -errno;
+	}
+	return 0;
+}
+
 int f2fs_reset_zones(int j)
 {
 	struct device_info *dev = c.devices + j;
 	struct blk_zone_report *rep;
 	struct blk_zone *blkz;
-	struct blk_zone_range range;
 	uint64_t total_sectors;
 	uint64_t sector;
+	uint64_t run_start = 0, run_sectors = 0, zone_sectors = 0;
+	unsigned int nr_resets = 0, nr_zones = 0;
 	unsigned int i;
 	int ret = -1;
 
@@ -483,20 +510,40 @@ int f2fs_reset_zones(int j)
 		for (i = 0; i < rep->nr_zones && sector < total_sectors; i++) {
 			if (blk_zone_seq(blkz) &&
 			    !blk_zone_empty(blkz)) {
-				/* Non empty sequential zone: reset */
-				range.sector = blk_zone_sector(blkz);
-				range.nr_sectors = blk_zone_length(blkz);
-				ret = ioctl(dev->fd, BLKRESETZONE, &range);
-				if (ret != 0) {
-					ret = -errno;
-					ERR_MSG("ioctl BLKRESETZONE failed\n");
-					goto out;
+				/* Non empty sequential zone: reset with its run */
+				if (run_sectors &&
+				    run_start + run_sectors != blk_zone_sector(blkz)) {
+					ret = f2fs_reset_zone_range(dev, run_start,
+							run_sectors, zone_sectors);
+					if (ret) {
+						ERR_MSG("ioctl BLKRESETZONE failed\n");
+						goto out;
+					}
+					nr_resets++;
+					run_sectors = 0;
 				}
+				if (!run_sectors)
+					run_start = blk_zone_sector(blkz);
+				run_sectors += blk_zone_length(blkz);
+				zone_sectors = blk_zone_length(blkz);
+				nr_zones++;
 			}
 			sector = blk_zone_sector(blkz) + blk_zone_length(blkz);
 			blkz++;
 		}
 	}
+
+	if (run_sectors) {
+		ret = f2fs_reset_zone_range(dev, run_start, run_sectors,
+							zone_sectors);
+		if (ret) {
+			ERR_MSG("ioctl BLKRESETZONE failed\n");
+			goto out;
+		}
+		nr_resets++;
+	}
+	ret = 0;
+	DBG(1, "Reset %u zones with %u commands\n", nr_zones, nr_resets);
 out:
 	free(rep);
 	if (!ret)
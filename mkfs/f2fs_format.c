@@ -627,72 +627,37 @@ too_small:
 	return -1;
 }
 
-static int f2fs_init_sit_area(void)
+int f2fs_init_sit_area(void)
 {
-	uint32_t blk_size, seg_size;
-	uint32_t index = 0;
-	uint64_t sit_seg_addr = 0;
-	uint8_t *zero_buf = NULL;
+	uint64_t seg_size, sit_seg_addr;
 
-	blk_size = 1 << get_sb(log_blocksize);
-	seg_size = (1 << get_sb(log_blocks_per_seg)) * blk_size;
-
-	zero_buf = calloc(sizeof(uint8_t), seg_size);
-	if(zero_buf == NULL) {
-		MSG(1, "\tError: Calloc Failed for sit_zero_buf!!!\n");
-		return -1;
-	}
-
-	sit_seg_addr = get_sb(sit_blkaddr);
-	sit_seg_addr *= blk_size;
+	seg_size = 1ULL << (get_sb(log_blocks_per_seg) + get_sb(log_blocksize));
+	sit_seg_addr = (uint64_t)get_sb(sit_blkaddr) << get_sb(log_blocksize);
 
 	DBG(1, "\tFilling sit area at offset 0x%08"PRIx64"\n", sit_seg_addr);
-	for (index = 0; index < (get_sb(segment_count_sit) / 2); index++) {
-		if (dev_fill(zero_buf, sit_seg_addr, seg_size)) {
-			MSG(1, "\tError: While zeroing out the sit area "
-					"on disk!!!\n");
-			free(zero_buf);
-			return -1;
-		}
-		sit_seg_addr += seg_size;
+	if (f2fs_zero_extents(sit_seg_addr,
+			seg_size * (get_sb(segment_count_sit) / 2), 0, 1)) {
+		MSG(1, "\tError: While zeroing out the sit area on disk!!!\n");
+		return -1;
 	}
-
-	free(zero_buf);
-	return 0 ;
+	return 0;
 }
 
-static int f2fs_init_nat_area(void)
+int f2fs_init_nat_area(void)
 {
-	uint32_t blk_size, seg_size;
-	uint32_t index = 0;
-	uint64_t nat_seg_addr = 0;
-	uint8_t *nat_buf = NULL;
-
-	blk_size = 1 << get_sb(log_blocksize);
-	seg_size = (1 << get_sb(log_blocks_per_seg)) * blk_size;
-
-	nat_buf = calloc(sizeof(uint8_t), seg_size);
-	if (nat_buf == NULL) {
-		MSG(1, "\tError: Calloc Failed for nat_zero_blk!!!\n");
-		return -1;
-	}
+	uint64_t seg_size, nat_seg_addr;
 
-	nat_seg_addr = get_sb(nat_blkaddr);
-	nat_seg_addr *= blk_size;
+	seg_size = 1ULL << (get_sb(log_blocks_per_seg) + get_sb(log_blocksize));
+	nat_seg_addr = (uint64_t)get_sb(nat_blkaddr) << get_sb(log_blocksize);
 
+	/* the first copy of each pair of segments */
 	DBG(1, "\tFilling nat area at offset 0x%08"PRIx64"\n", nat_seg_addr);
-	for (index = 0; index < get_sb(segment_count_nat) / 2; index++) {
-		if (dev_fill(nat_buf, nat_seg_addr, seg_size)) {
-			MSG(1, "\tError: While zeroing out the nat area "
-					"on disk!!!\n");
-			free(nat_buf);
-			return -1;
-		}
-		nat_seg_addr = nat_seg_addr + (2 * seg_size);
+	if (f2fs_zero_extents(nat_seg_addr, seg_size, 2 * seg_size,
+					get_sb(segment_count_nat) / 2)) {
+		MSG(1, "\tError: While zeroing out the nat area on disk!!!\n");
+		return -1;
 	}
-
-	free(nat_buf);
-	return 0 ;
+	return 0;
 }
 
 static int f2fs_write_check_point_pack(void)
@@ -833,7 +798,7 @@ static int f2fs_write_check_point_pack(void)
 
 	for (i = 0; i < get_sb(cp_payload); i++) {
 		cp_seg_blk++;
-		if (dev_fill_block(cp_payload, cp_seg_blk)) {
+		if (dev_write_block(cp_payload, cp_seg_blk)) {
 			MSG(1, "\tError: While zeroing out the sit bitmap area "
 					"on disk!!!\n");
 			goto free_cp_payload;
@@ -1063,7 +1028,7 @@ static int f2fs_write_check_point_pack(void)
 
 	for (i = 0; i < get_sb(cp_payload); i++) {
 		cp_seg_blk++;
-		if (dev_fill_block(cp_payload, cp_seg_blk)) {
+		if (dev_write_block(cp_payload, cp_seg_blk)) {
 			MSG(1, "\tError: While zeroing out the sit bitmap area "
 					"on disk!!!\n");
 			goto free_cp_payload;
@@ -1235,7 +1200,7 @@ static int f2fs_write_root_inode(void)
 	if (c.feature & cpu_to_le32(F2FS_FEATURE_COMPRESSION)) {
 		raw_node->i.i_compress_algrithm = 0;
 		raw_node->i.i_log_cluster_size = 0;
-		raw_node->i.i_padding = 0;
+		raw_node->i.i_compress_flag = 0;
 	}
 
 	if (c.feature & cpu_to_le32(F2FS_FEATURE_DEDUP)) {
@@ -1563,7 +1528,7 @@ static int f2fs_write_lpf_inode(void)
 	if (c.feature & cpu_to_le32(F2FS_FEATURE_COMPRESSION)) {
 		raw_node->i.i_compress_algrithm = 0;
 		raw_node->i.i_log_cluster_size = 0;
-		raw_node->i.i_padding = 0;
+		raw_node->i.i_compress_flag = 0;
 	}
 
 	if (c.feature & cpu_to_le32(F2FS_FEATURE_DEDUP)) {
@@ -1717,8 +1682,13 @@ exit:
 
 int f2fs_format_device(void)
 {
+	unsigned long long total_size;
 	int err = 0;
 
+	total_size = (c.total_sectors * c.sector_size) >> F2FS_GB_SHIFT;
+	if (total_size > F2FS_LARGE_NAT_BITMAP_MIN_SIZE)
+		c.large_nat_bitmap = 1;
+
 	err= f2fs_prepare_super_block();
 	if (err < 0) {
 		MSG(0, "\tError: Failed to prepare a super block!!!\n");
@@ -1745,6 +1715,12 @@ int f2fs_format_device(void)
 		goto exit;
 	}
 
+	/*
+	 * The rest is a few hundred scattered blocks: keep them, and write
+	 * them out sorted in f2fs_finalize_device().
+	 */
+	dev_wb_init();
+
 	err = f2fs_create_root_dir();
 	if (err < 0) {
 		MSG(0, "\tError: Failed to create the root directory!!!\n");
@@ -1762,6 +1738,12 @@ int f2fs_format_device(void)
 		MSG(0, "\tError: Failed to write the super block!!!\n");
 		goto exit;
 	}
+
+	if (c.save_template) {
+		err = f2fs_save_template();
+		if (err < 0)
+			goto exit;
+	}
 exit:
 	if (err)
 		MSG(0, "\tError: Could not format the device!!!\n");
@@ -75,6 +75,8 @@ static void mkfs_usage()
 	MSG(0, "  -t 0: nodiscard, 1: discard [default:1]\n");
 	MSG(0, "  -T timestamps\n");
 	MSG(0, "  -w wanted sector size\n");
+	MSG(0, "  -x save a format template to file\n");
+	MSG(0, "  -X format from a template saved by -x\n");
 	MSG(0, "  -z # of sections per zone [default:1]\n");
 	MSG(0, "  -V print the version number and exit\n");
 	MSG(0, "sectors: number of sectors [default: determined by device size]\n");
@@ -181,7 +183,7 @@ static void add_default_options(void)
 
 static void f2fs_parse_options(int argc, char *argv[])
 {
-	static const char *option_string = "qa:c:C:d:e:E:g:hil:mo:O:rR:s:S:z:t:T:U:Vfw:";
+	static const char *option_string = "qa:c:C:d:e:E:g:hil:mo:O:rR:s:S:z:t:T:U:Vfw:x:X:";
 	static const struct option long_opts[] = {
 		{ .name = "help", .has_arg = 0, .flag = NULL, .val = 'h' },
 		{ .name = NULL, .has_arg = 0, .flag = NULL, .val = 0 }
@@ -281,6 +283,12 @@ static void f2fs_parse_options(int argc, char *argv[])
 		case 'w':
 			c.wanted_sector_size = atoi(optarg);
 			break;
+		case 'x':
+			c.save_template = strdup(optarg);
+			break;
+		case 'X':
+			c.load_template = strdup(optarg);
+			break;
 		case 'V':
 			show_version("mkfs.f2fs");
 			exit(0);
@@ -361,6 +369,11 @@ static void f2fs_parse_options(int argc, char *argv[])
 	if (c.sparse_mode)
 		c.trim = 0;
 
+	if (c.save_template && c.load_template) {
+		MSG(0, "\tError: -x and -X are exclusive\n");
+		mkfs_usage();
+	}
+
 	if (c.zoned_mode)
 		c.feature |= cpu_to_le32(F2FS_FEATURE_BLKZONED);
 }
@@ -457,11 +470,6 @@ int main(int argc, char *argv[])
 	if (f2fs_get_device_info() < 0)
 		return -1;
 
-	unsigned long long total_size = (c.total_sectors * c.sector_size) >> F2FS_GB_SHIFT;
-	if (total_size > F2FS_LARGE_NAT_BITMAP_MIN_SIZE) {
-		c.large_nat_bitmap = 1;
-	}
-
 	if (f2fs_check_overwrite()) {
 		char *zero_buf = NULL;
 		int i;
@@ -505,8 +513,12 @@ int main(int argc, char *argv[])
 		goto err_format;
 	}
 
-	if (f2fs_format_device() < 0)
+	if (c.load_template) {
+		if (f2fs_format_from_template() < 0)
+			goto err_format;
+	} else if (f2fs_format_device() < 0) {
 		goto err_format;
+	}
 
 	if (f2fs_finalize_device() < 0)
 		goto err_format;
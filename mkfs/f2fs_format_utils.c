@@ -30,7 +30,12 @@
 #include <sys/ioctl.h>
 #endif
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #ifdef HAVE_LINUX_FS_H
 #include <linux/fs.h>
@@ -46,8 +51,17 @@
 #ifndef BLKSECDISCARD
 #define BLKSECDISCARD	_IO(0x12,125)
 #endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES	_IO(0x12,124)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT	_IO(0x12,127)
+#endif
 #endif
 
+/* bytes from the start of each device known to read as zeroes */
+static uint64_t zeroed_bytes[MAX_DEVICES];
+
 #if defined(FALLOC_FL_PUNCH_HOLE) || defined(BLKDISCARD) || \
 	defined(BLKSECDISCARD)
 static int trim_device(int i)
@@ -80,6 +94,8 @@ static int trim_device(int i)
 		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
 				range[0], range[1]) < 0) {
 			MSG(0, "Info: fallocate(PUNCH_HOLE|KEEP_SIZE) is failed\n");
+		} else {
+			zeroed_bytes[i] = bytes;
 		}
 #endif
 		free(stat_buf);
@@ -102,7 +118,11 @@ static int trim_device(int i)
 		if (ioctl(fd, BLKDISCARD, &range) < 0) {
 			MSG(0, "Info: This device doesn't support BLKDISCARD\n");
 		} else {
+			unsigned int zeroes = 0;
+
 			MSG(0, "Info: Discarded %llu MB\n", range[1] >> 20);
+			if (!ioctl(fd, BLKDISCARDZEROES, &zeroes) && zeroes)
+				zeroed_bytes[i] = bytes;
 		}
 	} else {
 		free(stat_buf);
@@ -162,8 +182,10 @@ static bool is_wiped_device(int i)
 	free(zero_buf);
 	free(buf);
 
-	if (wiped)
+	if (wiped) {
 		MSG(0, "Info: Found all zeros in first %d blocks\n", nblocks);
+		zeroed_bytes[i] = (uint64_t)nblocks * F2FS_BLKSIZE;
+	}
 	return wiped;
 }
 #else
@@ -173,14 +195,251 @@ static bool is_wiped_device(int UNUSED(i))
 }
 #endif
 
+struct trim_job {
+	int dev;
+	int ret;
+	uint64_t msecs;
+};
+
+static void *trim_worker(void *arg)
+{
+	struct trim_job *job = arg;
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	job->ret = 0;
+	if (!is_wiped_device(job->dev))
+		job->ret = trim_device(job->dev);
+	gettimeofday(&end, NULL);
+
+	job->msecs = (end.tv_sec - start.tv_sec) * 1000 +
+				(end.tv_usec - start.tv_usec) / 1000;
+	return NULL;
+}
+
+/* trim the devices, or reset their zones, all at once */
 int f2fs_trim_devices(void)
 {
-	int i;
+	struct trim_job jobs[MAX_DEVICES];
+#ifndef _WIN32
+	pthread_t threads[MAX_DEVICES];
+	bool started[MAX_DEVICES] = { false };
+#endif
+	int i, ret = 0;
+
+	for (i = 0; i < c.ndevs; i++) {
+		jobs[i].dev = i;
+#ifndef _WIN32
+		if (c.ndevs > 1 && !pthread_create(&threads[i], NULL,
+						trim_worker, jobs + i)) {
+			started[i] = true;
+			continue;
+		}
+#endif
+		trim_worker(jobs + i);
+	}
 
 	for (i = 0; i < c.ndevs; i++) {
-		if (!is_wiped_device(i) && trim_device(i))
-			return -1;
+#ifndef _WIN32
+		if (started[i])
+			pthread_join(threads[i], NULL);
+#endif
+		MSG(0, "Info: [%s] Trimmed in %"PRIu64" ms\n",
+				c.devices[i].path, jobs[i].msecs);
+		if (jobs[i].ret)
+			ret = -1;
 	}
+	if (ret)
+		return ret;
+
 	c.trimmed = 1;
 	return 0;
 }
+
+/*
+ * Zeroing of the metadata areas: ranges the device reads as zeroes after
+ * the trim are skipped, the rest is zeroed by the device if it can
+ * (BLKZEROOUT, FALLOC_FL_ZERO_RANGE), or by ZERO_MAX_THREADS writers of
+ * ZERO_IO_SIZE bytes each.
+ */
+#define ZERO_IO_SIZE		(8 << 20)
+#define ZERO_MAX_THREADS	8
+
+struct zero_ctx {
+	int fd;
+	uint64_t start, len, stride;	/* @count extents of @len bytes */
+	unsigned int count;
+	uint64_t next;			/* next byte to write, all extents */
+	void *buf;
+	int err;
+#ifndef _WIN32
+	pthread_mutex_t lock;
+#endif
+};
+
+static int zero_by_device(int fd, uint64_t offset, uint64_t len)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+#if defined(__linux__) && defined(BLKZEROOUT)
+	if (S_ISBLK(st.st_mode)) {
+		uint64_t range[2] = { offset, len };
+
+		return ioctl(fd, BLKZEROOUT, &range);
+	}
+#endif
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_ZERO_RANGE)
+	if (S_ISREG(st.st_mode))
+		return fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+								offset, len);
+#endif
+	return -1;
+}
+
+/* take the next piece to write, within one extent */
+static bool zero_next(struct zero_ctx *zc, uint64_t *offset, size_t *len)
+{
+	uint64_t ext, ofs;
+	bool found = false;
+
+#ifndef _WIN32
+	pthread_mutex_lock(&zc->lock);
+#endif
+	ext = zc->next / zc->len;
+	ofs = zc->next % zc->len;
+	if (ext < zc->count && !zc->err) {
+		*offset = zc->start + ext * zc->stride + ofs;
+		*len = min(zc->len - ofs, (uint64_t)ZERO_IO_SIZE);
+		zc->next += *len;
+		found = true;
+	}
+#ifndef _WIN32
+	pthread_mutex_unlock(&zc->lock);
+#endif
+	return found;
+}
+
+static void *zero_worker(void *arg)
+{
+	struct zero_ctx *zc = arg;
+	uint64_t offset;
+	size_t len;
+
+	while (zero_next(zc, &offset, &len)) {
+		if (pwrite64(zc->fd, zc->buf, len, offset) == (ssize_t)len)
+			continue;
+#ifndef _WIN32
+		pthread_mutex_lock(&zc->lock);
+#endif
+		zc->err = -1;
+#ifndef _WIN32
+		pthread_mutex_unlock(&zc->lock);
+#endif
+	}
+	return NULL;
+}
+
+static int zero_by_writes(struct zero_ctx *zc)
+{
+#ifndef _WIN32
+	pthread_t threads[ZERO_MAX_THREADS];
+	uint64_t total = zc->len * zc->count;
+	int nr_threads, i;
+#endif
+
+	zc->buf = calloc(1, min(zc->len, (uint64_t)ZERO_IO_SIZE));
+	if (!zc->buf) {
+		MSG(1, "\tError: Calloc Failed for zero_buf!!!\n");
+		return -1;
+	}
+
+#ifndef _WIN32
+	nr_threads = min(total / ZERO_IO_SIZE, (uint64_t)ZERO_MAX_THREADS);
+	pthread_mutex_init(&zc->lock, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, zero_worker, zc))
+			break;
+	}
+	nr_threads = i;
+#endif
+	/* the caller writes too, so no thread is needed for small areas */
+	zero_worker(zc);
+#ifndef _WIN32
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&zc->lock);
+#endif
+	free(zc->buf);
+	return zc->err;
+}
+
+/*
+ * Zero @count extents of @len bytes, @stride bytes apart, from byte @start
+ * of the volume. They must lie on the first device, with the rest of the
+ * metadata.
+ */
+int f2fs_zero_extents(uint64_t start, uint64_t len, uint64_t stride,
+							unsigned int count)
+{
+	struct zero_ctx zc = {
+		.fd = c.devices[0].fd,
+		.start = start,
+		.len = len,
+		.stride = stride,
+		.count = count,
+	};
+	uint64_t skip;
+	unsigned int i;
+	int ret;
+
+	if (!count || !len)
+		return 0;
+
+	ASSERT(start + (count - 1) * stride + len <=
+			(c.devices[0].end_blkaddr + 1) << F2FS_BLKSIZE_BITS);
+
+	if (c.sparse_mode) {
+		char zero_blk[F2FS_BLKSIZE] = { 0 };
+
+		/* only marks the blocks, @zero_blk is not read */
+		for (i = 0; i < count; i++)
+			if (dev_fill(zero_blk, start + i * stride, len))
+				return -1;
+		return 0;
+	}
+
+	/* drop the extents, then the head of the one, known to be zero */
+	while (zc.count && zc.start + zc.len <= zeroed_bytes[0]) {
+		zc.start += zc.stride;
+		zc.count--;
+	}
+	if (!zc.count) {
+		DBG(1, "\tSkip zeroing known zero bytes 0x%08"PRIx64"\n", start);
+		goto out;
+	}
+	if (zc.count == 1 && zc.start < zeroed_bytes[0]) {
+		skip = zeroed_bytes[0] - zc.start;
+		zc.start += skip;
+		zc.len -= skip;
+	}
+
+	for (i = 0; i < zc.count; i++) {
+		if (zero_by_device(zc.fd, zc.start + i * zc.stride, zc.len))
+			break;
+	}
+	if (i < zc.count) {
+		/* the device cannot, write the rest */
+		zc.start += i * zc.stride;
+		zc.count -= i;
+		ret = zero_by_writes(&zc);
+		if (ret)
+			return ret;
+	}
+out:
+	/* a mount in this process reads them back without I/O */
+	dev_mark_zeroed(start, len, stride, count);
+	return 0;
+}
@@ -16,4 +16,9 @@ extern struct f2fs_configuration c;
 
 int f2fs_trim_device(int, uint64_t);
 int f2fs_trim_devices(void);
+int f2fs_zero_extents(uint64_t, uint64_t, uint64_t, unsigned int);
 int f2fs_format_device(void);
+int f2fs_init_sit_area(void);
+int f2fs_init_nat_area(void);
+int f2fs_save_template(void);
+int f2fs_format_from_template(void);
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2026. All rights reserved.
+ *
+ * f2fs_template.c
+ *
+ * Format templates for provisioning many devices of the same size. With
+ * -x, mkfs saves what it writes past the SIT and NAT areas: the
+ * superblocks, checkpoint packs, NAT, inodes and dentries, and the few
+ * blocks it zeroes. With -X, mkfs replays such a template on a device of
+ * the same geometry: it trims and zeroes the SIT and NAT areas as a
+ * format does, then writes the saved blocks in a few runs, with a new
+ * UUID and the inode times of this run.
+ *
+ * Dual licensed under the GPL or LGPL version 2 licenses.
+ */
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <f2fs_fs.h>
+
+#ifdef HAVE_UUID_UUID_H
+#include <uuid/uuid.h>
+#endif
+#ifndef HAVE_LIBUUID
+#define uuid_parse(a, b) -1
+#define uuid_generate(a)
+#endif
+
+#include "f2fs_format_utils.h"
+
+extern struct f2fs_super_block *sb;
+
+#define F2FS_TEMPLATE_MAGIC	0x504d5446	/* "FTMP" */
+#define F2FS_TEMPLATE_VERSION	1
+
+#define TEMPLATE_TRIMMED	0x1		/* the device was trimmed */
+
+struct f2fs_template_header {
+	__le32 magic;
+	__le32 version;
+	__le64 total_sectors;		/* formatted size, in sectors */
+	__le32 sector_size;
+	__le32 flags;
+	__le32 nr_runs;
+	__le32 reserved;
+} __attribute__((packed));
+
+enum {
+	TEMPLATE_DATA,			/* written as is */
+	TEMPLATE_ZERO,			/* zeroed, no data in the template */
+	TEMPLATE_SUPER,			/* superblock, gets the UUID */
+	TEMPLATE_INODE,			/* inode, gets the times */
+};
+
+/* consecutive blocks of one kind, followed by their data if any */
+struct f2fs_template_run {
+	__le64 blkaddr;
+	__le32 nr_blocks;
+	__le32 type;
+} __attribute__((packed));
+
+struct template_run {
+	uint64_t blkaddr;
+	uint32_t nr_blocks;
+	uint32_t type;
+	char *data;			/* NULL for TEMPLATE_ZERO */
+};
+
+struct template {
+	struct template_run *runs;
+	uint32_t nr_runs, max_runs;
+	struct f2fs_template_header hdr;
+};
+
+static bool is_zero_block(const char *buf)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, F2FS_BLKSIZE - 1);
+}
+
+/* mkfs puts all its inodes in the current hot node segment */
+static bool is_inode_block(uint64_t blkaddr, struct f2fs_node *node)
+{
+	uint64_t start = get_sb(main_blkaddr) +
+			(uint64_t)c.cur_seg[CURSEG_HOT_NODE] * c.blks_per_seg;
+
+	if (blkaddr < start || blkaddr >= start + c.blks_per_seg)
+		return false;
+	return node->footer.nid == node->footer.ino &&
+		!(le32_to_cpu(node->footer.flag) >> OFFSET_BIT_SHIFT);
+}
+
+static void template_free(struct template *tp)
+{
+	uint32_t i;
+
+	for (i = 0; i < tp->nr_runs; i++)
+		free(tp->runs[i].data);
+	free(tp->runs);
+}
+
+static int template_add(void *priv, __u64 blkaddr, void *buf)
+{
+	struct template *tp = priv;
+	struct template_run *run = NULL;
+	uint32_t type = TEMPLATE_DATA;
+
+	if (blkaddr < 2)
+		type = TEMPLATE_SUPER;
+	else if (is_zero_block(buf))
+		type = TEMPLATE_ZERO;
+	else if (is_inode_block(blkaddr, buf))
+		type = TEMPLATE_INODE;
+
+	if (tp->nr_runs)
+		run = tp->runs + tp->nr_runs - 1;
+	if (!run || run->type != type ||
+			run->blkaddr + run->nr_blocks != blkaddr) {
+		if (tp->nr_runs == tp->max_runs) {
+			tp->max_runs = tp->max_runs ? tp->max_runs * 2 : 64;
+			run = realloc(tp->runs,
+					tp->max_runs * sizeof(*tp->runs));
+			if (!run)
+				return -ENOMEM;
+			tp->runs = run;
+		}
+		run = tp->runs + tp->nr_runs++;
+		run->blkaddr = blkaddr;
+		run->nr_blocks = 0;
+		run->type = type;
+		run->data = NULL;
+	}
+
+	if (type != TEMPLATE_ZERO) {
+		char *data = realloc(run->data,
+				(size_t)(run->nr_blocks + 1) * F2FS_BLKSIZE);
+
+		if (!data)
+			return -ENOMEM;
+		memcpy(data + (size_t)run->nr_blocks * F2FS_BLKSIZE, buf,
+							F2FS_BLKSIZE);
+		run->data = data;
+	}
+	run->nr_blocks++;
+	return 0;
+}
+
+/*
+ * Save the blocks kept for f2fs_finalize_device() to c.save_template.
+ * Called once the whole layout is written.
+ */
+int f2fs_save_template(void)
+{
+	struct template tp = { 0 };
+	struct f2fs_template_run raw;
+	uint64_t nr_blocks = 0;
+	FILE *fp = NULL;
+	uint32_t i;
+	int ret;
+
+	if (c.ndevs > 1 || c.sparse_mode || c.zoned_mode) {
+		MSG(0, "\tError: Templates need a single regular device\n");
+		return -1;
+	}
+
+	ret = dev_wb_walk(template_add, &tp);
+	if (ret) {
+		MSG(0, "\tError: Could not collect the template blocks\n");
+		goto out;
+	}
+
+	tp.hdr.magic = cpu_to_le32(F2FS_TEMPLATE_MAGIC);
+	tp.hdr.version = cpu_to_le32(F2FS_TEMPLATE_VERSION);
+	tp.hdr.total_sectors = cpu_to_le64(c.total_sectors);
+	tp.hdr.sector_size = cpu_to_le32(c.sector_size);
+	tp.hdr.flags = cpu_to_le32(c.trimmed ? TEMPLATE_TRIMMED : 0);
+	tp.hdr.nr_runs = cpu_to_le32(tp.nr_runs);
+
+	ret = -1;
+	fp = fopen(c.save_template, "wb");
+	if (!fp) {
+		MSG(0, "\tError: Failed to create %s\n", c.save_template);
+		goto out;
+	}
+	if (fwrite(&tp.hdr, sizeof(tp.hdr), 1, fp) != 1)
+		goto write_fail;
+	for (i = 0; i < tp.nr_runs; i++) {
+		raw.blkaddr = cpu_to_le64(tp.runs[i].blkaddr);
+		raw.nr_blocks = cpu_to_le32(tp.runs[i].nr_blocks);
+		raw.type = cpu_to_le32(tp.runs[i].type);
+		if (fwrite(&raw, sizeof(raw), 1, fp) != 1)
+			goto write_fail;
+	}
+	for (i = 0; i < tp.nr_runs; i++) {
+		if (!tp.runs[i].data)
+			continue;
+		if (fwrite(tp.runs[i].data, F2FS_BLKSIZE,
+				tp.runs[i].nr_blocks, fp) !=
+						tp.runs[i].nr_blocks)
+			goto write_fail;
+		nr_blocks += tp.runs[i].nr_blocks;
+	}
+	if (fclose(fp)) {
+		fp = NULL;
+		goto write_fail;
+	}
+	fp = NULL;
+
+	MSG(0, "Info: Saved %"PRIu64" blocks in %u runs to %s\n",
+				nr_blocks, tp.nr_runs, c.save_template);
+	ret = 0;
+	goto out;
+write_fail:
+	MSG(0, "\tError: Failed to write %s\n", c.save_template);
+out:
+	if (fp)
+		fclose(fp);
+	template_free(&tp);
+	return ret;
+}
+
+static int template_load(struct template *tp)
+{
+	struct f2fs_template_run raw;
+	FILE *fp;
+	uint32_t i;
+	int ret = -1;
+
+	fp = fopen(c.load_template, "rb");
+	if (!fp) {
+		MSG(0, "\tError: Failed to open %s\n", c.load_template);
+		return -1;
+	}
+
+	if (fread(&tp->hdr, sizeof(tp->hdr), 1, fp) != 1 ||
+			le32_to_cpu(tp->hdr.magic) != F2FS_TEMPLATE_MAGIC ||
+			le32_to_cpu(tp->hdr.version) != F2FS_TEMPLATE_VERSION) {
+		MSG(0, "\tError: %s is not a format template\n",
+							c.load_template);
+		goto out;
+	}
+
+	tp->nr_runs = le32_to_cpu(tp->hdr.nr_runs);
+	tp->runs = calloc(tp->nr_runs, sizeof(*tp->runs));
+	if (!tp->runs)
+		goto out;
+
+	for (i = 0; i < tp->nr_runs; i++) {
+		if (fread(&raw, sizeof(raw), 1, fp) != 1)
+			goto bad;
+		tp->runs[i].blkaddr = le64_to_cpu(raw.blkaddr);
+		tp->runs[i].nr_blocks = le32_to_cpu(raw.nr_blocks);
+		tp->runs[i].type = le32_to_cpu(raw.type);
+		if (tp->runs[i].type > TEMPLATE_INODE)
+			goto bad;
+	}
+	for (i = 0; i < tp->nr_runs; i++) {
+		struct template_run *run = tp->runs + i;
+
+		if (run->type == TEMPLATE_ZERO)
+			continue;
+		run->data = malloc((size_t)run->nr_blocks * F2FS_BLKSIZE);
+		if (!run->data)
+			goto out;
+		if (fread(run->data, F2FS_BLKSIZE, run->nr_blocks, fp) !=
+							run->nr_blocks)
+			goto bad;
+	}
+
+	/* the superblock comes first */
+	if (!tp->nr_runs || tp->runs[0].type != TEMPLATE_SUPER ||
+						tp->runs[0].blkaddr)
+		goto bad;
+	memcpy(sb, tp->runs[0].data + F2FS_SUPER_OFFSET, sizeof(*sb));
+	if (get_sb(magic) != F2FS_SUPER_MAGIC)
+		goto bad;
+	ret = 0;
+	goto out;
+bad:
+	MSG(0, "\tError: %s is corrupted\n", c.load_template);
+out:
+	fclose(fp);
+	return ret;
+}
+
+/* give the template the UUID and the times of this format */
+static int template_patch(struct template *tp)
+{
+	time_t now = (c.fixed_time == -1) ? time(NULL) : c.fixed_time;
+	struct f2fs_super_block *raw_sb;
+	struct f2fs_node *node;
+	uint32_t i, j;
+
+	if (c.vol_uuid) {
+		if (uuid_parse(c.vol_uuid, sb->uuid)) {
+			MSG(0, "\tError: supplied string is not a valid UUID\n");
+			return -1;
+		}
+	} else {
+		uuid_generate(sb->uuid);
+	}
+	if (get_sb(feature) & F2FS_FEATURE_SB_CHKSUM)
+		set_sb(crc, f2fs_cal_crc32(F2FS_SUPER_MAGIC, sb,
+						SB_CHKSUM_OFFSET));
+
+	c.feature = sb->feature;
+	if (c.feature & cpu_to_le32(F2FS_FEATURE_INODE_CHKSUM))
+		c.chksum_seed = f2fs_cal_crc32(~0, sb->uuid,
+						sizeof(sb->uuid));
+
+	for (i = 0; i < tp->nr_runs; i++) {
+		struct template_run *run = tp->runs + i;
+
+		for (j = 0; j < run->nr_blocks; j++) {
+			char *buf = run->data + (size_t)j * F2FS_BLKSIZE;
+
+			if (run->type == TEMPLATE_SUPER) {
+				raw_sb = (struct f2fs_super_block *)
+						(buf + F2FS_SUPER_OFFSET);
+				if (le32_to_cpu(raw_sb->magic) ==
+							F2FS_SUPER_MAGIC)
+					memcpy(raw_sb, sb, sizeof(*sb));
+				continue;
+			}
+			if (run->type != TEMPLATE_INODE)
+				continue;
+
+			node = (struct f2fs_node *)buf;
+			if (c.feature &
+				cpu_to_le32(F2FS_FEATURE_INODE_CRTIME) &&
+					node->i.i_crtime == node->i.i_mtime)
+				node->i.i_crtime = cpu_to_le32(now);
+			node->i.i_atime = cpu_to_le32(now);
+			node->i.i_ctime = cpu_to_le32(now);
+			node->i.i_mtime = cpu_to_le32(now);
+			if (c.feature & cpu_to_le32(F2FS_FEATURE_INODE_CHKSUM))
+				node->i.i_inode_checksum =
+					cpu_to_le32(f2fs_inode_chksum(node));
+		}
+	}
+	return 0;
+}
+
+static int template_write_run(struct template_run *run)
+{
+	uint64_t offset = run->blkaddr << F2FS_BLKSIZE_BITS;
+	uint64_t len = (uint64_t)run->nr_blocks << F2FS_BLKSIZE_BITS;
+
+	if (run->type == TEMPLATE_ZERO)
+		return f2fs_zero_extents(offset, len, 0, 1);
+	return dev_write(run->data, offset, len);
+}
+
+/*
+ * Format the device from c.load_template instead of laying it out. The
+ * device must have the size the template was made for.
+ */
+int f2fs_format_from_template(void)
+{
+	struct template tp = { 0 };
+	uint32_t i;
+	int ret = -1;
+
+	if (c.ndevs > 1 || c.sparse_mode || c.zoned_mode ||
+				c.zoned_model != F2FS_ZONED_NONE) {
+		MSG(0, "\tError: Templates need a single regular device\n");
+		return -1;
+	}
+
+	if (template_load(&tp))
+		goto out;
+
+	if (le64_to_cpu(tp.hdr.total_sectors) != c.total_sectors ||
+			le32_to_cpu(tp.hdr.sector_size) != c.sector_size) {
+		MSG(0, "\tError: %s is for %"PRIu64" sectors of %u bytes, "
+			"not %"PRIu64" of %u\n", c.load_template,
+			le64_to_cpu(tp.hdr.total_sectors),
+			le32_to_cpu(tp.hdr.sector_size),
+			c.total_sectors, c.sector_size);
+		goto out;
+	}
+
+	/* what f2fs_prepare_super_block() sets up for the device */
+	c.blks_per_seg = 1 << get_sb(log_blocks_per_seg);
+	c.devices[0].start_blkaddr = 0;
+	c.devices[0].end_blkaddr = get_sb(segment0_blkaddr) +
+			(uint64_t)get_sb(segment_count) * c.blks_per_seg - 1;
+
+	if (template_patch(&tp))
+		goto out;
+
+	/* the checkpoint says whether the device was trimmed */
+	if (le32_to_cpu(tp.hdr.flags) & TEMPLATE_TRIMMED) {
+		if (f2fs_trim_devices()) {
+			MSG(0, "\tError: Failed to trim whole device!!!\n");
+			goto out;
+		}
+	}
+
+	if (f2fs_init_sit_area() || f2fs_init_nat_area())
+		goto out;
+
+	/* the superblock last, once the rest is in place */
+	for (i = 1; i <= tp.nr_runs; i++) {
+		if (template_write_run(tp.runs + i % tp.nr_runs)) {
+			MSG(0, "\tError: While writing the template blocks\n");
+			goto out;
+		}
+	}
+
+	MSG(0, "Info: Formatted from %s in %u writes\n",
+					c.load_template, tp.nr_runs);
+	ret = 0;
+out:
+	template_free(&tp);
+	if (ret)
+		MSG(0, "\tError: Could not format the device!!!\n");
+	return ret;
+}
@@ -0,0 +1,126 @@
+#!/bin/bash
+#
+# Run defrag.f2fs on a device whose last checkpoint leaves fsync'd data
+# waiting for roll-forward recovery, then check that recovery still brings
+# back every file.
+#
+# On a host-managed zoned device the tools keep such blocks allocated in the
+# checkpoint bitmap, so defrag runs and must not reuse them. Other devices
+# must refuse the image and leave it untouched until the kernel replays
+# the log.
+#
+# usage: defrag_fsync_test.sh [dev] (the device is erased)
+
+DEV=${1:-/dev/sdb1}
+MNT=/mnt/f2fs
+TMP=/tmp/res
+SUM=/tmp/defrag_fsync.md5
+
+mkdir $MNT 2>/dev/null
+umount $MNT 2>/dev/null
+
+_check_out()
+{
+	if [ $1 -ne 0 ]; then
+		grep ASSERT $TMP
+		echo FAIL RETURN $1
+		exit 1
+	fi
+}
+
+_fail()
+{
+	echo FAIL: $1
+	exit 1
+}
+
+_is_hmzoned()
+{
+	[ "`cat /sys/block/$(basename $DEV)/queue/zoned 2>/dev/null`" = \
+							"host-managed" ]
+}
+
+_mkfs()
+{
+	echo "========== mkfs.f2fs ==================="
+	if _is_hmzoned; then
+		mkfs.f2fs -f -m $DEV >$TMP 2>&1
+	else
+		mkfs.f2fs -f $DEV >$TMP 2>&1
+	fi
+	_check_out $?
+}
+
+_mount()
+{
+	echo "========== mount ======================="
+	mount -t f2fs $DEV $MNT 2>&1
+	_check_out $?
+}
+
+_fsck()
+{
+	echo "========== fsck.f2fs ==================="
+	fsck.f2fs -f $DEV </dev/null >$TMP 2>&1
+	_check_out $?
+	grep -q "\[FAIL\]" $TMP && _fail "fsck found corruption"
+}
+
+_defrag()
+{
+	echo "========== defrag.f2fs ================="
+	# move the first 128MB of main area right behind itself
+	defrag.f2fs -s 0 -l 0x8000 $DEV >$TMP 2>&1
+}
+
+# checkpointed files first, then fsync'd ones shut down without a checkpoint
+_fill()
+{
+	echo "========== write and shutdown =========="
+	for i in `seq 1 64`; do
+		dd if=/dev/urandom of=$MNT/cp_$i bs=4k count=$((i * 8)) \
+							2>/dev/null || exit 1
+	done
+	sync
+	for i in `seq 1 32`; do
+		dd if=/dev/urandom of=$MNT/fsync_$i bs=4k count=$((i * 4)) \
+					conv=fsync 2>/dev/null || exit 1
+	done
+	(cd $MNT && md5sum cp_* fsync_*) > $SUM
+	f2fs_io shutdown 2 $MNT >/dev/null || _fail "shutdown"
+	umount $MNT
+}
+
+_verify()
+{
+	echo "========== verify ======================"
+	(cd $MNT && md5sum --quiet -c $SUM) || _fail "data mismatch"
+}
+
+_mkfs
+_mount
+_fill
+
+if _is_hmzoned; then
+	_defrag
+	_check_out $?
+else
+	before=`md5sum < $DEV`
+	_defrag && _fail "defrag ran on an unclean image"
+	[ "`md5sum < $DEV`" = "$before" ] || _fail "unclean image changed"
+fi
+
+# roll-forward recovery replays the fsync'd files
+_mount
+_verify
+umount $MNT
+_fsck
+
+_defrag
+_check_out $?
+_fsck
+_mount
+_verify
+umount $MNT
+
+echo PASS